@@ -0,0 +1,738 @@
+#include <assert.h>
+#include <inttypes.h>
+
+#include "compiler.h"
+#include "dynarr.h"
+
+/*
+ * Compiles a whole program to x86-64 assembly for the GNU assembler.
+ * Link the output with runtime.c to get an executable.
+ *
+ * Arguments are pushed on the stack in order, so the first argument is
+ * farthest away from the return address, and the caller pops them
+ * after the call.  Results are returned in RAX.  Expressions are
+ * evaluated into RAX, using RCX and the stack for temporaries.
+ *
+ * Function arguments and let and loop bindings are variables, which
+ * are assigned to registers with a linear scan allocator.  Each
+ * variable's live interval runs from its definition to its last use,
+ * in the order the code is generated, and is extended to the end of
+ * every loop it is used in but defined outside of.  Variables live
+ * across a call only get callee-saved registers, the others can also
+ * use caller-saved ones.  When there are not enough registers, the
+ * variable with the lowest weight (uses, multiplied by 8 for each loop
+ * the use is in) is spilled to the stack.
+ */
+
+typedef enum {
+	REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15,
+	REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10, REG_R11,
+	NUM_REGS,
+	NUM_CALLEE_SAVED = REG_RSI
+} asm_reg_t;
+
+static const char *reg_names[NUM_REGS] = {
+	"%rbx", "%r12", "%r13", "%r14", "%r15",
+	"%rsi", "%rdi", "%r8", "%r9", "%r10", "%r11"
+};
+
+typedef struct
+{
+	int32_t symbol;
+	int start;
+	int end;
+	int weight;
+	bool crosses_call;
+	int reg;		// -1 if the variable lives on the stack
+	int32_t disp;		// RBP offset if it does
+} asm_var_t;
+
+typedef struct _asm_scope_t
+{
+	asm_var_t *var;
+	struct _asm_scope_t *next;
+} asm_scope_t;
+
+typedef struct
+{
+	int n;
+	asm_var_t **vars;
+	int start;		// position of the loop start
+	dynarr_t used;		// variables used in the loop
+	int label;
+} asm_loop_t;
+
+typedef struct
+{
+	context_t *ctx;
+	program_t *program;
+	FILE *out;
+	int label;
+
+	// Per function
+	dynarr_t vars;
+	dynarr_t calls;
+	dynarr_t loops;
+	int pos;
+	int n_spills;
+	int n_saved;
+	bool saved[NUM_CALLEE_SAVED];
+
+	// While generating code, the variable bound by each binding
+	// and argument, in the order they were created.
+	int next_var;
+} asmgen_t;
+
+static bool
+is_simple (expr_t *expr)
+{
+	return expr->type == EXPR_IDENT || (expr->type == EXPR_INTEGER && expr->v.i >= INT32_MIN && expr->v.i <= INT32_MAX);
+}
+
+static bool
+is_comparison (expr_t *expr)
+{
+	return expr->type == EXPR_BINARY && (expr->v.binary.op == TOKEN_LESS || expr->v.binary.op == TOKEN_EQUALS);
+}
+
+static bool
+is_logic (expr_t *expr)
+{
+	return expr->type == EXPR_BINARY && (expr->v.binary.op == TOKEN_LOGIC_AND || expr->v.binary.op == TOKEN_LOGIC_OR);
+}
+
+static asm_scope_t*
+scope_bind (asmgen_t *ag, asm_scope_t *scope, asm_var_t *var)
+{
+	asm_scope_t *new = pool_alloc(&ag->ctx->pool, sizeof(asm_scope_t));
+	new->var = var;
+	new->next = scope;
+	return new;
+}
+
+static asm_var_t*
+scope_lookup (asm_scope_t *scope, int32_t symbol)
+{
+	for (; scope != NULL; scope = scope->next) {
+		if (scope->var->symbol == symbol)
+			return scope->var;
+	}
+	error_assert(false, "unbound variable");
+	return NULL;
+}
+
+/*
+ * Liveness analysis.  This must visit the expressions in exactly the
+ * order the code generator evaluates them.
+ */
+
+static asm_var_t*
+new_var (asmgen_t *ag, int32_t symbol)
+{
+	asm_var_t *var = pool_alloc(&ag->ctx->pool, sizeof(asm_var_t));
+	var->symbol = symbol;
+	var->start = var->end = ++ag->pos;
+	var->weight = 0;
+	var->crosses_call = false;
+	var->reg = -1;
+	var->disp = 0;
+	dynarr_append(&ag->vars, var);
+	return var;
+}
+
+static void
+use_var (asmgen_t *ag, asm_var_t *var)
+{
+	int weight = 1;
+
+	var->end = ++ag->pos;
+	for (size_t i = 0; i < dynarr_length(&ag->loops); i++) {
+		asm_loop_t *loop = dynarr_nth(&ag->loops, i);
+		if (var->start < loop->start)
+			dynarr_append(&loop->used, var);
+		if (weight < (1 << 24))
+			weight *= 8;
+	}
+	var->weight += weight;
+}
+
+static void analyze_expr (asmgen_t *ag, asm_scope_t *scope, expr_t *expr);
+
+static void
+analyze_operands (asmgen_t *ag, asm_scope_t *scope, expr_t *left, expr_t *right)
+{
+	if (is_simple(right)) {
+		analyze_expr(ag, scope, left);
+		analyze_expr(ag, scope, right);
+	} else if (is_simple(left)) {
+		analyze_expr(ag, scope, right);
+		analyze_expr(ag, scope, left);
+	} else {
+		analyze_expr(ag, scope, left);
+		analyze_expr(ag, scope, right);
+	}
+}
+
+static asm_scope_t*
+analyze_bindings (asmgen_t *ag, asm_scope_t *scope, expr_t *expr, asm_var_t **vars)
+{
+	for (int i = 0; i < expr->v.let_loop.n; i++) {
+		analyze_expr(ag, scope, expr->v.let_loop.bindings[i].expr);
+		asm_var_t *var = new_var(ag, expr->v.let_loop.bindings[i].symbol);
+		if (vars != NULL)
+			vars[i] = var;
+		scope = scope_bind(ag, scope, var);
+	}
+	return scope;
+}
+
+static void
+analyze_expr (asmgen_t *ag, asm_scope_t *scope, expr_t *expr)
+{
+	switch (expr->type) {
+		case EXPR_INTEGER:
+			ag->pos++;
+			break;
+
+		case EXPR_IDENT:
+			use_var(ag, scope_lookup(scope, expr->v.ident.symbol));
+			break;
+
+		case EXPR_IF:
+			analyze_expr(ag, scope, expr->v.if_expr.condition);
+			analyze_expr(ag, scope, expr->v.if_expr.consequent);
+			analyze_expr(ag, scope, expr->v.if_expr.alternative);
+			break;
+
+		case EXPR_UNARY:
+			analyze_expr(ag, scope, expr->v.unary.operand);
+			break;
+
+		case EXPR_BINARY:
+			if (is_logic(expr)) {
+				analyze_expr(ag, scope, expr->v.binary.left);
+				analyze_expr(ag, scope, expr->v.binary.right);
+			} else {
+				analyze_operands(ag, scope, expr->v.binary.left, expr->v.binary.right);
+			}
+			ag->pos++;
+			break;
+
+		case EXPR_LET:
+			scope = analyze_bindings(ag, scope, expr, NULL);
+			analyze_expr(ag, scope, expr->v.let_loop.body);
+			break;
+
+		case EXPR_LOOP: {
+			asm_loop_t *loop = pool_alloc(&ag->ctx->pool, sizeof(asm_loop_t));
+
+			loop->n = expr->v.let_loop.n;
+			loop->vars = pool_alloc(&ag->ctx->pool, sizeof(asm_var_t*) * loop->n);
+			scope = analyze_bindings(ag, scope, expr, loop->vars);
+
+			loop->start = ++ag->pos;
+			dynarr_init(&loop->used, &ag->ctx->pool);
+			dynarr_append(&ag->loops, loop);
+
+			analyze_expr(ag, scope, expr->v.let_loop.body);
+
+			// The loop variables and everything else used in the
+			// body must survive the jump back to the start.
+			int end = ++ag->pos;
+			for (size_t i = 0; i < dynarr_length(&loop->used); i++) {
+				asm_var_t *var = dynarr_nth(&loop->used, i);
+				if (var->end < end)
+					var->end = end;
+			}
+			assert(dynarr_nth(&ag->loops, dynarr_length(&ag->loops) - 1) == loop);
+			dynarr_remove(&ag->loops, dynarr_length(&ag->loops) - 1);
+			break;
+		}
+
+		case EXPR_RECUR: {
+			size_t n_loops = dynarr_length(&ag->loops);
+			error_assert(n_loops > 0, "recur not in tail position of a loop");
+			asm_loop_t *loop = dynarr_nth(&ag->loops, n_loops - 1);
+			error_assert(expr->v.recur.n == loop->n, "recur has the wrong number of arguments");
+			for (int i = 0; i < expr->v.recur.n; i++)
+				analyze_expr(ag, scope, expr->v.recur.args[i]);
+			// Assigning the loop variables counts as a use, so
+			// they keep their locations even if they're never
+			// read.
+			for (int i = 0; i < loop->n; i++)
+				use_var(ag, loop->vars[i]);
+			break;
+		}
+
+		case EXPR_CALL:
+			for (int i = 0; i < expr->v.call.n; i++)
+				analyze_expr(ag, scope, expr->v.call.args[i]);
+			dynarr_append(&ag->calls, (void*)(intptr_t)++ag->pos);
+			break;
+
+		default:
+			assert(false);
+	}
+}
+
+/*
+ * Register allocation.
+ */
+
+static int
+compare_starts (const void *a, const void *b)
+{
+	const asm_var_t *va = *(asm_var_t* const*)a;
+	const asm_var_t *vb = *(asm_var_t* const*)b;
+	return va->start - vb->start;
+}
+
+static void
+spill (asmgen_t *ag, asm_var_t *var)
+{
+	var->reg = -1;
+	if (var->disp == 0)
+		var->disp = -8 * ++ag->n_spills;
+}
+
+static void
+allocate_registers (asmgen_t *ag)
+{
+	size_t n_vars = dynarr_length(&ag->vars);
+	asm_var_t **vars = (asm_var_t**)dynarr_data(&ag->vars);
+	asm_var_t *owner[NUM_REGS];
+
+	for (size_t i = 0; i < n_vars; i++) {
+		asm_var_t *var = vars[i];
+		for (size_t j = 0; j < dynarr_length(&ag->calls); j++) {
+			int call = (int)(intptr_t)dynarr_nth(&ag->calls, j);
+			if (var->start < call && call < var->end)
+				var->crosses_call = true;
+		}
+	}
+
+	qsort(vars, n_vars, sizeof(asm_var_t*), compare_starts);
+
+	for (int r = 0; r < NUM_REGS; r++)
+		owner[r] = NULL;
+
+	for (size_t i = 0; i < n_vars; i++) {
+		asm_var_t *var = vars[i];
+		int n_allowed = var->crosses_call ? NUM_CALLEE_SAVED : NUM_REGS;
+		int reg = -1;
+
+		for (int r = 0; r < NUM_REGS; r++) {
+			if (owner[r] != NULL && owner[r]->end < var->start)
+				owner[r] = NULL;
+		}
+
+		// Prefer caller-saved registers, which don't need to be
+		// saved in the prologue.
+		for (int r = n_allowed - 1; r >= 0; r--) {
+			if (owner[r] == NULL) {
+				reg = r;
+				break;
+			}
+		}
+
+		if (reg < 0) {
+			int victim = -1;
+			for (int r = 0; r < n_allowed; r++) {
+				asm_var_t *other = owner[r];
+				if (victim < 0 || other->weight < owner[victim]->weight
+				    || (other->weight == owner[victim]->weight && other->end > owner[victim]->end))
+					victim = r;
+			}
+			if (owner[victim]->weight < var->weight
+			    || (owner[victim]->weight == var->weight && owner[victim]->end > var->end)) {
+				spill(ag, owner[victim]);
+				reg = victim;
+			}
+		}
+
+		if (reg < 0) {
+			spill(ag, var);
+		} else {
+			var->reg = reg;
+			owner[reg] = var;
+		}
+	}
+
+	ag->n_saved = 0;
+	for (int r = 0; r < NUM_CALLEE_SAVED; r++)
+		ag->saved[r] = false;
+	for (size_t i = 0; i < n_vars; i++) {
+		if (vars[i]->reg >= 0 && vars[i]->reg < NUM_CALLEE_SAVED && !ag->saved[vars[i]->reg]) {
+			ag->saved[vars[i]->reg] = true;
+			ag->n_saved++;
+		}
+	}
+}
+
+/*
+ * Code generation.
+ */
+
+static int
+new_label (asmgen_t *ag)
+{
+	return ag->label++;
+}
+
+static void
+emit_label (asmgen_t *ag, int label)
+{
+	fprintf(ag->out, ".L%d:\n", label);
+}
+
+// The stack slots of spilled variables come after the saved
+// registers.
+static const char*
+var_location (asmgen_t *ag, asm_var_t *var)
+{
+	static char buf[32];
+
+	if (var->reg >= 0)
+		return reg_names[var->reg];
+	if (var->disp < 0)
+		snprintf(buf, sizeof(buf), "%d(%%rbp)", var->disp - 8 * ag->n_saved);
+	else
+		snprintf(buf, sizeof(buf), "%d(%%rbp)", var->disp);
+	return buf;
+}
+
+// Returns the operand for a simple expression.
+static const char*
+simple_operand (asmgen_t *ag, asm_scope_t *scope, expr_t *expr)
+{
+	static char buf[32];
+
+	if (expr->type == EXPR_IDENT)
+		return var_location(ag, scope_lookup(scope, expr->v.ident.symbol));
+	snprintf(buf, sizeof(buf), "$%" PRId64, expr->v.i);
+	return buf;
+}
+
+static asm_var_t*
+next_var (asmgen_t *ag)
+{
+	// The allocator sorted the variables by start, which is also the
+	// order in which they are created.
+	return dynarr_nth(&ag->vars, ag->next_var++);
+}
+
+static void gen_expr (asmgen_t *ag, asm_scope_t *scope, asm_loop_t *loop, expr_t *expr);
+
+// Evaluates the operands of a binary operator, leaving the left one in
+// RAX, and returns the operand to use for the right one.
+static const char*
+gen_operands (asmgen_t *ag, asm_scope_t *scope, expr_t *left, expr_t *right)
+{
+	if (is_simple(right)) {
+		gen_expr(ag, scope, NULL, left);
+		return simple_operand(ag, scope, right);
+	} else if (is_simple(left)) {
+		gen_expr(ag, scope, NULL, right);
+		fprintf(ag->out, "\tmovq %%rax, %%rcx\n");
+		fprintf(ag->out, "\tmovq %s, %%rax\n", simple_operand(ag, scope, left));
+		return "%rcx";
+	} else {
+		gen_expr(ag, scope, NULL, left);
+		fprintf(ag->out, "\tpushq %%rax\n");
+		gen_expr(ag, scope, NULL, right);
+		fprintf(ag->out, "\tmovq %%rax, %%rcx\n");
+		fprintf(ag->out, "\tpopq %%rax\n");
+		return "%rcx";
+	}
+}
+
+// Jumps to LABEL if EXPR's truth value is JUMP_IF, otherwise falls
+// through.
+static void
+gen_branch (asmgen_t *ag, asm_scope_t *scope, expr_t *expr, bool jump_if, int label)
+{
+	if (is_comparison(expr)) {
+		const char *right = gen_operands(ag, scope, expr->v.binary.left, expr->v.binary.right);
+		bool less = expr->v.binary.op == TOKEN_LESS;
+		fprintf(ag->out, "\tcmpq %s, %%rax\n", right);
+		if (jump_if)
+			fprintf(ag->out, "\t%s .L%d\n", less ? "jl" : "je", label);
+		else
+			fprintf(ag->out, "\t%s .L%d\n", less ? "jge" : "jne", label);
+	} else if (expr->type == EXPR_UNARY && expr->v.unary.op == TOKEN_NOT) {
+		gen_branch(ag, scope, expr->v.unary.operand, !jump_if, label);
+	} else if (is_logic(expr)) {
+		// For && we jump if both are true or one is false, for ||
+		// if one is true or both are false.
+		bool is_and = expr->v.binary.op == TOKEN_LOGIC_AND;
+		if (jump_if == is_and) {
+			int skip = new_label(ag);
+			gen_branch(ag, scope, expr->v.binary.left, !jump_if, skip);
+			gen_branch(ag, scope, expr->v.binary.right, jump_if, label);
+			emit_label(ag, skip);
+		} else {
+			gen_branch(ag, scope, expr->v.binary.left, jump_if, label);
+			gen_branch(ag, scope, expr->v.binary.right, jump_if, label);
+		}
+	} else {
+		gen_expr(ag, scope, NULL, expr);
+		fprintf(ag->out, "\ttestq %%rax, %%rax\n");
+		fprintf(ag->out, "\t%s .L%d\n", jump_if ? "jnz" : "jz", label);
+	}
+}
+
+static void
+gen_push (asmgen_t *ag, asm_scope_t *scope, expr_t *expr)
+{
+	if (is_simple(expr)) {
+		fprintf(ag->out, "\tpushq %s\n", simple_operand(ag, scope, expr));
+	} else {
+		gen_expr(ag, scope, NULL, expr);
+		fprintf(ag->out, "\tpushq %%rax\n");
+	}
+}
+
+static asm_scope_t*
+gen_bindings (asmgen_t *ag, asm_scope_t *scope, expr_t *expr, asm_var_t **vars)
+{
+	for (int i = 0; i < expr->v.let_loop.n; i++) {
+		expr_t *value = expr->v.let_loop.bindings[i].expr;
+		bool is_constant = value->type == EXPR_INTEGER && is_simple(value);
+		if (!is_constant)
+			gen_expr(ag, scope, NULL, value);
+		asm_var_t *var = next_var(ag);
+		assert(var->symbol == expr->v.let_loop.bindings[i].symbol);
+		if (is_constant)
+			fprintf(ag->out, "\tmovq $%" PRId64 ", %s\n", value->v.i, var_location(ag, var));
+		else
+			fprintf(ag->out, "\tmovq %%rax, %s\n", var_location(ag, var));
+		if (vars != NULL)
+			vars[i] = var;
+		scope = scope_bind(ag, scope, var);
+	}
+	return scope;
+}
+
+// Evaluates EXPR into RAX.  LOOP is the innermost loop if EXPR is in
+// tail position with respect to it, otherwise NULL.
+static void
+gen_expr (asmgen_t *ag, asm_scope_t *scope, asm_loop_t *loop, expr_t *expr)
+{
+	FILE *out = ag->out;
+
+	switch (expr->type) {
+		case EXPR_INTEGER:
+			if (expr->v.i >= INT32_MIN && expr->v.i <= INT32_MAX)
+				fprintf(out, "\tmovq $%" PRId64 ", %%rax\n", expr->v.i);
+			else
+				fprintf(out, "\tmovabsq $%" PRId64 ", %%rax\n", expr->v.i);
+			break;
+
+		case EXPR_IDENT:
+			fprintf(out, "\tmovq %s, %%rax\n", var_location(ag, scope_lookup(scope, expr->v.ident.symbol)));
+			break;
+
+		case EXPR_IF: {
+			int alternative = new_label(ag);
+			int end = new_label(ag);
+			gen_branch(ag, scope, expr->v.if_expr.condition, false, alternative);
+			gen_expr(ag, scope, loop, expr->v.if_expr.consequent);
+			fprintf(out, "\tjmp .L%d\n", end);
+			emit_label(ag, alternative);
+			gen_expr(ag, scope, loop, expr->v.if_expr.alternative);
+			emit_label(ag, end);
+			break;
+		}
+
+		case EXPR_UNARY:
+			if (expr->v.unary.op == TOKEN_NEGATE && expr->v.unary.operand->type == EXPR_INTEGER) {
+				fprintf(out, "\tmovabsq $%" PRId64 ", %%rax\n", -expr->v.unary.operand->v.i);
+				break;
+			}
+			gen_expr(ag, scope, NULL, expr->v.unary.operand);
+			if (expr->v.unary.op == TOKEN_NOT) {
+				fprintf(out, "\ttestq %%rax, %%rax\n");
+				fprintf(out, "\tsete %%al\n");
+				fprintf(out, "\tmovzbq %%al, %%rax\n");
+			} else {
+				fprintf(out, "\tnegq %%rax\n");
+			}
+			break;
+
+		case EXPR_BINARY: {
+			if (is_logic(expr)) {
+				int is_false = new_label(ag);
+				int end = new_label(ag);
+				gen_branch(ag, scope, expr, false, is_false);
+				fprintf(out, "\tmovq $1, %%rax\n");
+				fprintf(out, "\tjmp .L%d\n", end);
+				emit_label(ag, is_false);
+				fprintf(out, "\txorl %%eax, %%eax\n");
+				emit_label(ag, end);
+				break;
+			}
+
+			const char *right = gen_operands(ag, scope, expr->v.binary.left, expr->v.binary.right);
+			switch (expr->v.binary.op) {
+				case TOKEN_PLUS:
+					fprintf(out, "\taddq %s, %%rax\n", right);
+					break;
+				case TOKEN_TIMES:
+					fprintf(out, "\timulq %s, %%rax\n", right);
+					break;
+				case TOKEN_LESS:
+				case TOKEN_EQUALS:
+					fprintf(out, "\tcmpq %s, %%rax\n", right);
+					fprintf(out, "\t%s %%al\n", expr->v.binary.op == TOKEN_LESS ? "setl" : "sete");
+					fprintf(out, "\tmovzbq %%al, %%rax\n");
+					break;
+				default:
+					assert(false);
+			}
+			break;
+		}
+
+		case EXPR_LET:
+			scope = gen_bindings(ag, scope, expr, NULL);
+			gen_expr(ag, scope, loop, expr->v.let_loop.body);
+			break;
+
+		case EXPR_LOOP: {
+			asm_loop_t info;
+			info.n = expr->v.let_loop.n;
+			info.vars = pool_alloc(&ag->ctx->pool, sizeof(asm_var_t*) * info.n);
+			info.label = new_label(ag);
+			scope = gen_bindings(ag, scope, expr, info.vars);
+			emit_label(ag, info.label);
+			gen_expr(ag, scope, &info, expr->v.let_loop.body);
+			break;
+		}
+
+		case EXPR_RECUR: {
+			int n = expr->v.recur.n;
+			error_assert(loop != NULL, "recur not in tail position of a loop");
+			if (n == 1) {
+				gen_expr(ag, scope, NULL, expr->v.recur.args[0]);
+				fprintf(out, "\tmovq %%rax, %s\n", var_location(ag, loop->vars[0]));
+			} else {
+				// Loop variables that are passed on unchanged are
+				// left alone.
+				for (int i = 0; i < n; i++) {
+					expr_t *arg = expr->v.recur.args[i];
+					if (arg->type == EXPR_IDENT && scope_lookup(scope, arg->v.ident.symbol) == loop->vars[i])
+						continue;
+					gen_push(ag, scope, arg);
+				}
+				for (int i = n - 1; i >= 0; i--) {
+					expr_t *arg = expr->v.recur.args[i];
+					if (arg->type == EXPR_IDENT && scope_lookup(scope, arg->v.ident.symbol) == loop->vars[i])
+						continue;
+					fprintf(out, "\tpopq %s\n", var_location(ag, loop->vars[i]));
+				}
+			}
+			fprintf(out, "\tjmp .L%d\n", loop->label);
+			break;
+		}
+
+		case EXPR_CALL: {
+			int n = expr->v.call.n;
+			for (int i = 0; i < n; i++)
+				gen_push(ag, scope, expr->v.call.args[i]);
+			fprintf(out, "\tcall sl_%s\n", expr->v.call.function->name);
+			fprintf(out, "\taddq $%d, %%rsp\n", 8 * n);
+			break;
+		}
+
+		default:
+			assert(false);
+	}
+}
+
+static void
+gen_function (asmgen_t *ag, function_t *function)
+{
+	FILE *out = ag->out;
+	asm_scope_t *scope = NULL;
+	asm_var_t **args = pool_alloc(&ag->ctx->pool, sizeof(asm_var_t*) * function->n_args);
+
+	dynarr_init(&ag->vars, &ag->ctx->pool);
+	dynarr_init(&ag->calls, &ag->ctx->pool);
+	dynarr_init(&ag->loops, &ag->ctx->pool);
+	ag->pos = 0;
+	ag->n_spills = 0;
+
+	for (int i = 0; i < function->n_args; i++) {
+		args[i] = new_var(ag, function->arg_symbols[i]);
+		// Spilled arguments stay where the caller put them.
+		args[i]->disp = 16 + 8 * (function->n_args - 1 - i);
+		scope = scope_bind(ag, scope, args[i]);
+	}
+	analyze_expr(ag, scope, function->body);
+	allocate_registers(ag);
+
+	fprintf(out, "\n\t.p2align 4\n");
+	fprintf(out, "sl_%s:\n", function->name);
+	fprintf(out, "\tpushq %%rbp\n");
+	fprintf(out, "\tmovq %%rsp, %%rbp\n");
+	for (int r = 0; r < NUM_CALLEE_SAVED; r++) {
+		if (ag->saved[r])
+			fprintf(out, "\tpushq %s\n", reg_names[r]);
+	}
+	if (ag->n_spills > 0)
+		fprintf(out, "\tsubq $%d, %%rsp\n", 8 * ag->n_spills);
+	for (int i = 0; i < function->n_args; i++) {
+		if (args[i]->reg >= 0)
+			fprintf(out, "\tmovq %d(%%rbp), %s\n", args[i]->disp, reg_names[args[i]->reg]);
+	}
+
+	ag->next_var = function->n_args;
+	gen_expr(ag, scope, NULL, function->body);
+	assert(ag->next_var == dynarr_length(&ag->vars));
+
+	if (ag->n_saved > 0)
+		fprintf(out, "\tleaq %d(%%rbp), %%rsp\n", -8 * ag->n_saved);
+	else
+		fprintf(out, "\tmovq %%rbp, %%rsp\n");
+	for (int r = NUM_CALLEE_SAVED - 1; r >= 0; r--) {
+		if (ag->saved[r])
+			fprintf(out, "\tpopq %s\n", reg_names[r]);
+	}
+	fprintf(out, "\tpopq %%rbp\n");
+	fprintf(out, "\tret\n");
+}
+
+void
+emit_asm_program (context_t *ctx, program_t *program, FILE *out)
+{
+	asmgen_t ag;
+
+	ag.ctx = ctx;
+	ag.program = program;
+	ag.out = out;
+	ag.label = 0;
+
+	function_t *main_function = lookup_function(program, "main");
+	error_assert(main_function != NULL, "Function main must be defined.");
+
+	fprintf(out, "\t.text\n");
+	for (function_t *func = program->functions; func != NULL; func = func->next)
+		gen_function(&ag, func);
+
+	// int64_t simplang_main (int64_t *args)
+	fprintf(out, "\n\t.globl simplang_main\n");
+	fprintf(out, "\t.p2align 4\n");
+	fprintf(out, "simplang_main:\n");
+	for (int i = 0; i < main_function->n_args; i++)
+		fprintf(out, "\tpushq %d(%%rdi)\n", 8 * i);
+	fprintf(out, "\tcall sl_main\n");
+	fprintf(out, "\taddq $%d, %%rsp\n", 8 * main_function->n_args);
+	fprintf(out, "\tret\n");
+
+	fprintf(out, "\n\t.section .rodata\n");
+	fprintf(out, "\t.globl simplang_main_nargs\n");
+	fprintf(out, "\t.p2align 3\n");
+	fprintf(out, "simplang_main_nargs:\n");
+	fprintf(out, "\t.quad %d\n", main_function->n_args);
+
+	fprintf(out, "\n\t.section .note.GNU-stack,\"\",@progbits\n");
+}
@@ -0,0 +1,289 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "compiler.h"
+
+/*
+ * Batch mode runs one program on many argument vectors.  The program
+ * is shared, and each worker thread has its own context.
+ *
+ * Every worker starts out owning an equal share of the runs, as a
+ * range of run indexes.  It takes runs from the beginning of its
+ * range.  When its range is empty it steals the upper half of the
+ * range with the most runs left.  The results are stored by run index,
+ * so they can be printed in input order once all workers are done.
+ * On the SPMD engine a worker takes as many runs at a time as it has
+ * lanes.
+ */
+
+typedef struct
+{
+	const vm_program_t *prog;
+	vm_engine_t engine;
+	int lanes;
+
+	size_t n_runs;
+	// The arguments of run I are ARGS[STARTS[I]] to ARGS[STARTS[I + 1]].
+	int64_t *args;
+	size_t *starts;
+	int64_t *results;
+
+	struct _batch_worker_t *workers;
+	int n_workers;
+} batch_t;
+
+typedef struct _batch_worker_t
+{
+	batch_t *batch;
+	vm_t vm;
+	vm_spmd_t *spmd;
+	pthread_t thread;
+
+	// The runs left in the worker's range.  They only change under
+	// LOCK, but thieves look at them without it, so they're atomic.
+	pthread_mutex_t lock;
+	_Atomic size_t begin;
+	_Atomic size_t end;
+} batch_worker_t;
+
+static void*
+grow (void *array, size_t *capacity, size_t needed, size_t elem_size)
+{
+	if (needed <= *capacity)
+		return array;
+	while (*capacity < needed)
+		*capacity = *capacity == 0 ? 64 : *capacity * 2;
+	array = realloc(array, *capacity * elem_size);
+	assert(array != NULL);
+	return array;
+}
+
+static void
+batch_error (size_t line, const char *message)
+{
+	fprintf(stderr, "Error: batch line %zu: %s\n", line, message);
+	exit(1);
+}
+
+// Reads one line of arguments per run.  N_ARGS is the number of
+// arguments each line must have, or -1 for any number.
+static void
+read_runs (batch_t *batch, FILE *in, int n_args)
+{
+	size_t args_capacity = 0, starts_capacity = 0;
+	size_t n = 0;
+	char *line = NULL;
+	size_t line_capacity = 0;
+
+	batch->args = NULL;
+	batch->starts = NULL;
+	batch->n_runs = 0;
+
+	batch->starts = grow(batch->starts, &starts_capacity, 1, sizeof(size_t));
+	batch->starts[0] = 0;
+
+	while (getline(&line, &line_capacity, in) >= 0) {
+		char *p = line;
+		int count = 0;
+
+		for (;;) {
+			while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+				p++;
+			if (*p == 0)
+				break;
+
+			char *end;
+			errno = 0;
+			int64_t value = (int64_t)strtoll(p, &end, 10);
+			if (end == p || errno != 0)
+				batch_error(batch->n_runs + 1, "not an integer");
+			p = end;
+
+			batch->args = grow(batch->args, &args_capacity, n + 1, sizeof(int64_t));
+			batch->args[n++] = value;
+			count++;
+		}
+		if (n_args >= 0 && count != n_args)
+			batch_error(batch->n_runs + 1, "wrong number of arguments for main");
+
+		batch->n_runs++;
+		batch->starts = grow(batch->starts, &starts_capacity, batch->n_runs + 1, sizeof(size_t));
+		batch->starts[batch->n_runs] = n;
+	}
+	free(line);
+	error_assert(!ferror(in), "cannot read batch file");
+}
+
+static void
+run_one (batch_worker_t *worker, size_t run)
+{
+	batch_t *batch = worker->batch;
+	size_t start = batch->starts[run];
+
+	vm_reset(&worker->vm);
+	vm_push_args(&worker->vm, (int)(batch->starts[run + 1] - start), batch->args + start);
+	batch->results[run] = batch->engine(&worker->vm);
+}
+
+static void
+run_lanes (batch_worker_t *worker, size_t first, int n)
+{
+	batch_t *batch = worker->batch;
+	int64_t *args[n];
+	int n_args[n];
+
+	for (int i = 0; i < n; i++) {
+		size_t start = batch->starts[first + i];
+		args[i] = batch->args + start;
+		n_args[i] = (int)(batch->starts[first + i + 1] - start);
+	}
+	vm_run_spmd(worker->spmd, n, args, n_args, batch->results + first);
+}
+
+// Takes up to MAX runs from the beginning of the worker's own range.
+// Returns how many it took.
+static int
+take_own (batch_worker_t *worker, size_t *first, int max)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&worker->lock);
+	size_t begin = atomic_load_explicit(&worker->begin, memory_order_relaxed);
+	size_t end = atomic_load_explicit(&worker->end, memory_order_relaxed);
+	if (begin < end) {
+		*first = begin;
+		n = end - begin < (size_t)max ? (int)(end - begin) : max;
+		atomic_store_explicit(&worker->begin, begin + n, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return n;
+}
+
+// Moves the upper half of the fullest other range to WORKER.  Returns
+// false if there's nothing left to steal.
+static bool
+steal (batch_worker_t *worker)
+{
+	batch_t *batch = worker->batch;
+
+	for (;;) {
+		batch_worker_t *victim = NULL;
+		size_t most = 0;
+
+		// Only a guess, because the ranges keep changing.  It's
+		// checked again under the victim's lock.
+		for (int i = 0; i < batch->n_workers; i++) {
+			batch_worker_t *other = &batch->workers[i];
+			size_t other_begin = atomic_load_explicit(&other->begin, memory_order_relaxed);
+			size_t other_end = atomic_load_explicit(&other->end, memory_order_relaxed);
+			if (other != worker && other_begin < other_end && other_end - other_begin > most) {
+				victim = other;
+				most = other_end - other_begin;
+			}
+		}
+		if (victim == NULL)
+			return false;
+
+		size_t begin = 0, end = 0;
+		pthread_mutex_lock(&victim->lock);
+		size_t victim_begin = atomic_load_explicit(&victim->begin, memory_order_relaxed);
+		size_t victim_end = atomic_load_explicit(&victim->end, memory_order_relaxed);
+		if (victim_begin < victim_end) {
+			end = victim_end;
+			begin = victim_begin + (victim_end - victim_begin) / 2;
+			atomic_store_explicit(&victim->end, begin, memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if (begin < end) {
+			pthread_mutex_lock(&worker->lock);
+			atomic_store_explicit(&worker->begin, begin, memory_order_relaxed);
+			atomic_store_explicit(&worker->end, end, memory_order_relaxed);
+			pthread_mutex_unlock(&worker->lock);
+			return true;
+		}
+	}
+}
+
+static void*
+worker_main (void *arg)
+{
+	batch_worker_t *worker = arg;
+	int max = worker->spmd != NULL ? worker->batch->lanes : 1;
+	size_t first;
+	int n;
+
+	for (;;) {
+		while ((n = take_own(worker, &first, max)) > 0) {
+			if (worker->spmd != NULL)
+				run_lanes(worker, first, n);
+			else
+				run_one(worker, first);
+		}
+		if (!steal(worker))
+			return NULL;
+	}
+}
+
+void
+vm_run_batch (const vm_program_t *prog, vm_engine_t engine, int lanes, int n_args, FILE *in, FILE *out,
+	      int n_threads, bool huge_pages)
+{
+	batch_t batch;
+
+	batch.prog = prog;
+	batch.engine = engine;
+	batch.lanes = lanes;
+	read_runs(&batch, in, n_args);
+	batch.results = malloc(sizeof(int64_t) * (batch.n_runs + 1));
+
+	if ((size_t)n_threads > batch.n_runs)
+		n_threads = batch.n_runs > 0 ? (int)batch.n_runs : 1;
+	batch.n_workers = n_threads;
+	batch.workers = malloc(sizeof(batch_worker_t) * n_threads);
+
+	// Contexts can only be set up while no other one is running.
+	for (int i = 0; i < n_threads; i++) {
+		batch_worker_t *worker = &batch.workers[i];
+		worker->batch = &batch;
+		if (lanes > 0) {
+			worker->spmd = vm_spmd_new(prog, lanes, VM_STACK_SLOTS, VM_CALL_STACK_SIZE, huge_pages);
+		} else {
+			worker->spmd = NULL;
+			vm_init(&worker->vm, prog, VM_STACK_SLOTS, VM_CALL_STACK_SIZE, huge_pages);
+		}
+		pthread_mutex_init(&worker->lock, NULL);
+		atomic_init(&worker->begin, batch.n_runs * i / n_threads);
+		atomic_init(&worker->end, batch.n_runs * (i + 1) / n_threads);
+	}
+
+	// The main thread is the first worker.
+	for (int i = 1; i < n_threads; i++) {
+		int err = pthread_create(&batch.workers[i].thread, NULL, worker_main, &batch.workers[i]);
+		error_assert(err == 0, "cannot create batch thread");
+	}
+	worker_main(&batch.workers[0]);
+	for (int i = 1; i < n_threads; i++)
+		pthread_join(batch.workers[i].thread, NULL);
+
+	for (size_t i = 0; i < batch.n_runs; i++)
+		fprintf(out, "%" PRId64 "\n", batch.results[i]);
+
+	for (int i = 0; i < n_threads; i++) {
+		if (batch.workers[i].spmd != NULL)
+			vm_spmd_free(batch.workers[i].spmd);
+		else
+			vm_free(&batch.workers[i].vm);
+		pthread_mutex_destroy(&batch.workers[i].lock);
+	}
+	free(batch.workers);
+	free(batch.results);
+	free(batch.args);
+	free(batch.starts);
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Times the VM engines on call-heavy programs, taking the best of five
+# runs.  Give other simplang binaries as arguments to compare them with
+# this one.
+#
+#   ./bench-calls.sh [SIMPLANG...]
+
+examples=`dirname "$0"`/../../examples
+runs=5
+
+best_ms () {
+	best=
+	i=0
+	while [ $i -lt $runs ]; do
+		start=`date +%s%N`
+		"$@" >/dev/null || exit 1
+		end=`date +%s%N`
+		ms=$(( (end - start) / 1000000 ))
+		if [ -z "$best" ] || [ $ms -lt $best ]; then
+			best=$ms
+		fi
+		i=$((i + 1))
+	done
+	echo $best
+}
+
+printf "%-24s %-9s %-18s %8s\n" binary engine program ms
+for simplang in ./simplang "$@"; do
+	for engine in switch threaded jit; do
+		for program in "fib.sl 32" "eightqueens.sl 8"; do
+			set -- $program
+			ms=`best_ms $simplang --engine=$engine --compile $examples/$1 $2`
+			printf "%-24s %-9s %-18s %8s\n" $simplang $engine "$program" $ms
+		done
+	done
+done
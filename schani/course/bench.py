@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+
+# Times the example programs on every engine, taking the best of a
+# few runs, and reports the wall time, the VM instructions executed
+# per second and the peak RSS.  The results can be written as JSON and
+# compared with an earlier run.
+#
+#   ./bench.py [--runs=N] [--json=FILE] [--compare=FILE] [SIMPLANG]
+#
+# The instruction count is that of the program's VM code, from
+# --count-instructions, for all engines, so the rates of different
+# engines can be compared.  The reference implementation is timed,
+# too, if mono is there to run it, or if --reference gives a command
+# that does.
+#
+# The front end is timed separately, on generated programs whose main
+# is one long chain of binary operators, by compiling them with
+# --compile.
+
+import sys
+import os
+import json
+import time
+import random
+import shutil
+import argparse
+import tempfile
+import subprocess
+
+course_dir = os.path.realpath (os.path.dirname (__file__))
+examples_dir = os.path.join (course_dir, '..', '..', 'examples')
+reference_exe = os.path.join (course_dir, '..', '..', 'implementations', 'interpreter-schani.exe')
+
+programs = [
+    ('euler-1', [1000]),
+    ('euler-2', [1000000000000000000]),
+    ('euler-3', [600851475143]),
+    ('euler-4', [99]),
+    ('euler-5', [20]),
+    ('eightqueens', [8]),
+    ('nextprime', [10000]),
+    ('fib', [27]),
+    ('sqrt', [1000000000000]),
+    ('div', [1000000000000000000, 7]),
+    ('bitset', [12345678901, 40]),
+]
+
+engines = [
+    ('interpret', ['--interpret']),
+    ('parallel', ['--interpret', '--parallel']),
+    ('switch', ['--engine=switch', '--compile']),
+    ('threaded', ['--engine=threaded', '--compile']),
+    ('jit', ['--engine=jit', '--compile']),
+    ('trace', ['--engine=trace', '--compile']),
+]
+
+# Runs CMD, returning its output, the wall time in seconds and its
+# peak RSS in kilobytes.  We wait for it ourselves, because Popen
+# doesn't give us its rusage.  That includes our own RSS, though,
+# which is why simplang is asked for its peak RSS.
+def measure (cmd):
+    with tempfile.TemporaryFile () as err:
+        start = time.perf_counter ()
+        p = subprocess.Popen (cmd, stdout=subprocess.PIPE, stderr=err)
+        out = p.stdout.read ()
+        pid, status, rusage = os.wait4 (p.pid, 0)
+        elapsed = time.perf_counter () - start
+        p.stdout.close ()
+        p.returncode = os.waitstatus_to_exitcode (status)
+        if p.returncode != 0:
+            err.seek (0)
+            raise RuntimeError ('%s failed: %s' % (' '.join (cmd), err.read ().decode ().strip ()))
+        rss = rusage.ru_maxrss
+        err.seek (0)
+        for line in err.read ().decode ().splitlines ():
+            if line.startswith ('peak RSS: '):
+                rss = int (line.split () [2])
+    return out.decode (), elapsed, rss
+
+expression_sizes = [1000, 10000, 100000]
+
+# Writes a program whose main is a chain of N binary operators, mixing
+# all precedence levels, to PATH.
+def write_expression_program (path, n):
+    rng = random.Random (n)
+    operators = ['+', '*', '<', '==', '&&', '||', '+', '*']
+    operands = ['x', '1', '2', '(x + -1)', '!x', '-x']
+    terms = ['x']
+    for i in range (n):
+        terms.append (rng.choice (operators))
+        terms.append (rng.choice (operands))
+    with open (path, 'w') as f:
+        f.write ('let main x =\n')
+        for i in range (0, len (terms), 16):
+            f.write ('  %s\n' % ' '.join (terms [i : i + 16]))
+        f.write ('end\n')
+
+def bench_expressions (simplang, sizes, runs):
+    results = []
+    print ('\n%-14s %10s %12s' % ('operators', 'best ms', 'ops/ms'))
+    with tempfile.TemporaryDirectory () as tmp:
+        for n in sizes:
+            path = os.path.join (tmp, 'expr-%d.sl' % n)
+            write_expression_program (path, n)
+            cmd = [simplang, '--compile', path, '3']
+            times = []
+            for i in range (runs):
+                out, elapsed, rss = measure (cmd)
+                times.append (elapsed * 1000)
+            best = min (times)
+            print ('%-14d %10.1f %12.1f' % (n, best, n / best if best > 0 else 0.0))
+            results.append ({'operators': n, 'times_ms': times, 'best_ms': best})
+    return results
+
+def count_instructions (simplang, path, args):
+    p = subprocess.run ([simplang, '--count-instructions', '--compile', path] + [str (a) for a in args],
+                        stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+    for line in p.stderr.splitlines ():
+        if line.startswith ('instructions: '):
+            return int (line.split () [1])
+    return None
+
+def find_reference (command):
+    if command is not None:
+        prefix = command.split ()
+    elif shutil.which ('mono') is not None:
+        prefix = ['mono']
+    else:
+        sys.stderr.write ('skipping the reference implementation: no mono\n')
+        return None
+    cmd = prefix + [reference_exe, os.path.join (examples_dir, 'fib.sl'), '10']
+    try:
+        out, elapsed, rss = measure (cmd)
+        if out.strip () == '55':
+            return prefix + [reference_exe]
+    except (OSError, RuntimeError):
+        pass
+    sys.stderr.write ('skipping the reference implementation: it doesn\'t run with %s\n' % ' '.join (prefix))
+    return None
+
+def compare (old_file, results, expressions):
+    with open (old_file) as f:
+        old = json.load (f)
+    old_results = {(r ['program'], r ['engine']): r for r in old ['results']}
+    print ('\n%-14s %-10s %10s %10s %8s' % ('program', 'engine', 'old ms', 'new ms', 'change'))
+    for r in results:
+        o = old_results.get ((r ['program'], r ['engine']))
+        if o is None:
+            continue
+        change = (r ['best_ms'] - o ['best_ms']) / o ['best_ms'] * 100 if o ['best_ms'] > 0 else 0.0
+        note = ''
+        if o.get ('instructions') != r.get ('instructions'):
+            note = '  instructions %s -> %s' % (o.get ('instructions'), r.get ('instructions'))
+        print ('%-14s %-10s %10.1f %10.1f %+7.1f%%%s' % (r ['program'], r ['engine'], o ['best_ms'], r ['best_ms'], change, note))
+    old_expressions = {r ['operators']: r for r in old.get ('expressions', [])}
+    for r in expressions:
+        o = old_expressions.get (r ['operators'])
+        if o is None:
+            continue
+        change = (r ['best_ms'] - o ['best_ms']) / o ['best_ms'] * 100 if o ['best_ms'] > 0 else 0.0
+        print ('%-14s %-10s %10.1f %10.1f %+7.1f%%' % ('expr-%d' % r ['operators'], 'compile', o ['best_ms'], r ['best_ms'], change))
+
+def main ():
+    parser = argparse.ArgumentParser (description='Benchmark the SimpLang engines on the examples.')
+    parser.add_argument ('simplang', nargs='?', default=os.path.join (course_dir, 'simplang'))
+    parser.add_argument ('--runs', type=int, default=3)
+    parser.add_argument ('--json', help='write the results to this file')
+    parser.add_argument ('--compare', help='compare with the results in this file')
+    parser.add_argument ('--engines', help='comma-separated engines to run (default: all)')
+    parser.add_argument ('--programs', help='comma-separated programs to run (default: all)')
+    parser.add_argument ('--reference', help='command to run the reference implementation with')
+    parser.add_argument ('--expressions', default=','.join (str (n) for n in expression_sizes),
+                         help='comma-separated operator counts of the generated expressions to compile '
+                         '(default: %(default)s), or empty to skip them')
+    options = parser.parse_args ()
+
+    selected = engines
+    if options.engines:
+        names = options.engines.split (',')
+        selected = [e for e in engines if e [0] in names]
+    reference = None
+    if not options.engines or 'reference' in options.engines.split (','):
+        reference = find_reference (options.reference)
+    if reference is not None:
+        selected = selected + [('reference', None)]
+    benchmarks = programs
+    if options.programs:
+        names = options.programs.split (',')
+        benchmarks = [p for p in programs if p [0] in names]
+
+    results = []
+    print ('%-14s %-10s %-22s %10s %12s %10s' % ('program', 'engine', 'result', 'best ms', 'Minsns/s', 'RSS KB'))
+    for name, args in benchmarks:
+        path = os.path.join (examples_dir, name + '.sl')
+        str_args = [str (a) for a in args]
+        instructions = count_instructions (options.simplang, path, args)
+        expected = None
+        for engine, flags in selected:
+            if engine == 'reference':
+                cmd = reference + [path] + str_args
+            else:
+                cmd = [options.simplang, '--peak-rss'] + flags + [path] + str_args
+            times = []
+            peak_rss = 0
+            for i in range (options.runs):
+                out, elapsed, rss = measure (cmd)
+                times.append (elapsed * 1000)
+                peak_rss = max (peak_rss, rss)
+            result = out.strip ()
+            if expected is None:
+                expected = result
+            elif result != expected:
+                sys.stderr.write ('Error: %s gives %s on %s, but %s gave %s\n' %
+                                  (engine, result, name, selected [0] [0], expected))
+                sys.exit (1)
+            best = min (times)
+            ips = instructions / (best / 1000) if instructions is not None and best > 0 else None
+            print ('%-14s %-10s %-22s %10.1f %12s %10d' %
+                   (name, engine, result, best, '%.1f' % (ips / 1e6) if ips is not None else '-', peak_rss))
+            results.append ({
+                'program': name,
+                'args': args,
+                'engine': engine,
+                'command': cmd,
+                'result': result,
+                'times_ms': times,
+                'best_ms': best,
+                'instructions': instructions,
+                'instructions_per_second': ips,
+                'peak_rss_kb': peak_rss,
+            })
+
+    sizes = [int (n) for n in options.expressions.split (',') if n]
+    expressions = bench_expressions (options.simplang, sizes, options.runs) if sizes else []
+
+    if options.json:
+        with open (options.json, 'w') as f:
+            json.dump ({'simplang': options.simplang, 'date': time.strftime ('%Y-%m-%dT%H:%M:%S'),
+                        'runs': options.runs, 'results': results, 'expressions': expressions}, f, indent=2)
+            f.write ('\n')
+    if options.compare:
+        compare (options.compare, results, expressions)
+
+main ()
@@ -0,0 +1,271 @@
+#!/usr/bin/env python3
+
+# Runs the test suites in tests on simplang, and the tests of its own
+# modes that need more than a program and its arguments: binary VM
+# code, which depends on the machine, so it is made here, batches,
+# the server, profiles and memoization.
+#
+#   ./check.py [SIMPLANG]
+#
+# Prints a line per suite, and the output of the ones that fail.
+
+import os
+import sys
+import shutil
+import tempfile
+import subprocess
+
+course_dir = os.path.realpath (os.path.dirname (__file__))
+tests_dir = os.path.join (course_dir, '..', '..', 'tests')
+examples_dir = os.path.join (course_dir, '..', '..', 'examples')
+test_py = os.path.join (tests_dir, 'test.py')
+
+suites = [
+    ('scanner', ['--scan']),
+    ('parser-1.2', ['--parse-expr']),
+    ('parser-1.4', ['--parse-expr']),
+    ('parser-1.6', ['--parse-expr']),
+    ('parser-1.8', ['--parse-expr']),
+    ('parser-1.11', ['--parse-function']),
+    ('parser-1.10', ['--eval-expr']),
+    ('interpreter-1.3', ['--eval-expr']),
+    ('interpreter-1.5', ['--eval-expr']),
+    ('interpreter-1.7', ['--eval-expr']),
+    ('interpreter-1.9', ['--eval-expr']),
+    ('interpreter-1.12', ['--interpret']),
+    ('full', ['--interpret']),
+    ('full', ['--compile']),
+    ('full', ['--interpret', '--memo=auto']),
+    ('full', ['--compile', '--memo=auto']),
+    ('vm', ['--vm']),
+    ('vm-verify', ['--vm']),
+]
+
+failures = 0
+
+def report (name, ok, output=''):
+    global failures
+    print ('%-40s %s' % (name, 'ok' if ok else 'FAILED'))
+    if not ok:
+        failures += 1
+        if output:
+            print (output.rstrip ())
+
+# Runs tests/test.py on SUITE, which is the name of a directory in
+# tests or the path of one.
+def run_suite (exe, suite, flags, name=None):
+    p = subprocess.run ([sys.executable, test_py, suite, exe] + flags,
+                        stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+    report (name or ' '.join ([suite] + flags), p.returncode == 0, p.stdout)
+
+# Converts nextprime-simple to the binary format and runs it on the
+# suite for the text version, next to binary files the loader must
+# refuse.
+def check_binary (exe, tmp):
+    suite = os.path.join (tmp, 'binary')
+    os.mkdir (suite)
+    sbc = os.path.join (suite, 'nextprime-simple.sbc')
+    subprocess.check_call ([exe, '--convert-sbc', os.path.join (examples_dir, 'nextprime-simple.sbc'), sbc])
+    shutil.copy (os.path.join (tests_dir, 'vm', 'nextprime-simple.tests'), suite)
+
+    with open (sbc, 'rb') as f:
+        data = f.read ()
+    bad = [
+        ('truncated', data [:len (data) // 2], 'VM code file is truncated or corrupt'),
+        # The version is the 16 bits after the magic number.
+        ('wrong-version', data [:4] + bytes ([0xff, 0xff]) + data [6:], 'unsupported VM code version'),
+    ]
+    for (name, contents, error) in bad:
+        with open (os.path.join (suite, name + '.sbc'), 'wb') as f:
+            f.write (contents)
+        with open (os.path.join (suite, name + '.err'), 'w') as f:
+            f.write ('Error: %s\n' % error)
+
+    run_suite (exe, suite, ['--vm'], 'binary VM code')
+
+# The runs in a .tests file, as pairs of the arguments and the result.
+def read_tests (path):
+    with open (path, 'r') as f:
+        lines = [l.split () for l in f if l.strip ()]
+    return [(lines [i], lines [i + 1] [0]) for i in range (0, len (lines), 2)]
+
+def run_batch (exe, flags, program, lines):
+    return subprocess.run ([exe] + flags + ['--batch=-', program], input=''.join (l + '\n' for l in lines),
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+
+# Runs each program in the full suite as batches of its tests,
+# repeated so that there are more runs than threads, and checks that
+# the results come back in the order of the input.  SIZES are the
+# numbers of runs in the batches, all of them if not given.
+def check_batch_order (exe, flags, sizes=None):
+    full_dir = os.path.join (tests_dir, 'full')
+    ok = True
+    output = ''
+    for fn in sorted (os.listdir (full_dir)):
+        if not fn.endswith ('.tests'):
+            continue
+        program = os.path.join (examples_dir, fn [:-6] + '.sl')
+        all_runs = read_tests (os.path.join (full_dir, fn)) * 5
+        for size in sizes or [len (all_runs)]:
+            runs = (all_runs * (size // len (all_runs) + 1)) [:size]
+            p = run_batch (exe, flags + ['--compile'], program, [' '.join (args) for (args, result) in runs])
+            expected = [result for (args, result) in runs]
+            if p.returncode != 0 or p.stdout.split () != expected:
+                ok = False
+                output += 'Failure on %s with %d runs: expected %s, got %s%s\n' % \
+                    (fn [:-6], size, ' '.join (expected), p.stdout.split (), p.stderr)
+    report ('batch ' + ' '.join (flags), ok, output)
+
+batch_errors = [
+    ('too many arguments', ['--compile'], 'fib.sl', ['10', '3 4'], 'batch line 2: wrong number of arguments for main'),
+    ('not a number', ['--compile'], 'fib.sl', ['10', 'ten'], 'batch line 2: not an integer'),
+    ('too many arguments', ['--vm'], 'nextprime-simple.sbc', ['10', '3 4'], 'batch line 2: wrong number of arguments for main'),
+    ('not a number', ['--vm'], 'nextprime-simple.sbc', ['10', '3x'], 'batch line 2: not an integer'),
+]
+
+def check_batch_errors (exe):
+    for (name, flags, program, lines, error) in batch_errors:
+        p = run_batch (exe, flags, os.path.join (examples_dir, program), lines)
+        got = (p.stderr.splitlines () or [''])[0]
+        report ('batch %s %s' % (flags [0], name), p.returncode != 0 and got == 'Error: ' + error,
+                'expected Error: %s, got %s' % (error, got))
+
+# Sends requests to --serve one at a time, rewriting the program in
+# between.  Each step is the source to write, or None to leave the
+# file alone, whether to keep its modification time, the argument and
+# the reply expected, or just the start of it.
+server_steps = [
+    ('let main n = n + 1 end\n', False, 1, '2'),
+    (None, False, 2, '3'),
+    # The file looks the same, so it isn't read again.
+    ('let main n = n + 2 end\n', True, 1, '2'),
+    # But it is once its modification time changes.
+    (None, False, 1, '3'),
+    # The first version was dropped, so it is compiled again.
+    ('let main n = n + 1 end\n', False, 1, '2'),
+    # Kills the worker, so the next request starts a new one.
+    ('let main n = n + end\n', False, 1, 'Error:'),
+    ('let main n = n * 3 end\n', False, 2, '6'),
+    (None, False, 5, '15'),
+]
+
+def check_server (exe, tmp):
+    program = os.path.join (tmp, 'serve.sl')
+    server = subprocess.Popen ([exe, '--serve'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, universal_newlines=True)
+    ok = True
+    output = ''
+    mtime = 0
+    for (source, keep_mtime, arg, expected) in server_steps:
+        if source is not None:
+            with open (program, 'w') as f:
+                f.write (source)
+        # Whole seconds, so that the times differ even on file systems
+        # that don't store fractions.
+        mtime = mtime if keep_mtime else mtime + 1
+        os.utime (program, ns=(mtime * 10**9, mtime * 10**9))
+        server.stdin.write ('%s %d\n' % (program, arg))
+        server.stdin.flush ()
+        reply = server.stdout.readline ().rstrip ('\n')
+        if not reply.startswith (expected) or (expected != 'Error:' and reply != expected):
+            ok = False
+            output += 'Failure on %s with %d: expected %s, got %s\n' % (repr (source), arg, expected, reply)
+    server.stdin.close ()
+    ok = server.wait () == 0 and ok
+    report ('server', ok, output)
+
+superinstructions = ['AddImm', 'MultiplyImm', 'JumpIfNotLess', 'JumpIfNotEqual', 'MoveMove']
+
+# Compiles the programs in the full suite to VM code, which must only
+# have the instructions every VM knows, and runs it on the suite.
+def check_emitted (exe, tmp):
+    suite = os.path.join (tmp, 'emitted')
+    full_dir = os.path.join (tests_dir, 'full')
+    ok = True
+    output = ''
+    os.mkdir (suite)
+    for fn in sorted (os.listdir (full_dir)):
+        if not fn.endswith ('.tests'):
+            continue
+        code = subprocess.check_output ([exe, '--emit-sbc', os.path.join (examples_dir, fn [:-6] + '.sl')],
+                                        universal_newlines=True)
+        for line in code.splitlines ():
+            if line.split () [1] in superinstructions:
+                ok = False
+                output += 'Superinstruction in %s: %s\n' % (fn [:-6], line)
+        with open (os.path.join (suite, fn [:-6] + '.sbc'), 'w') as f:
+            f.write (code)
+        shutil.copy (os.path.join (full_dir, fn), suite)
+    report ('emitted VM code', ok, output)
+    run_suite (exe, suite, ['--vm'], 'emitted VM code --vm')
+
+# Verified code and code that isn't are run by different loops, which
+# must count the same.
+def check_profile (exe):
+    ok = True
+    output = ''
+    for (program, args) in [('fib.sl', ['15']), ('eightqueens.sl', ['6']), ('nextprime.sl', ['1000'])]:
+        reports = []
+        for flags in [[], ['--no-verify']]:
+            p = subprocess.run ([exe, '--compile', '--profile=-'] + flags + [os.path.join (examples_dir, program)] + args,
+                                stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+            reports.append (p.stderr)
+        if reports [0] != reports [1]:
+            ok = False
+            output += 'Profiles of %s differ:\n%s\n%s\n' % (program, reports [0], reports [1])
+    report ('profile', ok, output)
+
+    p = subprocess.run ([exe, '--compile', '--engine=jit', '--profile=-', os.path.join (examples_dir, 'fib.sl'), '15'],
+                        stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+    error = 'Error: profiles can only be made with --engine=switch'
+    report ('profile --engine=jit', p.returncode != 0 and p.stderr.strip () == error, p.stderr)
+
+# Lists of functions to memoize in fib.sl, and the error they must
+# give, or None.
+memo_lists = [
+    ('fib', None),
+    ('fib,fib', None),
+    ('main,fib', None),
+    ('fib,', 'empty function name in memo list'),
+    (',fib', 'empty function name in memo list'),
+    ('nope', 'memoized function is not defined'),
+    # A name, but that of an argument.
+    ('n', 'memoized function is not defined'),
+]
+
+def check_memo_lists (exe):
+    for (names, error) in memo_lists:
+        for mode in ['--interpret', '--compile']:
+            p = subprocess.run ([exe, mode, '--memo=' + names, os.path.join (examples_dir, 'fib.sl'), '40'],
+                                stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+            if error is None:
+                ok = p.returncode == 0 and p.stdout == '102334155\n'
+            else:
+                ok = p.returncode != 0 and p.stderr.strip () == 'Error: ' + error
+            report ('%s --memo=%s' % (mode, names), ok, p.stdout + p.stderr)
+
+def main ():
+    exe = os.path.realpath (sys.argv [1] if len (sys.argv) > 1 else os.path.join (course_dir, 'simplang'))
+
+    for (suite, flags) in suites:
+        run_suite (exe, suite, flags)
+    with tempfile.TemporaryDirectory () as tmp:
+        check_binary (exe, tmp)
+        check_emitted (exe, tmp)
+        check_server (exe, tmp)
+    for threads in [1, 2, 4]:
+        check_batch_order (exe, ['--threads=%d' % threads])
+    # Batches smaller than a group of lanes, and ones whose last group
+    # on a thread is only partly filled.
+    for lanes in [4, 8]:
+        for threads in [1, 2]:
+            check_batch_order (exe, ['--lanes=%d' % lanes, '--threads=%d' % threads],
+                               [1, lanes - 1, lanes + 1, lanes * threads + 3])
+    check_batch_errors (exe)
+    check_profile (exe)
+    check_memo_lists (exe)
+
+    if failures > 0:
+        print ('%d failed' % failures)
+        sys.exit (1)
+
+main ()
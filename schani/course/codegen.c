@@ -0,0 +1,373 @@
+#include <assert.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "dynarr.h"
+
+typedef struct _scope_t
+{
+	int32_t symbol;
+	int32_t slot;
+	struct _scope_t *next;
+} scope_t;
+
+typedef struct
+{
+	int32_t head;
+	int32_t first_slot;
+	int n;
+} loop_info_t;
+
+/*
+ * Each function is compiled by itself, as if it started at instruction
+ * 0, with calls going to the indexes of the functions they call.
+ * link_program then puts the functions one after the other and fixes
+ * up the jumps and calls.
+ */
+
+typedef struct
+{
+	context_t *ctx;
+	program_t *program;
+	dynarr_t code;
+} codegen_t;
+
+static int32_t
+current_pc (codegen_t *cg)
+{
+	return (int32_t)dynarr_length(&cg->code);
+}
+
+static vm_ins_t*
+emit (codegen_t *cg, vm_opcode_t opcode, int32_t arg1, int32_t arg2, int32_t arg3)
+{
+	vm_ins_t *ins = pool_alloc(&cg->ctx->pool, sizeof(vm_ins_t));
+	ins->opcode = opcode;
+	ins->args.slot.arg1 = arg1;
+	ins->args.slot.arg2 = arg2;
+	ins->args.slot.arg3 = arg3;
+	ins->args.slot.arg4 = 0;
+	dynarr_append(&cg->code, ins);
+	return ins;
+}
+
+static void
+emit_set (codegen_t *cg, int32_t dst, int64_t imm)
+{
+	vm_ins_t *ins = pool_alloc(&cg->ctx->pool, sizeof(vm_ins_t));
+	ins->opcode = VM_OP_SET;
+	ins->args.imm.arg = dst;
+	ins->args.imm.arg2 = 0;
+	ins->args.imm.imm = imm;
+	dynarr_append(&cg->code, ins);
+}
+
+static void
+emit_move (codegen_t *cg, int32_t dst, int32_t src)
+{
+	if (dst != src)
+		emit(cg, VM_OP_MOVE, dst, src, 0);
+}
+
+static scope_t*
+scope_bind (codegen_t *cg, scope_t *scope, int32_t symbol, int32_t slot)
+{
+	scope_t *new = pool_alloc(&cg->ctx->pool, sizeof(scope_t));
+	new->symbol = symbol;
+	new->slot = slot;
+	new->next = scope;
+	return new;
+}
+
+static int32_t
+scope_lookup (scope_t *scope, int32_t symbol)
+{
+	for (; scope != NULL; scope = scope->next) {
+		if (scope->symbol == symbol)
+			return scope->slot;
+	}
+	error_assert(false, "unbound variable");
+	return 0;
+}
+
+static void compile_expr (codegen_t *cg, scope_t *scope, loop_info_t *loop, expr_t *expr, int32_t dst, int32_t free);
+
+// Returns the slot holding the value of EXPR.  Identifiers are used
+// in place, everything else is computed into DST.
+static int32_t
+compile_operand (codegen_t *cg, scope_t *scope, expr_t *expr, int32_t dst, int32_t free)
+{
+	if (expr->type == EXPR_IDENT)
+		return scope_lookup(scope, expr->v.ident.symbol);
+	compile_expr(cg, scope, NULL, expr, dst, free);
+	return dst;
+}
+
+static void
+compile_logic (codegen_t *cg, scope_t *scope, expr_t *expr, int32_t dst, int32_t free)
+{
+	int32_t left = compile_operand(cg, scope, expr->v.binary.left, dst, free);
+	vm_ins_t *skip;
+
+	if (expr->v.binary.op == TOKEN_LOGIC_AND) {
+		emit_move(cg, dst, left);
+		skip = emit(cg, VM_OP_JUMP_IF_ZERO, dst, 0, 0);
+	} else {
+		vm_ins_t *right_branch = emit(cg, VM_OP_JUMP_IF_ZERO, left, 0, 0);
+		emit_set(cg, dst, 1);
+		skip = emit(cg, VM_OP_JUMP, 0, 0, 0);
+		right_branch->args.slot.arg2 = current_pc(cg);
+	}
+
+	int32_t right = compile_operand(cg, scope, expr->v.binary.right, dst, free);
+	emit(cg, VM_OP_NOT, dst, right, 0);
+	emit(cg, VM_OP_NOT, dst, dst, 0);
+
+	if (expr->v.binary.op == TOKEN_LOGIC_AND)
+		skip->args.slot.arg2 = current_pc(cg);
+	else
+		skip->args.slot.arg1 = current_pc(cg);
+}
+
+static scope_t*
+compile_bindings (codegen_t *cg, scope_t *scope, expr_t *expr, int32_t first_slot)
+{
+	for (int i = 0; i < expr->v.let_loop.n; i++) {
+		binding_t *binding = &expr->v.let_loop.bindings[i];
+		int32_t slot = first_slot + i;
+		compile_expr(cg, scope, NULL, binding->expr, slot, slot + 1);
+		scope = scope_bind(cg, scope, binding->symbol, slot);
+	}
+	return scope;
+}
+
+// Computes EXPR into slot DST.  All slots from FREE upwards may be
+// used as temporaries.  LOOP is the innermost loop if EXPR is in tail
+// position with respect to it, otherwise NULL.
+static void
+compile_expr (codegen_t *cg, scope_t *scope, loop_info_t *loop, expr_t *expr, int32_t dst, int32_t free)
+{
+	switch (expr->type) {
+		case EXPR_INTEGER:
+			emit_set(cg, dst, expr->v.i);
+			break;
+
+		case EXPR_IDENT:
+			emit_move(cg, dst, scope_lookup(scope, expr->v.ident.symbol));
+			break;
+
+		case EXPR_IF: {
+			int32_t cond = compile_operand(cg, scope, expr->v.if_expr.condition, dst, free);
+			vm_ins_t *to_alternative = emit(cg, VM_OP_JUMP_IF_ZERO, cond, 0, 0);
+			compile_expr(cg, scope, loop, expr->v.if_expr.consequent, dst, free);
+			vm_ins_t *to_end = emit(cg, VM_OP_JUMP, 0, 0, 0);
+			to_alternative->args.slot.arg2 = current_pc(cg);
+			compile_expr(cg, scope, loop, expr->v.if_expr.alternative, dst, free);
+			to_end->args.slot.arg1 = current_pc(cg);
+			break;
+		}
+
+		case EXPR_UNARY: {
+			if (expr->v.unary.op == TOKEN_NEGATE && expr->v.unary.operand->type == EXPR_INTEGER) {
+				emit_set(cg, dst, -expr->v.unary.operand->v.i);
+				break;
+			}
+			int32_t operand = compile_operand(cg, scope, expr->v.unary.operand, dst, free);
+			switch (expr->v.unary.op) {
+				case TOKEN_NOT:
+					emit(cg, VM_OP_NOT, dst, operand, 0);
+					break;
+				case TOKEN_NEGATE:
+					emit(cg, VM_OP_NEGATE, dst, operand, 0);
+					break;
+				default:
+					assert(false);
+			}
+			break;
+		}
+
+		case EXPR_BINARY: {
+			vm_opcode_t opcode;
+
+			switch (expr->v.binary.op) {
+				case TOKEN_LOGIC_AND:
+				case TOKEN_LOGIC_OR:
+					compile_logic(cg, scope, expr, dst, free);
+					return;
+				case TOKEN_LESS:
+					opcode = VM_OP_LESS_THAN;
+					break;
+				case TOKEN_EQUALS:
+					opcode = VM_OP_EQUALS;
+					break;
+				case TOKEN_PLUS:
+					opcode = VM_OP_ADD;
+					break;
+				case TOKEN_TIMES:
+					opcode = VM_OP_MULTIPLY;
+					break;
+				default:
+					assert(false);
+			}
+
+			int32_t left = compile_operand(cg, scope, expr->v.binary.left, dst, free);
+			int32_t right = compile_operand(cg, scope, expr->v.binary.right, free, free + 1);
+			emit(cg, opcode, dst, left, right);
+			break;
+		}
+
+		case EXPR_LET: {
+			int n = expr->v.let_loop.n;
+			scope = compile_bindings(cg, scope, expr, free);
+			compile_expr(cg, scope, loop, expr->v.let_loop.body, dst, free + n);
+			break;
+		}
+
+		case EXPR_LOOP: {
+			loop_info_t info;
+			info.first_slot = free;
+			info.n = expr->v.let_loop.n;
+			scope = compile_bindings(cg, scope, expr, free);
+			info.head = current_pc(cg);
+			compile_expr(cg, scope, &info, expr->v.let_loop.body, dst, free + info.n);
+			break;
+		}
+
+		case EXPR_RECUR: {
+			int n = expr->v.recur.n;
+			error_assert(loop != NULL, "recur not in tail position of a loop");
+			error_assert(n == loop->n, "recur has the wrong number of arguments");
+			// All arguments must be computed before any of the loop
+			// variables is overwritten.
+			for (int i = 0; i < n; i++)
+				compile_expr(cg, scope, NULL, expr->v.recur.args[i], free + i, free + i + 1);
+			for (int i = 0; i < n; i++)
+				emit_move(cg, loop->first_slot + i, free + i);
+			emit(cg, VM_OP_JUMP, loop->head, 0, 0);
+			break;
+		}
+
+		case EXPR_CALL: {
+			int n = expr->v.call.n;
+			function_t *function = expr->v.call.function;
+			for (int i = 0; i < n; i++)
+				compile_expr(cg, scope, NULL, expr->v.call.args[i], free + i, free + i + 1);
+			emit(cg, VM_OP_CALL, function->index, free + n, dst);
+			break;
+		}
+
+		default:
+			assert(false);
+	}
+}
+
+function_code_t
+compile_function_code (context_t *ctx, program_t *program, function_t *function)
+{
+	codegen_t cg;
+	scope_t *scope = NULL;
+	function_code_t code;
+
+	cg.ctx = ctx;
+	cg.program = program;
+	dynarr_init(&cg.code, &ctx->pool);
+
+	for (int i = 0; i < function->n_args; i++)
+		scope = scope_bind(&cg, scope, function->arg_symbols[i], i - function->n_args);
+
+	int32_t result = compile_operand(&cg, scope, function->body, 0, 1);
+	emit(&cg, VM_OP_RETURN, result, 0, 0);
+
+	code.n_instructions = (int32_t)dynarr_length(&cg.code);
+	code.instructions = (vm_ins_t**)dynarr_data(&cg.code);
+	return code;
+}
+
+void
+link_program (program_t *program, function_code_t *code, vm_program_t *prog)
+{
+	function_t *main_function = lookup_function(program, "main");
+	int32_t n_functions = 0;
+	int32_t pc;
+
+	error_assert(main_function != NULL, "Function main must be defined.");
+
+	for (function_t *func = program->functions; func != NULL; func = func->next)
+		n_functions++;
+	int32_t *entries = malloc(sizeof(int32_t) * (n_functions > 0 ? n_functions : 1));
+	assert(entries != NULL);
+
+	// The program starts at instruction 0 with the arguments to main
+	// already pushed, so all we have to do there is jump to main.
+	pc = 1;
+	for (int32_t i = 0; i < n_functions; i++) {
+		entries[i] = pc;
+		pc += code[i].n_instructions;
+	}
+
+	prog->num_instructions = pc;
+	prog->instructions = malloc(sizeof(vm_ins_t) * prog->num_instructions);
+	assert(prog->instructions != NULL);
+	memset(&prog->instructions[0], 0, sizeof(vm_ins_t));
+	prog->instructions[0].opcode = VM_OP_JUMP;
+	prog->instructions[0].args.slot.arg1 = entries[main_function->index];
+
+	for (int32_t i = 0; i < n_functions; i++) {
+		int32_t base = entries[i];
+		for (int32_t j = 0; j < code[i].n_instructions; j++) {
+			vm_ins_t *ins = &prog->instructions[base + j];
+			memcpy(ins, code[i].instructions[j], sizeof(vm_ins_t));
+			switch (ins->opcode) {
+				case VM_OP_JUMP:
+					ins->args.slot.arg1 += base;
+					break;
+				case VM_OP_JUMP_IF_ZERO:
+					ins->args.slot.arg2 += base;
+					break;
+				case VM_OP_CALL:
+					error_assert(ins->args.slot.arg1 <= i, "function called before its definition");
+					ins->args.slot.arg1 = entries[ins->args.slot.arg1];
+					break;
+				default:
+					break;
+			}
+		}
+	}
+	prog->mapping = NULL;
+	prog->frame_sizes = NULL;
+
+	prog->names = calloc(prog->num_instructions, sizeof(const char*));
+	assert(prog->names != NULL);
+	for (function_t *func = program->functions; func != NULL; func = func->next)
+		prog->names[entries[func->index]] = func->name;
+
+	prog->memo_ids = NULL;
+	if (program->memo != NULL) {
+		prog->memo_ids = malloc(sizeof(int) * prog->num_instructions);
+		for (int i = 0; i < prog->num_instructions; i++)
+			prog->memo_ids[i] = -1;
+		for (function_t *func = program->functions; func != NULL; func = func->next)
+			prog->memo_ids[entries[func->index]] = func->memo_id;
+	}
+
+	free(entries);
+}
+
+void
+compile_program (context_t *ctx, program_t *program, vm_program_t *prog)
+{
+	// Everything the code generator allocates in the pool is garbage
+	// once the code has been copied out.
+	pool_mark_t mark = pool_mark(&ctx->pool);
+	int32_t n_functions = 0;
+
+	for (function_t *func = program->functions; func != NULL; func = func->next)
+		n_functions++;
+	function_code_t *code = pool_alloc(&ctx->pool, sizeof(function_code_t) * n_functions);
+	for (function_t *func = program->functions; func != NULL; func = func->next)
+		code[func->index] = compile_function_code(ctx, program, func);
+
+	link_program(program, code, prog);
+
+	pool_release(&ctx->pool, mark);
+}
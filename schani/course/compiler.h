@@ -7,11 +7,33 @@
 #include <stdlib.h>
 #include "pools.h"
 
-typedef struct {
-	pool_t pool;
-	FILE *file;
-	int lookahead;
-} context_t;
+/*
+ * A symbol table gives each distinct name a small integer id, from 0
+ * up, so that names can be compared and used as indexes cheaply.
+ */
+typedef struct
+{
+	pool_t pool;		// for the names
+	const char **names;	// by symbol id
+	uint32_t *hashes;
+	int32_t n_symbols;
+	int32_t names_size;
+	int32_t *table;		// symbol ids by hash, -1 for free entries
+	size_t table_size;
+} symtab_t;
+
+void symtab_init (symtab_t *symtab);
+void symtab_free (symtab_t *symtab);
+int32_t symtab_intern (symtab_t *symtab, const char *name, size_t length);
+// Returns -1 if NAME has no symbol.
+int32_t symtab_lookup (symtab_t *symtab, const char *name, size_t length);
+
+// The name stays where it is as long as the symbol table does.
+static inline const char*
+symtab_name (const symtab_t *symtab, int32_t id)
+{
+	return symtab->names[id];
+}
 
 typedef enum {
 	TOKEN_EOF,
@@ -57,16 +79,46 @@ typedef enum {
 } token_type_t;
 
 typedef struct {
-	token_type_t type;
+	uint8_t type;		// a token_type_t
+	uint32_t start;		// the offset in the source
 	union {
 		int64_t i;
-		char *name;
+		// An identifier is the slice of the source from START.
+		struct {
+			int32_t symbol;
+			uint32_t length;
+		} ident;
 	} v;
 } token_t;
 
-bool scan_init (context_t *ctx, const char *filename);
+typedef struct _context_t {
+	pool_t pool;
+	// The source is either mapped or read into BUFFER, or given by
+	// the caller, who keeps it until scan_free.
+	const char *source;
+	size_t source_size;
+	void *mapping;
+	char *buffer;
+	// All the tokens in the source, ending with a TOKEN_EOF, and the
+	// next one the parser looks at.
+	token_t *tokens;
+	size_t n_tokens;
+	size_t next_token;
+	// The identifiers scanned so far.  Their names in the syntax tree
+	// are the ones in here, so they can also be compared as pointers.
+	symtab_t symbols;
+	// The contexts of the parallel front end's threads, or NULL.  They
+	// share the source, tokens and symbols, which don't change after
+	// scanning, but each has its own pool, which holds the syntax
+	// trees of the functions it parsed.
+	struct _context_t *threads;
+	int n_threads;
+} context_t;
 
-token_t scan (context_t *ctx);
+bool scan_init (context_t *ctx, const char *filename);
+void scan_init_source (context_t *ctx, const char *source, size_t size);
+// Frees the tokens and the source, but not the symbols.
+void scan_free (context_t *ctx);
 
 static inline bool
 token_type_is_keyword (token_type_t t)
@@ -108,14 +160,20 @@ typedef struct _expr_t expr_t;
 
 typedef struct {
 	char *name;
+	int32_t symbol;
 	expr_t *expr;
+	int depends_on;		// the last earlier binding of the same let it uses, or -1
 } binding_t;
 
 struct _expr_t {
 	expr_type_t type;
 	union {
 		int64_t i;
-		char *ident;
+		struct {
+			char *name;
+			int32_t symbol;
+			int slot;
+		} ident;
 		struct {
 			expr_t *condition;
 			expr_t *consequent;
@@ -125,15 +183,21 @@ struct _expr_t {
 			int n;
 			binding_t *bindings;
 			expr_t *body;
+			int first_slot;
 		} let_loop;
 		struct {
 			int n;
 			expr_t **args;
+			int first_slot;
+			int scratch_slot;	// -1 if the loop variables can be assigned in place
 		} recur;
 		struct {
 			char *name;
+			int32_t symbol;
 			int n;
 			expr_t **args;
+			struct _function_t *function;
+			bool spawn;	// worth running in parallel with its siblings
 		} call;
 		struct {
 			token_type_t op;
@@ -150,34 +214,131 @@ struct _expr_t {
 typedef struct _function_t
 {
 	char *name;
+	int32_t symbol;
 	int n_args;
 	char **args;
+	int32_t *arg_symbols;
 	expr_t *body;
+	int n_slots;
+	int memo_id;		// -1 if not memoized
+	int32_t index;		// in the program, in source order
 
 	struct _function_t *next;
 } function_t;
 
+typedef struct _memo_t memo_t;
+
 typedef struct {
 	function_t *functions;
+	memo_t *memo;
+	// The first function named by each symbol, or NULL, for the
+	// symbols below N_SYMBOLS.
+	function_t **functions_by_symbol;
+	int32_t n_symbols;
 } program_t;
 
-typedef struct _environment_t
-{
-	char *name;
-	int64_t value;
-	struct _environment_t *next;
-} environment_t;
-
 void parser_init (context_t *ctx);
 
 expr_t* parse_expr (context_t *ctx);
 function_t* parse_function (context_t *ctx);
 program_t* parse_program (context_t *ctx);
+// Makes a program of the list of FUNCTIONS.
+program_t* new_program (context_t *ctx, function_t *functions);
 
 function_t* lookup_function (program_t *prog, char *name);
+function_t* lookup_function_symbol (program_t *prog, int32_t symbol);
 
-int64_t eval_expr (program_t *program, environment_t *env, expr_t *expr);
+int resolve_expr (program_t *program, expr_t *expr);
+void resolve_function (program_t *program, function_t *function);
+void resolve_program (program_t *program);
+
+int64_t eval_expr (program_t *program, expr_t *expr, int n_slots);
 int64_t eval_function (program_t *program, function_t *function, int64_t *args);
+int64_t eval_function_parallel (program_t *program, function_t *function, int64_t *args, int n_threads);
+
+/*
+ * A flat syntax tree has all expressions of a program in one array, in
+ * preorder, and refers to them, and to names, by 32-bit indexes.  Each
+ * expression takes 16 bytes, a third of an expr_t, without any side
+ * allocations, and a walk over a function goes through memory more or
+ * less in order.
+ *
+ * The first child of an expression, if it has any, always comes right
+ * after it.  The other children are in V.X, or, if there can be any
+ * number of them, in the shared REFS array, from V.X.A on:
+ *
+ *   INTEGER  V.I is the value
+ *   IDENT    N is the slot, V.X.A the symbol
+ *   IF       the condition is first, V.X.A the consequent, V.X.B the
+ *            alternative
+ *   LET      N bindings, V.X.B the body.  REFS[V.X.A] is the first
+ *   LOOP     slot, followed by the N binding expressions and then
+ *            their symbols
+ *   RECUR    N arguments.  REFS[V.X.A] is the first slot, the next one
+ *            the scratch slot, followed by the N argument expressions
+ *   UNARY    the operand is first
+ *   BINARY   the left operand is first, V.X.A the right operand
+ *   CALL     N arguments.  REFS[V.X.A] is the symbol of the function's
+ *            name, followed by the N argument expressions.  V.X.B is
+ *            the index of the function, or -1 if there is none of
+ *            that name
+ */
+typedef struct
+{
+	uint8_t type;		// an expr_type_t
+	uint8_t op;		// a token_type_t, for UNARY and BINARY
+	int32_t n;
+	union {
+		int64_t i;
+		struct {
+			int32_t a;
+			int32_t b;
+		} x;
+	} v;
+} flat_expr_t;
+
+typedef struct
+{
+	int32_t name;		// the symbol
+	int32_t n_args;
+	int32_t args;		// the arguments' symbols are at REFS[ARGS] on
+	int32_t n_slots;
+	int32_t body;
+	int32_t memo_id;	// -1 if not memoized
+} flat_function_t;
+
+typedef struct
+{
+	flat_expr_t *exprs;
+	int32_t n_exprs;
+	int32_t *refs;
+	int32_t n_refs;
+	flat_function_t *functions;	// in source order
+	int32_t n_functions;
+	symtab_t symbols;
+	memo_t *memo;
+} flat_program_t;
+
+// The flat tree doesn't share anything with PROGRAM, except the memo
+// table, which it takes over.
+flat_program_t* flatten_program (program_t *program);
+void flat_program_free (flat_program_t *flat);
+int32_t flat_lookup_function (flat_program_t *flat, const char *name);
+size_t flat_program_size (flat_program_t *flat);
+
+int64_t eval_flat_function (flat_program_t *flat, int32_t function, int64_t *args);
+
+// Functions with more arguments can't be memoized.
+#define MEMO_MAX_ARGS	4
+
+memo_t* memo_new (size_t max_bytes);
+void memo_free (memo_t *memo);
+int memo_register (memo_t *memo, const char *name, int n_args);
+int memo_n_args (memo_t *memo, int id);
+bool memo_lookup (memo_t *memo, int id, const int64_t *args, int64_t *result);
+void memo_insert (memo_t *memo, int id, const int64_t *args, int64_t result);
+void memo_print_stats (memo_t *memo, FILE *f);
+void memo_select (memo_t *memo, symtab_t *symbols, program_t *program, const char *names);
 
 // NOTE: keep in sync with which_opcode in vm.c!
 typedef enum {
@@ -192,43 +353,268 @@ typedef enum {
 	VM_OP_CALL,
 	VM_OP_RETURN,
 	VM_OP_LESS_THAN,
-	VM_OP_EQUALS
+	VM_OP_EQUALS,
+
+	// Superinstructions, produced by vm_fuse
+	VM_OP_ADD_IMM,
+	VM_OP_MULTIPLY_IMM,
+	VM_OP_JUMP_IF_NOT_LESS,
+	VM_OP_JUMP_IF_NOT_EQUAL,
+	VM_OP_MOVE_MOVE
 } vm_opcode_t;
 
+// Set, AddImm and MultiplyImm use the imm form, all other instructions
+// the slot form.
 typedef struct
 {
 	vm_opcode_t opcode;
 	union {
 		struct {
 			int32_t arg;
+			int32_t arg2;
 			int64_t imm;
 		} imm;
 		struct {
 			int32_t arg1;
 			int32_t arg2;
 			int32_t arg3;
+			int32_t arg4;
 		} slot;
 	} args;
 } vm_ins_t;
 
+static inline bool
+vm_opcode_has_imm (vm_opcode_t opcode)
+{
+	return opcode == VM_OP_SET || opcode == VM_OP_ADD_IMM || opcode == VM_OP_MULTIPLY_IMM;
+}
+
+// A call stack entry, with everything Return needs.
+typedef struct
+{
+	int64_t *stack_pointer;	// the caller's
+	int64_t *dst;		// where the result goes
+	int32_t return_pc;	// the instruction after the Call
+} vm_frame_t;
+
+/*
+ * A VM program.  Once it has been prepared with vm_fuse and vm_verify
+ * it is never changed, so any number of vm_t contexts can run it at
+ * the same time.
+ */
+typedef struct
+{
+	int32_t num_instructions;
+	vm_ins_t *instructions;
+	// If not NULL, the instructions are in a mapped binary file.
+	void *mapping;
+
+	// If not NULL, MEMO_IDS maps each instruction to the memo id of
+	// the function starting there, or -1.
+	int *memo_ids;
+
+	// If not NULL, NAMES maps each instruction to the name of the
+	// function starting there, or NULL.  Only used for profiles.
+	const char **names;
+
+	// Set by vm_verify, NULL if the code is not verified.  Maps each
+	// function entry to the number of slots its frame needs from the
+	// stack pointer up.
+	int32_t *frame_sizes;
+	// The number of slots below the stack pointer that the code
+	// starting at instruction 0 reads, i.e. its arguments.
+	int32_t entry_args;
+} vm_program_t;
+
+typedef struct _vm_jit_t vm_jit_t;
+typedef struct _vm_profile_t vm_profile_t;
+typedef struct _vm_traces_t vm_traces_t;
+
+// A context for running a program, with its stacks.
 typedef struct
 {
+	const vm_program_t *program;
+
 	int64_t *value_array;
 	size_t array_size;
 	size_t stack_pointer;
 
-	int32_t num_instructions;
-	vm_ins_t *instructions;
+	// All slots from USED_SLOTS up are still zero.
+	size_t used_slots;
 
-	int32_t *call_stack;
+	vm_frame_t *call_stack;
 	size_t call_stack_size;
 	size_t call_stack_pointer;
+
+	// The memo table, if the program has memoized functions.
+	memo_t *memo;
+
+	// The engines' translations of the program, made on the first run.
+	void *threaded_code;
+	vm_jit_t *jit;
+	bool jit_failed;
+	// If not NULL, vm_run traces hot loops.
+	vm_traces_t *traces;
+
+	// If not NULL, vm_run counts instructions and calls in it.
+	vm_profile_t *profile;
 } vm_t;
 
-void vm_init (vm_t *vm, size_t stack_size, size_t call_stack_size);
-void vm_load (vm_t *vm, const char *filename);
+/*
+ * The binary VM code format: a header followed, at INSTRUCTIONS_OFFSET,
+ * by the instructions as vm_ins_t records in the machine's byte order,
+ * so that the file can be mapped and run in place.
+ */
+#define VM_BINARY_MAGIC		0x43424c53	// "SLBC" in little endian
+#define VM_BINARY_VERSION	1
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t ins_size;		// sizeof(vm_ins_t)
+	uint32_t num_instructions;
+	uint32_t instructions_offset;
+} vm_binary_header_t;
+
+// The VM's stacks are only reserved, so they can be big.
+#define VM_STACK_SLOTS		((size_t)1 << 27)
+#define VM_CALL_STACK_SIZE	((size_t)1 << 24)
+
+void vm_load (vm_program_t *prog, const char *filename);
+const char* vm_opcode_name (vm_opcode_t opcode);
+// Writes the instruction at PC, without a newline.
+void vm_write_ins (const vm_program_t *prog, int32_t pc, FILE *f);
+void vm_write (vm_program_t *prog, FILE *f);
+void vm_write_binary (vm_program_t *prog, FILE *f);
+void vm_fuse (vm_program_t *prog);
+void vm_verify (vm_program_t *prog);
+
+void* vm_reserve_stack (size_t bytes, bool huge_pages);
+void vm_release_stack (void *start, size_t bytes);
+
+void vm_init (vm_t *vm, const vm_program_t *prog, size_t stack_size, size_t call_stack_size, bool huge_pages);
+void vm_reset (vm_t *vm);
+void vm_free (vm_t *vm);
 void vm_test_value_stack (vm_t *vm);
 void vm_push_args (vm_t *vm, int argc, int64_t *args);
 int64_t vm_run (vm_t *vm);
+int64_t vm_run_threaded (vm_t *vm);
+
+vm_jit_t* vm_jit_compile (const vm_program_t *prog);
+void vm_jit_free (vm_jit_t *jit);
+int64_t vm_run_jit (vm_t *vm);
+// Returns the code for the trace in PCS, to be called as
+// int32_t trace (int64_t *frame), or NULL if it can't be compiled.
+void* vm_jit_compile_trace (const vm_program_t *prog, int32_t *pcs, int32_t n, size_t *size);
+
+vm_traces_t* vm_traces_new (const vm_program_t *prog);
+void vm_traces_free (vm_traces_t *traces);
+// Called when verified code branches back to HEADER.  Returns the pc
+// to go on at.
+int32_t vm_trace_loop (vm_traces_t *traces, int64_t *sp, int32_t header);
+int64_t vm_run_trace (vm_t *vm);
+
+typedef struct _vm_spmd_t vm_spmd_t;
+
+vm_spmd_t* vm_spmd_new (const vm_program_t *prog, int lanes, size_t stack_size, size_t call_stack_size,
+			bool huge_pages);
+void vm_spmd_free (vm_spmd_t *spmd);
+void vm_run_spmd (vm_spmd_t *spmd, int n, int64_t **args, int *n_args, int64_t *results);
+
+typedef int64_t (*vm_engine_t) (vm_t *vm);
+
+// With LANES > 0 the batch is run on the SPMD engine instead of
+// ENGINE, that many runs at a time.
+void vm_run_batch (const vm_program_t *prog, vm_engine_t engine, int lanes, int n_args, FILE *in, FILE *out,
+		   int n_threads, bool huge_pages);
+
+/*
+ * Server mode runs programs on request, keeping them compiled between
+ * requests.  It reads requests from stdin and answers on stdout, or,
+ * with a SOCKET_PATH, serves the clients of a Unix domain socket
+ * there, one at a time.
+ */
+typedef struct
+{
+	vm_engine_t engine;
+	bool fuse;
+	bool verify;
+	bool huge_pages;
+	const char *memo_names;	// NULL if not memoizing
+	size_t memo_size;
+} server_options_t;
+
+void serve (const server_options_t *options, const char *socket_path);
+
+/*
+ * Instruction profiles.  Every instruction executed is counted, so the
+ * total is an exact measure of the work done, and calls are tracked to
+ * attribute the counts to functions, exclusively and inclusively, and
+ * to call stacks.
+ */
+struct _vm_profile_t
+{
+	const vm_program_t *program;
+	uint64_t total;
+	uint64_t *counts;	// per instruction
+
+	// Per function entry
+	uint64_t *calls;
+	uint64_t *inclusive;
+	uint64_t *exclusive;
+	uint32_t *active;	// number of frames on the stack
+
+	struct _vm_profile_frame_t *frames;
+	size_t n_frames;
+	size_t frames_size;
+	struct _vm_profile_node_t *root;
+};
+
+vm_profile_t* vm_profile_new (const vm_program_t *prog);
+void vm_profile_free (vm_profile_t *profile);
+void vm_profile_call (vm_profile_t *profile, int32_t entry);
+void vm_profile_return (vm_profile_t *profile);
+// Ends the frames that haven't returned, e.g. main's.
+void vm_profile_finish (vm_profile_t *profile);
+void vm_profile_write_report (vm_profile_t *profile, FILE *f);
+// One line per call stack, in the format flame graph tools read.
+void vm_profile_write_folded (vm_profile_t *profile, FILE *f);
+
+static inline void
+vm_profile_count (vm_profile_t *profile, int32_t pc)
+{
+	profile->counts[pc]++;
+	profile->total++;
+}
+
+void compile_program (context_t *ctx, program_t *program, vm_program_t *prog);
+
+/*
+ * The code of a single function, with jump targets relative to its
+ * start, and the indexes of the functions it calls in place of their
+ * entries, until link_program puts it in its place in the program.
+ */
+typedef struct
+{
+	vm_ins_t **instructions;
+	int32_t n_instructions;
+} function_code_t;
+
+function_code_t compile_function_code (context_t *ctx, program_t *program, function_t *function);
+// CODE has the code of each function in the program, by index.
+void link_program (program_t *program, function_code_t *code, vm_program_t *prog);
+
+/*
+ * The parallel front end splits the program into its functions at
+ * the top level "let ... end"s, and parses, resolves and compiles them
+ * on N_THREADS threads, which each allocate in their own pool.  The
+ * results are the same as those of parse_program with resolve_program,
+ * and of compile_program.
+ */
+program_t* parse_program_parallel (context_t *ctx, int n_threads);
+void compile_program_parallel (context_t *ctx, program_t *program, vm_program_t *prog);
+
+void emit_asm_program (context_t *ctx, program_t *program, FILE *out);
 
 #endif
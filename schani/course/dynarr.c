@@ -8,17 +8,16 @@ dynarr_init(dynarr_t *arr, pool_t *pool)
 	arr->pool = pool;
 	arr->length = 0;
 	arr->capacity = 4;
-	arr->data = pool_alloc(pool, sizeof(void*) * arr->capacity);
+	arr->data = pool_realloc(pool, NULL, 0, sizeof(void*) * arr->capacity);
 }
 
 void
 dynarr_append(dynarr_t *arr, void *p)
 {
 	if (arr->length >= arr->capacity) {
+		arr->data = pool_realloc(arr->pool, arr->data, sizeof(void*) * arr->capacity,
+					 sizeof(void*) * arr->capacity * 2);
 		arr->capacity *= 2;
-		void **new_data = pool_alloc(arr->pool, sizeof(void*) * arr->capacity);
-		memcpy(new_data, arr->data, sizeof(void*) * arr->length);
-		arr->data = new_data;
 	}
 
 	arr->data[arr->length++] = p;
@@ -49,14 +49,11 @@ allocString (pool_t *pool, int minSize, int *exponent)
 static char*
 reallocString (pool_t *pool, char *string, int minSize, int *exponent)
 {
-    char *new_string;
+    int oldSize = *exponent;
 
     *exponent = minSize * 2;
 
-    new_string = pool_alloc(pool, *exponent);
-    memcpy(new_string, string, minSize);
-
-    return new_string;
+    return pool_realloc(pool, string, oldSize, *exponent);
 }
 
 dynstring_t
@@ -0,0 +1,252 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+
+/*
+ * The arrays grow as the tree is walked, so nothing here holds on to a
+ * pointer into them across a call that can add to them.
+ */
+
+typedef struct
+{
+	flat_program_t *flat;
+	int32_t exprs_size;
+	int32_t refs_size;
+	// The index of the function named by each symbol below
+	// N_FUNCTION_SYMBOLS.  Function names are interned first, so the
+	// symbols from there on aren't functions.
+	int32_t *function_of_symbol;
+	int32_t n_function_symbols;
+} flattener_t;
+
+static int32_t
+add_expr (flattener_t *fl, expr_type_t type)
+{
+	flat_program_t *flat = fl->flat;
+
+	if (flat->n_exprs == fl->exprs_size) {
+		fl->exprs_size = fl->exprs_size == 0 ? 1024 : fl->exprs_size * 2;
+		flat->exprs = realloc(flat->exprs, sizeof(flat_expr_t) * fl->exprs_size);
+		assert(flat->exprs != NULL);
+	}
+
+	flat_expr_t *expr = &flat->exprs[flat->n_exprs];
+	memset(expr, 0, sizeof(flat_expr_t));
+	expr->type = type;
+	return flat->n_exprs++;
+}
+
+// Reserves N refs and returns the index of the first.
+static int32_t
+add_refs (flattener_t *fl, int32_t n)
+{
+	flat_program_t *flat = fl->flat;
+
+	while (flat->n_refs + n > fl->refs_size) {
+		fl->refs_size = fl->refs_size == 0 ? 1024 : fl->refs_size * 2;
+		flat->refs = realloc(flat->refs, sizeof(int32_t) * fl->refs_size);
+		assert(flat->refs != NULL);
+	}
+
+	int32_t index = flat->n_refs;
+	flat->n_refs += n;
+	return index;
+}
+
+static int32_t
+intern (flattener_t *fl, const char *name)
+{
+	return symtab_intern(&fl->flat->symbols, name, strlen(name));
+}
+
+static int32_t
+flatten_expr (flattener_t *fl, expr_t *expr)
+{
+	flat_program_t *flat = fl->flat;
+	int32_t index = add_expr(fl, expr->type);
+	int32_t child, refs, symbol;
+
+	switch (expr->type) {
+		case EXPR_INTEGER:
+			flat->exprs[index].v.i = expr->v.i;
+			break;
+
+		case EXPR_IDENT:
+			symbol = intern(fl, expr->v.ident.name);
+			flat->exprs[index].n = expr->v.ident.slot;
+			flat->exprs[index].v.x.a = symbol;
+			break;
+
+		case EXPR_IF:
+			flatten_expr(fl, expr->v.if_expr.condition);
+			child = flatten_expr(fl, expr->v.if_expr.consequent);
+			flat->exprs[index].v.x.a = child;
+			child = flatten_expr(fl, expr->v.if_expr.alternative);
+			flat->exprs[index].v.x.b = child;
+			break;
+
+		case EXPR_LET:
+		case EXPR_LOOP: {
+			int n = expr->v.let_loop.n;
+
+			refs = add_refs(fl, 1 + 2 * n);
+			flat->exprs[index].n = n;
+			flat->exprs[index].v.x.a = refs;
+			flat->refs[refs] = expr->v.let_loop.first_slot;
+			for (int i = 0; i < n; i++) {
+				binding_t *binding = &expr->v.let_loop.bindings[i];
+				child = flatten_expr(fl, binding->expr);
+				flat->refs[refs + 1 + i] = child;
+				symbol = intern(fl, binding->name);
+				flat->refs[refs + 1 + n + i] = symbol;
+			}
+			child = flatten_expr(fl, expr->v.let_loop.body);
+			flat->exprs[index].v.x.b = child;
+			break;
+		}
+
+		case EXPR_RECUR: {
+			int n = expr->v.recur.n;
+
+			refs = add_refs(fl, 2 + n);
+			flat->exprs[index].n = n;
+			flat->exprs[index].v.x.a = refs;
+			flat->refs[refs] = expr->v.recur.first_slot;
+			flat->refs[refs + 1] = expr->v.recur.scratch_slot;
+			for (int i = 0; i < n; i++) {
+				child = flatten_expr(fl, expr->v.recur.args[i]);
+				flat->refs[refs + 2 + i] = child;
+			}
+			break;
+		}
+
+		case EXPR_UNARY:
+			flat->exprs[index].op = expr->v.unary.op;
+			flatten_expr(fl, expr->v.unary.operand);
+			break;
+
+		case EXPR_BINARY:
+			flat->exprs[index].op = expr->v.binary.op;
+			flatten_expr(fl, expr->v.binary.left);
+			child = flatten_expr(fl, expr->v.binary.right);
+			flat->exprs[index].v.x.a = child;
+			break;
+
+		case EXPR_CALL: {
+			int n = expr->v.call.n;
+
+			symbol = intern(fl, expr->v.call.name);
+			refs = add_refs(fl, 1 + n);
+			flat->exprs[index].n = n;
+			flat->exprs[index].v.x.a = refs;
+			flat->exprs[index].v.x.b = symbol < fl->n_function_symbols ? fl->function_of_symbol[symbol] : -1;
+			flat->refs[refs] = symbol;
+			for (int i = 0; i < n; i++) {
+				child = flatten_expr(fl, expr->v.call.args[i]);
+				flat->refs[refs + 1 + i] = child;
+			}
+			break;
+		}
+
+		default:
+			assert(false);
+	}
+	return index;
+}
+
+flat_program_t*
+flatten_program (program_t *program)
+{
+	flat_program_t *flat = malloc(sizeof(flat_program_t));
+	flattener_t fl;
+	int32_t n = 0;
+
+	assert(flat != NULL);
+	memset(flat, 0, sizeof(flat_program_t));
+	symtab_init(&flat->symbols);
+	flat->memo = program->memo;
+	program->memo = NULL;
+
+	fl.flat = flat;
+	fl.exprs_size = 0;
+	fl.refs_size = 0;
+
+	for (function_t *func = program->functions; func != NULL; func = func->next)
+		n++;
+	flat->functions = malloc(sizeof(flat_function_t) * (n > 0 ? n : 1));
+	assert(flat->functions != NULL);
+
+	// If there are several functions of the same name, calls go to
+	// the first, as with lookup_function.
+	fl.function_of_symbol = malloc(sizeof(int32_t) * (n > 0 ? n : 1));
+	assert(fl.function_of_symbol != NULL);
+	fl.n_function_symbols = 0;
+	for (function_t *func = program->functions; func != NULL; func = func->next) {
+		int32_t symbol = intern(&fl, func->name);
+		if (symbol == fl.n_function_symbols)
+			fl.function_of_symbol[fl.n_function_symbols++] = flat->n_functions;
+		flat->functions[flat->n_functions++].name = symbol;
+	}
+
+	int32_t i = 0;
+	for (function_t *func = program->functions; func != NULL; func = func->next, i++) {
+		int32_t args = add_refs(&fl, func->n_args);
+		for (int j = 0; j < func->n_args; j++) {
+			int32_t symbol = intern(&fl, func->args[j]);
+			flat->refs[args + j] = symbol;
+		}
+		int32_t body = flatten_expr(&fl, func->body);
+
+		flat_function_t *function = &flat->functions[i];
+		function->n_args = func->n_args;
+		function->args = args;
+		function->n_slots = func->n_slots;
+		function->body = body;
+		function->memo_id = func->memo_id;
+	}
+	free(fl.function_of_symbol);
+
+	flat->exprs = realloc(flat->exprs, sizeof(flat_expr_t) * (flat->n_exprs > 0 ? flat->n_exprs : 1));
+	flat->refs = realloc(flat->refs, sizeof(int32_t) * (flat->n_refs > 0 ? flat->n_refs : 1));
+	assert(flat->exprs != NULL && flat->refs != NULL);
+	return flat;
+}
+
+void
+flat_program_free (flat_program_t *flat)
+{
+	if (flat->memo != NULL)
+		memo_free(flat->memo);
+	symtab_free(&flat->symbols);
+	free(flat->exprs);
+	free(flat->refs);
+	free(flat->functions);
+	free(flat);
+}
+
+int32_t
+flat_lookup_function (flat_program_t *flat, const char *name)
+{
+	for (int32_t i = 0; i < flat->n_functions; i++) {
+		if (strcmp(symtab_name(&flat->symbols, flat->functions[i].name), name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+// In bytes, including the symbol table.
+size_t
+flat_program_size (flat_program_t *flat)
+{
+	symtab_t *symbols = &flat->symbols;
+
+	return sizeof(flat_program_t)
+		+ sizeof(flat_expr_t) * flat->n_exprs
+		+ sizeof(int32_t) * flat->n_refs
+		+ sizeof(flat_function_t) * flat->n_functions
+		+ pool_used(&symbols->pool)
+		+ (sizeof(const char*) + sizeof(uint32_t)) * symbols->names_size
+		+ sizeof(int32_t) * symbols->table_size;
+}
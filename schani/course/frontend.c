@@ -0,0 +1,195 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "dynarr.h"
+#include "tasks.h"
+
+/*
+ * The parallel front end.  The scanner has already turned the whole
+ * source into tokens, and interned the identifiers, so the functions
+ * can be found by counting the "let"s, "if"s and "loop"s against the
+ * "end"s, without parsing.  Each step then runs over all functions as
+ * a fork-join task that splits the range of functions in halves.  The
+ * syntax tree of a function lives in the pool of the thread that
+ * parsed it, and its code in the pool of the thread that compiled it.
+ */
+
+typedef struct _front_end_t front_end_t;
+
+typedef void (*front_end_step_t) (front_end_t *fe, context_t *ctx, int32_t i);
+
+struct _front_end_t
+{
+	context_t *ctx;
+	program_t *program;
+	// The first token of each function, and the TOKEN_EOF after them
+	int32_t *starts;
+	int32_t n_functions;
+	function_t **functions;		// by index
+	function_code_t *code;
+	front_end_step_t step;
+};
+
+typedef struct
+{
+	task_t task;
+	front_end_t *fe;
+	int32_t begin;
+	int32_t end;
+} range_task_t;
+
+static void
+run_range (task_t *task, task_worker_t *worker)
+{
+	range_task_t *range = (range_task_t*)task;
+	front_end_t *fe = range->fe;
+
+	if (range->end - range->begin > 1) {
+		int32_t middle = range->begin + (range->end - range->begin) / 2;
+		range_task_t left = { .fe = fe, .begin = range->begin, .end = middle };
+		range_task_t right = { .fe = fe, .begin = middle, .end = range->end };
+
+		task_spawn(worker, &right.task, run_range);
+		run_range(&left.task, worker);
+		task_join(worker, &right.task);
+	} else if (range->end > range->begin) {
+		fe->step(fe, task_worker_data(worker), range->begin);
+	}
+}
+
+static void
+run_step (front_end_t *fe, front_end_step_t step)
+{
+	context_t *ctx = fe->ctx;
+	void *data[ctx->n_threads];
+	range_task_t root = { .fe = fe, .begin = 0, .end = fe->n_functions };
+
+	for (int i = 0; i < ctx->n_threads; i++)
+		data[i] = &ctx->threads[i];
+	fe->step = step;
+	task_run(ctx->n_threads, data, &root.task, run_range);
+}
+
+static void
+init_threads (context_t *ctx, int n_threads)
+{
+	assert(ctx->threads == NULL);
+	ctx->n_threads = n_threads;
+	ctx->threads = malloc(sizeof(context_t) * n_threads);
+	assert(ctx->threads != NULL);
+	for (int i = 0; i < n_threads; i++) {
+		context_t *thread = &ctx->threads[i];
+		memcpy(thread, ctx, sizeof(context_t));
+		pool_init(&thread->pool);
+		thread->threads = NULL;
+		thread->n_threads = 0;
+	}
+}
+
+// Finds the first token of each function.
+static void
+split_functions (front_end_t *fe)
+{
+	context_t *ctx = fe->ctx;
+	dynarr_t starts;
+	int depth = 0;
+
+	dynarr_init(&starts, &ctx->pool);
+	for (size_t i = 0; ctx->tokens[i].type != TOKEN_EOF; i++) {
+		switch (ctx->tokens[i].type) {
+			case TOKEN_LET:
+				if (depth == 0)
+					dynarr_append(&starts, (void*)(intptr_t)i);
+				// fall through
+			case TOKEN_IF:
+			case TOKEN_LOOP:
+				depth++;
+				break;
+			case TOKEN_END:
+				assert(depth > 0);
+				depth--;
+				break;
+			default:
+				assert(depth > 0);
+				break;
+		}
+	}
+	assert(depth == 0);
+
+	fe->n_functions = dynarr_length(&starts);
+	assert(fe->n_functions > 0);
+	fe->starts = pool_alloc(&ctx->pool, sizeof(int32_t) * (fe->n_functions + 1));
+	for (int32_t i = 0; i < fe->n_functions; i++)
+		fe->starts[i] = (int32_t)(intptr_t)dynarr_nth(&starts, i);
+	fe->starts[fe->n_functions] = ctx->n_tokens - 1;
+}
+
+static void
+parse_step (front_end_t *fe, context_t *ctx, int32_t i)
+{
+	ctx->next_token = fe->starts[i];
+	fe->functions[i] = parse_function(ctx);
+	assert(ctx->next_token == (size_t)fe->starts[i + 1]);
+}
+
+static void
+resolve_step (front_end_t *fe, context_t *ctx, int32_t i)
+{
+	resolve_function(fe->program, fe->functions[i]);
+}
+
+program_t*
+parse_program_parallel (context_t *ctx, int n_threads)
+{
+	front_end_t fe;
+
+	fe.ctx = ctx;
+	split_functions(&fe);
+	init_threads(ctx, n_threads);
+
+	fe.functions = pool_alloc(&ctx->pool, sizeof(function_t*) * fe.n_functions);
+	run_step(&fe, parse_step);
+
+	for (int32_t i = 0; i + 1 < fe.n_functions; i++)
+		fe.functions[i]->next = fe.functions[i + 1];
+	fe.program = new_program(ctx, fe.functions[0]);
+
+	run_step(&fe, resolve_step);
+	return fe.program;
+}
+
+static void
+compile_step (front_end_t *fe, context_t *ctx, int32_t i)
+{
+	fe->code[i] = compile_function_code(ctx, fe->program, fe->functions[i]);
+}
+
+void
+compile_program_parallel (context_t *ctx, program_t *program, vm_program_t *prog)
+{
+	front_end_t fe;
+	pool_mark_t marks[ctx->n_threads];
+	pool_mark_t mark = pool_mark(&ctx->pool);
+
+	assert(ctx->threads != NULL);
+	fe.ctx = ctx;
+	fe.program = program;
+	fe.n_functions = 0;
+	for (function_t *func = program->functions; func != NULL; func = func->next)
+		fe.n_functions++;
+	fe.functions = pool_alloc(&ctx->pool, sizeof(function_t*) * fe.n_functions);
+	for (function_t *func = program->functions; func != NULL; func = func->next)
+		fe.functions[func->index] = func;
+	fe.code = pool_alloc(&ctx->pool, sizeof(function_code_t) * fe.n_functions);
+
+	// Like compile_program, we only need the code until it's linked.
+	for (int i = 0; i < ctx->n_threads; i++)
+		marks[i] = pool_mark(&ctx->threads[i].pool);
+	run_step(&fe, compile_step);
+	link_program(program, fe.code, prog);
+	for (int i = 0; i < ctx->n_threads; i++)
+		pool_release(&ctx->threads[i].pool, marks[i]);
+	pool_release(&ctx->pool, mark);
+}
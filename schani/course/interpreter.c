@@ -3,31 +3,63 @@
 #include <string.h>
 
 #include "compiler.h"
+#include "tasks.h"
+
+// The number of slots in the interpreter's stack.
+#define INTERP_STACK_SLOTS	(1 << 20)
+
+/*
+ * The frames of all active calls live in one contiguous stack.  A new
+ * frame starts at TOP, which is the end of the caller's frame.
+ *
+ * In parallel mode each worker has its own interpreter and stack, and
+ * WORKER is not NULL.  Calls that the resolver marked to be spawned
+ * become tasks.  Their arguments are evaluated right away and kept
+ * above TOP until the task is joined.  A worker that steals a task
+ * runs it on its own stack, so frames are never shared.
+ */
+typedef struct
+{
+	int64_t *stack;
+	int64_t *top;
+	int64_t *limit;
+	memo_t *memo;
+	task_worker_t *worker;
+	flat_program_t *flat;	// when interpreting the flat tree
+} interp_t;
+
+typedef struct
+{
+	task_t task;
+	function_t *function;
+	int64_t *args;
+	int64_t result;
+} call_task_t;
 
 typedef struct
 {
 	int64_t i;
-	environment_t *loop_env;
+	bool is_recur;
 } intp_result_t;
 
 static inline intp_result_t
 make_int_result (int64_t i)
 {
-	intp_result_t res = { i, NULL };
+	intp_result_t res = { i, false };
 	return res;
 }
 
 static inline intp_result_t
-make_recur_result (environment_t *loop_env)
+make_recur_result (void)
 {
-	intp_result_t res = { 0, loop_env };
+	intp_result_t res = { 0, true };
 	return res;
 }
 
 static inline int64_t
 int_result (intp_result_t res)
 {
-	assert(res.loop_env == NULL);
+	assert(!res.is_recur);
 	return res.i;
 }
 
@@ -49,81 +81,238 @@ bool_to_int (bool b)
 		return make_int_result(0);
 }
 
-static int64_t
-env_lookup (environment_t *env, char *name)
+function_t*
+lookup_function (program_t *prog, char *name)
 {
-	for (;;) {
-		assert(env != NULL);
-		if (strcmp(env->name, name) == 0)
-			return env->value;
-		env = env->next;
+	for (function_t *func = prog->functions; func != NULL; func = func->next) {
+		if (strcmp(func->name, name) == 0)
+			return func;
 	}
+	return NULL;
+}
+
+function_t*
+lookup_function_symbol (program_t *prog, int32_t symbol)
+{
+	if (symbol >= prog->n_symbols)
+		return NULL;
+	return prog->functions_by_symbol[symbol];
+}
+
+static intp_result_t eval (interp_t *ip, int64_t *frame, expr_t *expr);
+
+static inline int64_t
+eval_value (interp_t *ip, int64_t *frame, expr_t *expr)
+{
+	return int_result(eval(ip, frame, expr));
+}
+
+// The arguments are already in the first slots of FRAME.
+static int64_t
+call_function (interp_t *ip, function_t *function, int64_t *frame)
+{
+	int64_t result;
+
+	if (function->memo_id >= 0 && memo_lookup(ip->memo, function->memo_id, frame, &result))
+		return result;
+
+	ip->top = frame + function->n_slots;
+	result = eval_value(ip, frame, function->body);
+
+	// The arguments are never assigned to, so they're still there.
+	if (function->memo_id >= 0)
+		memo_insert(ip->memo, function->memo_id, frame, result);
+	return result;
+}
+
+static void
+run_call_task (task_t *task, task_worker_t *worker)
+{
+	call_task_t *call = (call_task_t*)task;
+	interp_t *ip = task_worker_data(worker);
+	int64_t *callee = ip->top;
+
+	ip->worker = worker;
+	error_assert(callee + call->function->n_slots <= ip->limit, "stack overflow");
+	memcpy(callee, call->args, sizeof(int64_t) * call->function->n_args);
+	call->result = call_function(ip, call->function, callee);
+	ip->top = callee;
 }
 
-static environment_t*
-env_bind (environment_t *env, char *name, int64_t value)
+static inline bool
+is_spawned (interp_t *ip, expr_t *expr)
 {
-	environment_t *new = malloc(sizeof(environment_t));
-	new->name = name;
-	new->value = value;
-	new->next = env;
-	return new;
+	return ip->worker != NULL && expr->type == EXPR_CALL && expr->v.call.spawn;
 }
 
 static void
-env_free (environment_t *env, environment_t *old)
+spawn_call (interp_t *ip, int64_t *frame, expr_t *expr, call_task_t *task)
 {
-	while (env != old) {
-		environment_t *next = env->next;
-		free(env);
-		env = next;
+	int64_t *args = ip->top;
+
+	error_assert(args + expr->v.call.n <= ip->limit, "stack overflow");
+	for (int i = 0; i < expr->v.call.n; i++) {
+		args[i] = eval_value(ip, frame, expr->v.call.args[i]);
+		ip->top = args + i + 1;
 	}
+	task->function = expr->v.call.function;
+	task->args = args;
+	task_spawn(ip->worker, &task->task, run_call_task);
 }
 
-function_t*
-lookup_function (program_t *prog, char *name)
+static int64_t
+join_call (interp_t *ip, call_task_t *task)
 {
-	for (function_t *func = prog->functions; func != NULL; func = func->next) {
-		if (strcmp(func->name, name) == 0)
-			return func;
+	task_join(ip->worker, &task->task);
+	return task->result;
+}
+
+static void
+eval_bindings (interp_t *ip, int64_t *frame, expr_t *expr)
+{
+	int64_t *slots = frame + expr->v.let_loop.first_slot;
+	int n = expr->v.let_loop.n;
+	call_task_t tasks[n];
+	int pending[n];
+	int n_pending = 0;
+	int64_t *top = ip->top;
+
+	for (int i = 0; i < n; i++) {
+		binding_t *binding = &expr->v.let_loop.bindings[i];
+
+		if (n_pending > 0 && binding->depends_on >= pending[0]) {
+			while (n_pending > 0) {
+				int j = pending[--n_pending];
+				slots[j] = join_call(ip, &tasks[j]);
+			}
+			ip->top = top;
+		}
+
+		if (is_spawned(ip, binding->expr)) {
+			spawn_call(ip, frame, binding->expr, &tasks[i]);
+			pending[n_pending++] = i;
+		} else {
+			slots[i] = eval_value(ip, frame, binding->expr);
+		}
 	}
-	return NULL;
+
+	while (n_pending > 0) {
+		int j = pending[--n_pending];
+		slots[j] = join_call(ip, &tasks[j]);
+	}
+	ip->top = top;
 }
 
 static int64_t
-call_function (program_t *prog, char *name, int64_t *args)
+eval_call (interp_t *ip, int64_t *frame, expr_t *expr)
 {
-	function_t *func = lookup_function(prog, name);
-	assert(func != NULL);
-	return eval_function(prog, func, args);
+	function_t *function = expr->v.call.function;
+	int n = expr->v.call.n;
+	int64_t *callee = ip->top;
+	error_assert(callee + function->n_slots <= ip->limit, "stack overflow");
+
+	if (ip->worker != NULL) {
+		call_task_t tasks[n > 0 ? n : 1];
+
+		// The whole frame is reserved first, so that the spawned
+		// calls' arguments go above it.
+		ip->top = callee + n;
+		for (int i = 0; i < n; i++) {
+			expr_t *arg = expr->v.call.args[i];
+			if (is_spawned(ip, arg))
+				spawn_call(ip, frame, arg, &tasks[i]);
+			else
+				callee[i] = eval_value(ip, frame, arg);
+		}
+		for (int i = n - 1; i >= 0; i--) {
+			if (is_spawned(ip, expr->v.call.args[i]))
+				callee[i] = join_call(ip, &tasks[i]);
+		}
+		ip->top = callee + n;
+	} else {
+		// The arguments go straight into the new frame.  Each one
+		// is reserved as soon as it's computed, so that calls in
+		// the remaining arguments don't overwrite it.
+		for (int i = 0; i < n; i++) {
+			int64_t value = eval_value(ip, frame, expr->v.call.args[i]);
+			callee[i] = value;
+			ip->top = callee + i + 1;
+		}
+	}
+
+	int64_t result = call_function(ip, function, callee);
+	ip->top = callee;
+	return result;
 }
 
-static intp_result_t eval (program_t *prog, environment_t *env, expr_t *expr, expr_t *innermost_loop, environment_t *loop_env);
+static intp_result_t
+binary_result (token_type_t op, int64_t left, int64_t right)
+{
+	switch (op) {
+		case TOKEN_LESS:
+			return bool_to_int(left < right);
+
+		case TOKEN_EQUALS:
+			return bool_to_int(left == right);
 
-int64_t
-eval_expr (program_t *prog, environment_t *env, expr_t *expr)
+		case TOKEN_PLUS:
+			return make_int_result(left + right);
+
+		case TOKEN_TIMES:
+			return make_int_result(left * right);
+
+		default:
+			assert(false);
+			return make_int_result(0);
+	}
+}
+
+// One operand is a spawned call, which runs while the other one is
+// evaluated.  Neither is a logic operator, which the resolver doesn't
+// spawn.
+static intp_result_t
+eval_binary_parallel (interp_t *ip, int64_t *frame, expr_t *expr)
 {
-	return int_result(eval(prog, env, expr, NULL, NULL));
+	int64_t *top = ip->top;
+	call_task_t task;
+	int64_t left, right;
+
+	if (is_spawned(ip, expr->v.binary.right)) {
+		spawn_call(ip, frame, expr->v.binary.right, &task);
+		left = eval_value(ip, frame, expr->v.binary.left);
+		right = join_call(ip, &task);
+	} else {
+		spawn_call(ip, frame, expr->v.binary.left, &task);
+		right = eval_value(ip, frame, expr->v.binary.right);
+		left = join_call(ip, &task);
+	}
+	ip->top = top;
+	return binary_result(expr->v.binary.op, left, right);
 }
 
+/*
+ * FRAME holds the values of the function's variables, in the slots
+ * assigned by the resolver.  A recur stores the new values of the loop
+ * variables in the frame and returns a recur result to its loop.
+ */
 static intp_result_t
-eval (program_t *prog, environment_t *env, expr_t *expr, expr_t *innermost_loop, environment_t *loop_env)
+eval (interp_t *ip, int64_t *frame, expr_t *expr)
 {
 	switch (expr->type) {
 		case EXPR_INTEGER:
 			return make_int_result(expr->v.i);
 
 		case EXPR_IDENT:
-			return make_int_result(env_lookup(env, expr->v.ident));
+			return make_int_result(frame[expr->v.ident.slot]);
 
 		case EXPR_IF:
-			if (eval_expr(prog, env, expr->v.if_expr.condition))
-				return eval(prog, env, expr->v.if_expr.consequent, innermost_loop, loop_env);
+			if (eval_value(ip, frame, expr->v.if_expr.condition))
+				return eval(ip, frame, expr->v.if_expr.consequent);
 			else
-				return eval(prog, env, expr->v.if_expr.alternative, innermost_loop, loop_env);
+				return eval(ip, frame, expr->v.if_expr.alternative);
 
 		case EXPR_UNARY: {
-			int64_t operand = eval_expr(prog, env, expr->v.unary.operand);
+			int64_t operand = eval_value(ip, frame, expr->v.unary.operand);
 			switch (expr->v.unary.op) {
 				case TOKEN_NOT:
 					if (operand)
@@ -141,30 +330,182 @@ eval (program_t *prog, environment_t *env, expr_t *expr, expr_t *innermost_loop,
 		}
 
 		case EXPR_BINARY: {
-			int64_t left = eval_expr(prog, env, expr->v.binary.left);
+			if (is_spawned(ip, expr->v.binary.left) || is_spawned(ip, expr->v.binary.right))
+				return eval_binary_parallel(ip, frame, expr);
+			int64_t left = eval_value(ip, frame, expr->v.binary.left);
 			if (expr->v.binary.op == TOKEN_LOGIC_AND) {
 				if (!left)
 					return make_int_result(0);
-				return boolify_int(eval_expr(prog, env, expr->v.binary.right));
+				return boolify_int(eval_value(ip, frame, expr->v.binary.right));
 			}
 			if (expr->v.binary.op == TOKEN_LOGIC_OR) {
 				if (left)
 					return make_int_result(1);
-				return boolify_int(eval_expr(prog, env, expr->v.binary.right));
+				return boolify_int(eval_value(ip, frame, expr->v.binary.right));
+			}
+			int64_t right = eval_value(ip, frame, expr->v.binary.right);
+			return binary_result(expr->v.binary.op, left, right);
+		}
+
+		case EXPR_LET:
+			eval_bindings(ip, frame, expr);
+			return eval(ip, frame, expr->v.let_loop.body);
+
+		case EXPR_LOOP: {
+			eval_bindings(ip, frame, expr);
+			for (;;) {
+				intp_result_t result = eval(ip, frame, expr->v.let_loop.body);
+				if (!result.is_recur)
+					return result;
+			}
+		}
+
+		case EXPR_RECUR: {
+			int64_t *slots = frame + expr->v.recur.first_slot;
+			int n = expr->v.recur.n;
+			if (expr->v.recur.scratch_slot < 0) {
+				for (int i = 0; i < n; i++)
+					slots[i] = eval_value(ip, frame, expr->v.recur.args[i]);
+			} else {
+				int64_t *scratch = frame + expr->v.recur.scratch_slot;
+				for (int i = 0; i < n; i++)
+					scratch[i] = eval_value(ip, frame, expr->v.recur.args[i]);
+				memcpy(slots, scratch, sizeof(int64_t) * n);
 			}
-			int64_t right = eval_expr(prog, env, expr->v.binary.right);
-			switch (expr->v.binary.op) {
-				case TOKEN_LESS:
-					return bool_to_int(left < right);
+			return make_recur_result();
+		}
+
+		case EXPR_CALL:
+			return make_int_result(eval_call(ip, frame, expr));
+
+		default:
+			assert(false);
+	}
+}
+
+static void
+interp_init (interp_t *ip, program_t *prog)
+{
+	ip->stack = malloc(sizeof(int64_t) * INTERP_STACK_SLOTS);
+	assert(ip->stack != NULL);
+	ip->top = ip->stack;
+	ip->limit = ip->stack + INTERP_STACK_SLOTS;
+	ip->memo = prog != NULL ? prog->memo : NULL;
+	ip->worker = NULL;
+	ip->flat = NULL;
+}
+
+int64_t
+eval_expr (program_t *prog, expr_t *expr, int n_slots)
+{
+	interp_t ip;
+	interp_init(&ip, prog);
+	error_assert(n_slots <= INTERP_STACK_SLOTS, "stack overflow");
+	ip.top = ip.stack + n_slots;
+	int64_t result = eval_value(&ip, ip.stack, expr);
+	free(ip.stack);
+	return result;
+}
+
+int64_t
+eval_function (program_t *prog, function_t *function, int64_t *args)
+{
+	interp_t ip;
+	interp_init(&ip, prog);
+	error_assert(function->n_slots <= INTERP_STACK_SLOTS, "stack overflow");
+	memcpy(ip.stack, args, sizeof(int64_t) * function->n_args);
+	int64_t result = call_function(&ip, function, ip.stack);
+	free(ip.stack);
+	return result;
+}
+
+static intp_result_t eval_flat (interp_t *ip, int64_t *frame, int32_t index);
+
+static inline int64_t
+eval_flat_value (interp_t *ip, int64_t *frame, int32_t index)
+{
+	return int_result(eval_flat(ip, frame, index));
+}
+
+static int64_t
+call_flat_function (interp_t *ip, flat_function_t *function, int64_t *frame)
+{
+	int64_t result;
+
+	if (function->memo_id >= 0 && memo_lookup(ip->memo, function->memo_id, frame, &result))
+		return result;
+
+	ip->top = frame + function->n_slots;
+	result = eval_flat_value(ip, frame, function->body);
+
+	if (function->memo_id >= 0)
+		memo_insert(ip->memo, function->memo_id, frame, result);
+	return result;
+}
+
+static int64_t
+eval_flat_call (interp_t *ip, int64_t *frame, flat_expr_t *expr)
+{
+	flat_program_t *flat = ip->flat;
+	flat_function_t *function = &flat->functions[expr->v.x.b];
+	int32_t *args = &flat->refs[expr->v.x.a + 1];
+	int64_t *callee = ip->top;
+
+	assert(expr->v.x.b >= 0);
+	error_assert(callee + function->n_slots <= ip->limit, "stack overflow");
+	for (int i = 0; i < expr->n; i++) {
+		int64_t value = eval_flat_value(ip, frame, args[i]);
+		callee[i] = value;
+		ip->top = callee + i + 1;
+	}
+
+	int64_t result = call_flat_function(ip, function, callee);
+	ip->top = callee;
+	return result;
+}
+
+static void
+eval_flat_bindings (interp_t *ip, int64_t *frame, flat_expr_t *expr)
+{
+	flat_program_t *flat = ip->flat;
+	int32_t *refs = &flat->refs[expr->v.x.a];
+	int64_t *slots = frame + refs[0];
+
+	for (int i = 0; i < expr->n; i++)
+		slots[i] = eval_flat_value(ip, frame, refs[1 + i]);
+}
+
+// Like eval, on the flat tree, but without parallel calls.
+static intp_result_t
+eval_flat (interp_t *ip, int64_t *frame, int32_t index)
+{
+	flat_program_t *flat = ip->flat;
+	flat_expr_t *expr = &flat->exprs[index];
+
+	switch (expr->type) {
+		case EXPR_INTEGER:
+			return make_int_result(expr->v.i);
+
+		case EXPR_IDENT:
+			return make_int_result(frame[expr->n]);
 
-				case TOKEN_EQUALS:
-					return bool_to_int(left == right);
+		case EXPR_IF:
+			if (eval_flat_value(ip, frame, index + 1))
+				return eval_flat(ip, frame, expr->v.x.a);
+			else
+				return eval_flat(ip, frame, expr->v.x.b);
 
-				case TOKEN_PLUS:
-					return make_int_result(left + right);
+		case EXPR_UNARY: {
+			int64_t operand = eval_flat_value(ip, frame, index + 1);
+			switch (expr->op) {
+				case TOKEN_NOT:
+					if (operand)
+						return make_int_result(0);
+					else
+						return make_int_result(1);
 
-				case TOKEN_TIMES:
-					return make_int_result(left * right);
+				case TOKEN_NEGATE:
+					return make_int_result(-operand);
 
 				default:
 					assert(false);
@@ -172,48 +513,53 @@ eval (program_t *prog, environment_t *env, expr_t *expr, expr_t *innermost_loop,
 			break;
 		}
 
-		case EXPR_LET: {
-			environment_t *old = env;
-			for (int i = 0; i < expr->v.let_loop.n; i++) {
-				int64_t value = eval_expr(prog, env, expr->v.let_loop.bindings[i].expr);
-				env = env_bind(env, expr->v.let_loop.bindings[i].name, value);
+		case EXPR_BINARY: {
+			int64_t left = eval_flat_value(ip, frame, index + 1);
+			if (expr->op == TOKEN_LOGIC_AND) {
+				if (!left)
+					return make_int_result(0);
+				return boolify_int(eval_flat_value(ip, frame, expr->v.x.a));
 			}
-			intp_result_t result = eval(prog, env, expr->v.let_loop.body, innermost_loop, loop_env);
-			env_free(env, old);
-			return result;
+			if (expr->op == TOKEN_LOGIC_OR) {
+				if (left)
+					return make_int_result(1);
+				return boolify_int(eval_flat_value(ip, frame, expr->v.x.a));
+			}
+			int64_t right = eval_flat_value(ip, frame, expr->v.x.a);
+			return binary_result(expr->op, left, right);
 		}
 
+		case EXPR_LET:
+			eval_flat_bindings(ip, frame, expr);
+			return eval_flat(ip, frame, expr->v.x.b);
+
 		case EXPR_LOOP: {
-			environment_t *old = env;
-			for (int i = 0; i < expr->v.let_loop.n; i++) {
-				int64_t value = eval_expr(prog, env, expr->v.let_loop.bindings[i].expr);
-				env = env_bind(env, expr->v.let_loop.bindings[i].name, value);
-			}
+			eval_flat_bindings(ip, frame, expr);
 			for (;;) {
-				intp_result_t result = eval(prog, env, expr->v.let_loop.body, expr, old);
-				env_free(env, old);
-				if (result.loop_env == NULL)
+				intp_result_t result = eval_flat(ip, frame, expr->v.x.b);
+				if (!result.is_recur)
 					return result;
-				env = result.loop_env;
 			}
 		}
 
 		case EXPR_RECUR: {
-			assert(innermost_loop != NULL && innermost_loop->type == EXPR_LOOP);
-			assert(expr->v.recur.n == innermost_loop->v.let_loop.n);
-			for (int i = 0; i < expr->v.recur.n; i++) {
-				int64_t value = eval_expr(prog, env, expr->v.recur.args[i]);
-				loop_env = env_bind(loop_env, innermost_loop->v.let_loop.bindings[i].name, value);
+			int32_t *refs = &flat->refs[expr->v.x.a];
+			int64_t *slots = frame + refs[0];
+			int n = expr->n;
+			if (refs[1] < 0) {
+				for (int i = 0; i < n; i++)
+					slots[i] = eval_flat_value(ip, frame, refs[2 + i]);
+			} else {
+				int64_t *scratch = frame + refs[1];
+				for (int i = 0; i < n; i++)
+					scratch[i] = eval_flat_value(ip, frame, refs[2 + i]);
+				memcpy(slots, scratch, sizeof(int64_t) * n);
 			}
-			return make_recur_result(loop_env);
+			return make_recur_result();
 		}
 
-		case EXPR_CALL: {
-			int64_t args[expr->v.call.n];
-			for (int i = 0; i < expr->v.call.n; i++)
-				args[i] = eval_expr(prog, env, expr->v.call.args[i]);
-			return make_int_result(call_function(prog, expr->v.call.name, args));
-		}
+		case EXPR_CALL:
+			return make_int_result(eval_flat_call(ip, frame, expr));
 
 		default:
 			assert(false);
@@ -221,12 +567,44 @@ eval (program_t *prog, environment_t *env, expr_t *expr, expr_t *innermost_loop,
 }
 
 int64_t
-eval_function (program_t *prog, function_t *function, int64_t *args)
+eval_flat_function (flat_program_t *flat, int32_t function, int64_t *args)
 {
-	environment_t *env = NULL;
-	for (int i = 0; i < function->n_args; i++)
-		env = env_bind(env, function->args[i], args[i]);
-	int64_t result = eval_expr(prog, env, function->body);
-	env_free(env, NULL);
+	flat_function_t *func = &flat->functions[function];
+	interp_t ip;
+
+	interp_init(&ip, NULL);
+	ip.memo = flat->memo;
+	ip.flat = flat;
+	error_assert(func->n_slots <= INTERP_STACK_SLOTS, "stack overflow");
+	memcpy(ip.stack, args, sizeof(int64_t) * func->n_args);
+	int64_t result = call_flat_function(&ip, func, ip.stack);
+	free(ip.stack);
 	return result;
 }
+
+/*
+ * Like eval_function, but spawns the calls the resolver marked onto a
+ * work-stealing scheduler with N_THREADS workers.  The memo table isn't
+ * thread-safe, so PROG must not have one.
+ */
+int64_t
+eval_function_parallel (program_t *prog, function_t *function, int64_t *args, int n_threads)
+{
+	interp_t ips[n_threads];
+	void *data[n_threads];
+	call_task_t root;
+
+	assert(prog->memo == NULL);
+	for (int i = 0; i < n_threads; i++) {
+		interp_init(&ips[i], prog);
+		data[i] = &ips[i];
+	}
+
+	root.function = function;
+	root.args = args;
+	task_run(n_threads, data, &root.task, run_call_task);
+
+	for (int i = 0; i < n_threads; i++)
+		free(ips[i].stack);
+	return root.result;
+}
@@ -0,0 +1,881 @@
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "compiler.h"
+#include "x86.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+/*
+ * The JIT translates the whole instruction array into x86-64 code.
+ *
+ * The code is split into functions, starting at instruction 0 and at
+ * every Call target.  A function consists of all the instructions that
+ * can be reached from its start without following a Call.  Code that
+ * is reachable from more than one function is compiled once for each
+ * of them.  Within a function the most frequently used
+ * slots live in registers.  They are written back to the value array
+ * before a Call or Return and reloaded after a Call, so the value array
+ * looks exactly like it would in vm_run whenever control passes from
+ * one function to another.
+ *
+ * Calls and Returns are native calls and rets, on a separate native
+ * stack that has room for exactly as many return addresses as the VM's
+ * call stack.  The code and the native stack are kept in the context,
+ * so a context that runs many times compiles only once.  Each
+ * function's prologue also tracks the highest frame end, so that
+ * vm_reset knows how many slots to clear.  RBX points to the current frame (the slot $0) and RBP to
+ * a jit_context_t.
+ *
+ * Whenever the generated code would overflow one of the stacks it
+ * bails out, and vm_run_jit starts over with vm_run, which will then
+ * run into the same problem and report it.  Programs the JIT can't
+ * handle, such as ones that jump outside the code, are run with vm_run,
+ * too.
+ */
+
+#define JIT_NUM_CACHED		10
+
+typedef struct
+{
+	int64_t *low;
+	int64_t *high;
+	void *native_stack_top;
+	void *native_stack_limit;
+	int64_t native_stack_bytes;
+	void *saved_rsp;
+	int64_t failed;
+	int64_t *high_water;
+} jit_context_t;
+
+#define CTX_LOW			0
+#define CTX_HIGH		8
+#define CTX_STACK_TOP		16
+#define CTX_STACK_LIMIT		24
+#define CTX_STACK_BYTES		32
+#define CTX_SAVED_RSP		40
+#define CTX_FAILED		48
+#define CTX_HIGH_WATER		56
+
+static const x86_reg_t cached_regs[JIT_NUM_CACHED] = {
+	X86_RSI, X86_RDI, X86_R8, X86_R9, X86_R10, X86_R11, X86_R12, X86_R13, X86_R14, X86_R15
+};
+
+typedef struct
+{
+	int32_t entry;
+	int32_t *pcs;
+	int32_t n_pcs;
+	int32_t min_slot;
+	int32_t max_slot;
+	int n_cached;
+	int32_t cached_slots[JIT_NUM_CACHED];
+	bool cached_written[JIT_NUM_CACHED];
+	size_t entry_offset;
+} jit_function_t;
+
+typedef struct
+{
+	size_t at;
+	int32_t pc;
+} jit_fixup_t;
+
+struct _vm_jit_t
+{
+	void *code;
+	size_t size;
+	int64_t (*entry) (int64_t *frame, jit_context_t *ctx);
+	void *stack;
+	size_t stack_bytes;
+};
+
+typedef struct
+{
+	const vm_program_t *prog;
+	x86_buf_t buf;
+	int32_t *function_at;
+	int32_t *visited;
+	jit_function_t *functions;
+	int n_functions;
+	size_t *pc_offsets;
+	jit_fixup_t *jumps;
+	int n_jumps;
+	jit_fixup_t *calls;
+	int n_calls;
+	size_t bail_offset;
+	size_t epilogue_offset;
+	jit_function_t *current;
+} jit_compiler_t;
+
+// Stores the slots instruction INS accesses in SLOTS, and whether they
+// are written to in WRITTEN.  Returns the number of slots.
+static int
+ins_slots (vm_ins_t *ins, int32_t *slots, bool *written)
+{
+	switch (ins->opcode) {
+		case VM_OP_SET:
+			slots[0] = ins->args.imm.arg;
+			written[0] = true;
+			return 1;
+		case VM_OP_MOVE:
+		case VM_OP_NEGATE:
+		case VM_OP_NOT:
+			slots[0] = ins->args.slot.arg1;
+			written[0] = true;
+			slots[1] = ins->args.slot.arg2;
+			written[1] = false;
+			return 2;
+		case VM_OP_ADD:
+		case VM_OP_MULTIPLY:
+		case VM_OP_LESS_THAN:
+		case VM_OP_EQUALS:
+			slots[0] = ins->args.slot.arg1;
+			written[0] = true;
+			slots[1] = ins->args.slot.arg2;
+			written[1] = false;
+			slots[2] = ins->args.slot.arg3;
+			written[2] = false;
+			return 3;
+		case VM_OP_ADD_IMM:
+		case VM_OP_MULTIPLY_IMM:
+			slots[0] = ins->args.imm.arg;
+			written[0] = true;
+			slots[1] = ins->args.imm.arg2;
+			written[1] = false;
+			return 2;
+		case VM_OP_MOVE_MOVE:
+			slots[0] = ins->args.slot.arg1;
+			written[0] = true;
+			slots[1] = ins->args.slot.arg2;
+			written[1] = false;
+			slots[2] = ins->args.slot.arg3;
+			written[2] = true;
+			slots[3] = ins->args.slot.arg4;
+			written[3] = false;
+			return 4;
+		case VM_OP_JUMP_IF_NOT_LESS:
+		case VM_OP_JUMP_IF_NOT_EQUAL:
+			slots[0] = ins->args.slot.arg1;
+			written[0] = false;
+			slots[1] = ins->args.slot.arg2;
+			written[1] = false;
+			return 2;
+		case VM_OP_JUMP_IF_ZERO:
+		case VM_OP_RETURN:
+			slots[0] = ins->args.slot.arg1;
+			written[0] = false;
+			return 1;
+		case VM_OP_CALL:
+			slots[0] = ins->args.slot.arg3;
+			written[0] = true;
+			return 1;
+		case VM_OP_JUMP:
+			return 0;
+		default:
+			assert(false);
+			return 0;
+	}
+}
+
+static bool
+ins_falls_through (vm_ins_t *ins)
+{
+	return ins->opcode != VM_OP_JUMP && ins->opcode != VM_OP_RETURN;
+}
+
+static bool
+valid_target (jit_compiler_t *jc, int32_t target)
+{
+	return target >= 0 && target < jc->prog->num_instructions;
+}
+
+static int
+compare_pcs (const void *a, const void *b)
+{
+	return *(const int32_t*)a - *(const int32_t*)b;
+}
+
+// Collects the instructions of FUNC, in order.  VISITED must not
+// contain the function's index anywhere yet.
+static bool
+collect_function (jit_compiler_t *jc, int f)
+{
+	const vm_program_t *prog = jc->prog;
+	jit_function_t *func = &jc->functions[f];
+	int32_t *work = malloc(sizeof(int32_t) * prog->num_instructions);
+	int32_t n_work = 0;
+	bool ok = true;
+
+	func->n_pcs = 0;
+	work[n_work++] = func->entry;
+	jc->visited[func->entry] = f;
+
+	while (n_work > 0) {
+		int32_t pc = work[--n_work];
+		vm_ins_t *ins = &prog->instructions[pc];
+		int32_t succs[2];
+		int n_succs = 0;
+
+		work[prog->num_instructions - 1 - func->n_pcs++] = pc;
+
+		if (ins->opcode == VM_OP_JUMP)
+			succs[n_succs++] = ins->args.slot.arg1;
+		if (ins->opcode == VM_OP_JUMP_IF_ZERO)
+			succs[n_succs++] = ins->args.slot.arg2;
+		if (ins->opcode == VM_OP_JUMP_IF_NOT_LESS || ins->opcode == VM_OP_JUMP_IF_NOT_EQUAL)
+			succs[n_succs++] = ins->args.slot.arg3;
+		if (ins_falls_through(ins))
+			succs[n_succs++] = pc + 1;
+
+		for (int i = 0; i < n_succs; i++) {
+			if (!valid_target(jc, succs[i])) {
+				ok = false;
+				break;
+			}
+			if (jc->visited[succs[i]] != f) {
+				jc->visited[succs[i]] = f;
+				work[n_work++] = succs[i];
+			}
+		}
+		if (!ok)
+			break;
+	}
+
+	// The pcs were collected at the end of the work array.
+	if (ok) {
+		func->pcs = malloc(sizeof(int32_t) * func->n_pcs);
+		memcpy(func->pcs, work + prog->num_instructions - func->n_pcs, sizeof(int32_t) * func->n_pcs);
+		qsort(func->pcs, func->n_pcs, sizeof(int32_t), compare_pcs);
+	}
+
+	free(work);
+	return ok;
+}
+
+// Splits the code into functions and checks that control never leaves
+// the code.
+static bool
+find_functions (jit_compiler_t *jc)
+{
+	const vm_program_t *prog = jc->prog;
+	int32_t n = prog->num_instructions;
+
+	for (int32_t pc = 0; pc < n; pc++)
+		jc->function_at[pc] = -1;
+
+	jc->n_functions = 0;
+	jc->function_at[0] = jc->n_functions++;
+	for (int32_t pc = 0; pc < n; pc++) {
+		vm_ins_t *ins = &prog->instructions[pc];
+		if (ins->opcode != VM_OP_CALL)
+			continue;
+		if (!valid_target(jc, ins->args.slot.arg1))
+			return false;
+		if (jc->function_at[ins->args.slot.arg1] < 0)
+			jc->function_at[ins->args.slot.arg1] = jc->n_functions++;
+	}
+
+	jc->functions = calloc(jc->n_functions, sizeof(jit_function_t));
+	for (int32_t pc = 0; pc < n; pc++) {
+		if (jc->function_at[pc] >= 0)
+			jc->functions[jc->function_at[pc]].entry = pc;
+	}
+
+	for (int32_t pc = 0; pc < n; pc++)
+		jc->visited[pc] = -1;
+	for (int f = 0; f < jc->n_functions; f++) {
+		if (!collect_function(jc, f))
+			return false;
+	}
+
+	return true;
+}
+
+// Picks the slots to keep in registers and computes the frame extent.
+static bool
+analyze_function (jit_compiler_t *jc, jit_function_t *func)
+{
+	int32_t slots[4];
+	bool written[4];
+
+	func->min_slot = 0;
+	func->max_slot = 0;
+	for (int32_t i = 0; i < func->n_pcs; i++) {
+		vm_ins_t *ins = &jc->prog->instructions[func->pcs[i]];
+		if (ins->opcode == VM_OP_CALL && !x86_fits_int32((int64_t)ins->args.slot.arg2 * 8))
+			return false;
+		int n = ins_slots(ins, slots, written);
+		for (int i = 0; i < n; i++) {
+			if (slots[i] < func->min_slot)
+				func->min_slot = slots[i];
+			if (slots[i] > func->max_slot)
+				func->max_slot = slots[i];
+		}
+	}
+
+	if (!x86_fits_int32((int64_t)func->min_slot * 8) || !x86_fits_int32(((int64_t)func->max_slot + 1) * 8))
+		return false;
+
+	int32_t range = func->max_slot - func->min_slot + 1;
+	int *uses = calloc(range, sizeof(int));
+	bool *is_written = calloc(range, sizeof(bool));
+
+	for (int32_t j = 0; j < func->n_pcs; j++) {
+		int n = ins_slots(&jc->prog->instructions[func->pcs[j]], slots, written);
+		for (int i = 0; i < n; i++) {
+			uses[slots[i] - func->min_slot]++;
+			if (written[i])
+				is_written[slots[i] - func->min_slot] = true;
+		}
+	}
+
+	func->n_cached = 0;
+	while (func->n_cached < JIT_NUM_CACHED) {
+		int best = -1;
+		for (int32_t i = 0; i < range; i++) {
+			if (uses[i] > 0 && (best < 0 || uses[i] > uses[best]))
+				best = i;
+		}
+		if (best < 0)
+			break;
+		func->cached_slots[func->n_cached] = best + func->min_slot;
+		func->cached_written[func->n_cached] = is_written[best];
+		func->n_cached++;
+		uses[best] = 0;
+	}
+
+	free(uses);
+	free(is_written);
+	return true;
+}
+
+static x86_operand_t
+slot_operand (jit_compiler_t *jc, int32_t slot)
+{
+	jit_function_t *func = jc->current;
+	for (int i = 0; i < func->n_cached; i++) {
+		if (func->cached_slots[i] == slot)
+			return x86_reg(cached_regs[i]);
+	}
+	return x86_mem(X86_RBX, slot * 8);
+}
+
+static void
+load (jit_compiler_t *jc, x86_reg_t reg, int32_t slot)
+{
+	x86_mov(&jc->buf, x86_reg(reg), slot_operand(jc, slot));
+}
+
+static void
+store (jit_compiler_t *jc, int32_t slot, x86_reg_t reg)
+{
+	x86_mov(&jc->buf, slot_operand(jc, slot), x86_reg(reg));
+}
+
+static void
+write_back (jit_compiler_t *jc)
+{
+	jit_function_t *func = jc->current;
+	for (int i = 0; i < func->n_cached; i++) {
+		if (func->cached_written[i])
+			x86_mov(&jc->buf, x86_mem(X86_RBX, func->cached_slots[i] * 8), x86_reg(cached_regs[i]));
+	}
+}
+
+static void
+reload (jit_compiler_t *jc, int32_t except_slot)
+{
+	jit_function_t *func = jc->current;
+	for (int i = 0; i < func->n_cached; i++) {
+		if (func->cached_slots[i] != except_slot)
+			x86_mov(&jc->buf, x86_reg(cached_regs[i]), x86_mem(X86_RBX, func->cached_slots[i] * 8));
+	}
+}
+
+static void
+add_fixup (jit_fixup_t **fixups, int *n, size_t at, int32_t pc)
+{
+	if ((*n & (*n - 1)) == 0)
+		*fixups = realloc(*fixups, sizeof(jit_fixup_t) * (*n == 0 ? 1 : *n * 2));
+	(*fixups)[*n].at = at;
+	(*fixups)[*n].pc = pc;
+	(*n)++;
+}
+
+static void
+bail_if (jit_compiler_t *jc, x86_cc_t cc)
+{
+	size_t at = x86_jcc(&jc->buf, cc);
+	x86_patch_rel32(&jc->buf, at, jc->bail_offset);
+}
+
+static void
+compile_prologue (jit_compiler_t *jc, jit_function_t *func)
+{
+	x86_buf_t *buf = &jc->buf;
+
+	func->entry_offset = x86_offset(buf);
+
+	x86_lea(buf, X86_RAX, x86_mem(X86_RBX, (func->max_slot + 1) * 8));
+	x86_cmp(buf, X86_RAX, x86_mem(X86_RBP, CTX_HIGH));
+	bail_if(jc, X86_CC_A);
+	x86_cmp(buf, X86_RAX, x86_mem(X86_RBP, CTX_HIGH_WATER));
+	size_t below = x86_jcc(buf, X86_CC_BE);
+	x86_mov(buf, x86_mem(X86_RBP, CTX_HIGH_WATER), x86_reg(X86_RAX));
+	x86_patch_rel32(buf, below, x86_offset(buf));
+	if (func->min_slot < 0) {
+		x86_lea(buf, X86_RAX, x86_mem(X86_RBX, func->min_slot * 8));
+		x86_cmp(buf, X86_RAX, x86_mem(X86_RBP, CTX_LOW));
+		bail_if(jc, X86_CC_B);
+	}
+	x86_cmp(buf, X86_RSP, x86_mem(X86_RBP, CTX_STACK_LIMIT));
+	bail_if(jc, X86_CC_B);
+
+	reload(jc, INT32_MIN);
+}
+
+static void
+compile_binary (jit_compiler_t *jc, vm_ins_t *ins)
+{
+	x86_buf_t *buf = &jc->buf;
+	x86_operand_t right = slot_operand(jc, ins->args.slot.arg3);
+
+	load(jc, X86_RAX, ins->args.slot.arg2);
+	switch (ins->opcode) {
+		case VM_OP_ADD:
+			x86_add(buf, X86_RAX, right);
+			break;
+		case VM_OP_MULTIPLY:
+			x86_imul(buf, X86_RAX, right);
+			break;
+		case VM_OP_LESS_THAN:
+			x86_cmp(buf, X86_RAX, right);
+			x86_setcc_rax(buf, X86_CC_L);
+			break;
+		case VM_OP_EQUALS:
+			x86_cmp(buf, X86_RAX, right);
+			x86_setcc_rax(buf, X86_CC_E);
+			break;
+		default:
+			assert(false);
+	}
+	store(jc, ins->args.slot.arg1, X86_RAX);
+}
+
+static void
+compile_move (jit_compiler_t *jc, int32_t dst_slot, int32_t src_slot)
+{
+	x86_buf_t *buf = &jc->buf;
+	x86_operand_t dst = slot_operand(jc, dst_slot);
+	x86_operand_t src = slot_operand(jc, src_slot);
+
+	if (dst.is_reg || src.is_reg) {
+		x86_mov(buf, dst, src);
+	} else {
+		x86_mov(buf, x86_reg(X86_RAX), src);
+		x86_mov(buf, dst, x86_reg(X86_RAX));
+	}
+}
+
+static void
+compile_imm (jit_compiler_t *jc, vm_ins_t *ins)
+{
+	x86_buf_t *buf = &jc->buf;
+	int64_t imm = ins->args.imm.imm;
+
+	load(jc, X86_RAX, ins->args.imm.arg2);
+	if (ins->opcode == VM_OP_ADD_IMM && x86_fits_int32(imm)) {
+		x86_add_imm(buf, x86_reg(X86_RAX), (int32_t)imm);
+	} else {
+		x86_mov_imm(buf, x86_reg(X86_RCX), imm);
+		if (ins->opcode == VM_OP_ADD_IMM)
+			x86_add(buf, X86_RAX, x86_reg(X86_RCX));
+		else
+			x86_imul(buf, X86_RAX, x86_reg(X86_RCX));
+	}
+	store(jc, ins->args.imm.arg, X86_RAX);
+}
+
+static void
+compile_ins (jit_compiler_t *jc, int32_t pc)
+{
+	x86_buf_t *buf = &jc->buf;
+	vm_ins_t *ins = &jc->prog->instructions[pc];
+
+	switch (ins->opcode) {
+		case VM_OP_MOVE:
+			compile_move(jc, ins->args.slot.arg1, ins->args.slot.arg2);
+			break;
+		case VM_OP_MOVE_MOVE:
+			compile_move(jc, ins->args.slot.arg1, ins->args.slot.arg2);
+			compile_move(jc, ins->args.slot.arg3, ins->args.slot.arg4);
+			break;
+		case VM_OP_ADD_IMM:
+		case VM_OP_MULTIPLY_IMM:
+			compile_imm(jc, ins);
+			break;
+		case VM_OP_SET:
+			x86_mov_imm(buf, slot_operand(jc, ins->args.imm.arg), ins->args.imm.imm);
+			break;
+		case VM_OP_ADD:
+		case VM_OP_MULTIPLY:
+		case VM_OP_LESS_THAN:
+		case VM_OP_EQUALS:
+			compile_binary(jc, ins);
+			break;
+		case VM_OP_NEGATE:
+			load(jc, X86_RAX, ins->args.slot.arg2);
+			x86_neg(buf, x86_reg(X86_RAX));
+			store(jc, ins->args.slot.arg1, X86_RAX);
+			break;
+		case VM_OP_NOT:
+			x86_cmp_imm(buf, slot_operand(jc, ins->args.slot.arg2), 0);
+			x86_setcc_rax(buf, X86_CC_E);
+			store(jc, ins->args.slot.arg1, X86_RAX);
+			break;
+		case VM_OP_JUMP:
+			add_fixup(&jc->jumps, &jc->n_jumps, x86_jmp(buf), ins->args.slot.arg1);
+			break;
+		case VM_OP_JUMP_IF_ZERO:
+			x86_cmp_imm(buf, slot_operand(jc, ins->args.slot.arg1), 0);
+			add_fixup(&jc->jumps, &jc->n_jumps, x86_jcc(buf, X86_CC_E), ins->args.slot.arg2);
+			break;
+		case VM_OP_JUMP_IF_NOT_LESS:
+		case VM_OP_JUMP_IF_NOT_EQUAL: {
+			x86_cc_t cc = ins->opcode == VM_OP_JUMP_IF_NOT_LESS ? X86_CC_GE : X86_CC_NE;
+			load(jc, X86_RAX, ins->args.slot.arg1);
+			x86_cmp(buf, X86_RAX, slot_operand(jc, ins->args.slot.arg2));
+			add_fixup(&jc->jumps, &jc->n_jumps, x86_jcc(buf, cc), ins->args.slot.arg3);
+			break;
+		}
+		case VM_OP_CALL: {
+			int32_t offset = ins->args.slot.arg2 * 8;
+			write_back(jc);
+			x86_add_imm(buf, x86_reg(X86_RBX), offset);
+			add_fixup(&jc->calls, &jc->n_calls, x86_call(buf), ins->args.slot.arg1);
+			x86_add_imm(buf, x86_reg(X86_RBX), -offset);
+			reload(jc, ins->args.slot.arg3);
+			store(jc, ins->args.slot.arg3, X86_RAX);
+			break;
+		}
+		case VM_OP_RETURN:
+			load(jc, X86_RAX, ins->args.slot.arg1);
+			write_back(jc);
+			x86_ret(buf);
+			break;
+		default:
+			assert(false);
+	}
+}
+
+static void
+compile_trampoline (jit_compiler_t *jc)
+{
+	x86_buf_t *buf = &jc->buf;
+	static const x86_reg_t saved[] = { X86_RBX, X86_RBP, X86_R12, X86_R13, X86_R14, X86_R15 };
+	int n_saved = sizeof(saved) / sizeof(saved[0]);
+
+	// int64_t trampoline (int64_t *frame, jit_context_t *ctx)
+	for (int i = 0; i < n_saved; i++)
+		x86_push(buf, saved[i]);
+	x86_mov(buf, x86_reg(X86_RBX), x86_reg(X86_RDI));
+	x86_mov(buf, x86_reg(X86_RBP), x86_reg(X86_RSI));
+	x86_mov(buf, x86_mem(X86_RBP, CTX_SAVED_RSP), x86_reg(X86_RSP));
+	x86_mov(buf, x86_reg(X86_RSP), x86_mem(X86_RBP, CTX_STACK_TOP));
+	// The limit is one return address below the deepest allowed call.
+	x86_mov(buf, x86_reg(X86_RAX), x86_reg(X86_RSP));
+	x86_sub(buf, X86_RAX, x86_mem(X86_RBP, CTX_STACK_BYTES));
+	x86_mov(buf, x86_mem(X86_RBP, CTX_STACK_LIMIT), x86_reg(X86_RAX));
+	add_fixup(&jc->calls, &jc->n_calls, x86_call(buf), 0);
+
+	jc->epilogue_offset = x86_offset(buf);
+	x86_mov(buf, x86_reg(X86_RSP), x86_mem(X86_RBP, CTX_SAVED_RSP));
+	for (int i = n_saved - 1; i >= 0; i--)
+		x86_pop(buf, saved[i]);
+	x86_ret(buf);
+
+	jc->bail_offset = x86_offset(buf);
+	x86_mov_imm(buf, x86_mem(X86_RBP, CTX_FAILED), 1);
+	size_t at = x86_jmp(buf);
+	x86_patch_rel32(buf, at, jc->epilogue_offset);
+}
+
+static void
+compile_function (jit_compiler_t *jc, jit_function_t *func)
+{
+	jc->current = func;
+	jc->n_jumps = 0;
+
+	compile_prologue(jc, func);
+	if (func->pcs[0] != func->entry)
+		add_fixup(&jc->jumps, &jc->n_jumps, x86_jmp(&jc->buf), func->entry);
+
+	for (int32_t i = 0; i < func->n_pcs; i++) {
+		jc->pc_offsets[func->pcs[i]] = x86_offset(&jc->buf);
+		compile_ins(jc, func->pcs[i]);
+	}
+
+	for (int i = 0; i < jc->n_jumps; i++)
+		x86_patch_rel32(&jc->buf, jc->jumps[i].at, jc->pc_offsets[jc->jumps[i].pc]);
+}
+
+static vm_jit_t*
+jit_compile (jit_compiler_t *jc)
+{
+	const vm_program_t *prog = jc->prog;
+
+	if (prog->num_instructions == 0 || !find_functions(jc))
+		return NULL;
+	for (int f = 0; f < jc->n_functions; f++) {
+		if (!analyze_function(jc, &jc->functions[f]))
+			return NULL;
+	}
+
+	x86_init(&jc->buf);
+	compile_trampoline(jc);
+
+	for (int f = 0; f < jc->n_functions; f++)
+		compile_function(jc, &jc->functions[f]);
+
+	for (int i = 0; i < jc->n_calls; i++) {
+		jit_function_t *callee = &jc->functions[jc->function_at[jc->calls[i].pc]];
+		x86_patch_rel32(&jc->buf, jc->calls[i].at, callee->entry_offset);
+	}
+
+	vm_jit_t *jit = malloc(sizeof(vm_jit_t));
+	jit->stack = NULL;
+	jit->stack_bytes = 0;
+	jit->code = x86_finish(&jc->buf, &jit->size);
+	if (jit->code == NULL) {
+		free(jit);
+		return NULL;
+	}
+	jit->entry = (int64_t (*) (int64_t*, jit_context_t*))jit->code;
+	return jit;
+}
+
+/*
+ * Traces.  A trace is the list of pcs that one iteration of a loop
+ * executed, starting at the loop header, without Calls or Returns.  It
+ * is compiled into a native loop that runs it over and over, with the
+ * slots it uses most in registers.  Each conditional branch becomes a
+ * guard that leaves the loop if the branch goes the other way than it
+ * did while recording.  The code returns the pc to go on at.
+ */
+
+static void
+compile_trace_ins (jit_compiler_t *jc, int32_t pc, int32_t next)
+{
+	x86_buf_t *buf = &jc->buf;
+	vm_ins_t *ins = &jc->prog->instructions[pc];
+	int32_t target;
+	x86_cc_t cc;
+
+	switch (ins->opcode) {
+		case VM_OP_JUMP:
+			return;
+		case VM_OP_JUMP_IF_ZERO:
+			target = ins->args.slot.arg2;
+			if (target == pc + 1)
+				return;
+			x86_cmp_imm(buf, slot_operand(jc, ins->args.slot.arg1), 0);
+			cc = X86_CC_E;
+			break;
+		case VM_OP_JUMP_IF_NOT_LESS:
+		case VM_OP_JUMP_IF_NOT_EQUAL:
+			target = ins->args.slot.arg3;
+			if (target == pc + 1)
+				return;
+			load(jc, X86_RAX, ins->args.slot.arg1);
+			x86_cmp(buf, X86_RAX, slot_operand(jc, ins->args.slot.arg2));
+			cc = ins->opcode == VM_OP_JUMP_IF_NOT_LESS ? X86_CC_GE : X86_CC_NE;
+			break;
+		case VM_OP_CALL:
+		case VM_OP_RETURN:
+			assert(false);
+			return;
+		default:
+			compile_ins(jc, pc);
+			return;
+	}
+
+	// CC is the condition for taking the branch.  Flipping its lowest
+	// bit negates it.
+	if (next == target)
+		add_fixup(&jc->jumps, &jc->n_jumps, x86_jcc(buf, (x86_cc_t)(cc ^ 1)), pc + 1);
+	else
+		add_fixup(&jc->jumps, &jc->n_jumps, x86_jcc(buf, cc), target);
+}
+
+void*
+vm_jit_compile_trace (const vm_program_t *prog, int32_t *pcs, int32_t n, size_t *size)
+{
+	static const x86_reg_t saved[] = { X86_RBX, X86_R12, X86_R13, X86_R14, X86_R15 };
+	int n_saved = sizeof(saved) / sizeof(saved[0]);
+	jit_compiler_t jc;
+	jit_function_t func;
+	x86_buf_t *buf = &jc.buf;
+
+	memset(&jc, 0, sizeof(jc));
+	memset(&func, 0, sizeof(func));
+	jc.prog = prog;
+	jc.current = &func;
+	func.entry = pcs[0];
+	func.pcs = pcs;
+	func.n_pcs = n;
+	if (!analyze_function(&jc, &func))
+		return NULL;
+
+	// int32_t trace (int64_t *frame)
+	x86_init(buf);
+	for (int i = 0; i < n_saved; i++)
+		x86_push(buf, saved[i]);
+	x86_mov(buf, x86_reg(X86_RBX), x86_reg(X86_RDI));
+	reload(&jc, INT32_MIN);
+
+	size_t loop = x86_offset(buf);
+	for (int32_t i = 0; i < n; i++)
+		compile_trace_ins(&jc, pcs[i], i + 1 < n ? pcs[i + 1] : pcs[0]);
+	x86_patch_rel32(buf, x86_jmp(buf), loop);
+
+	size_t epilogue = x86_offset(buf);
+	write_back(&jc);
+	for (int i = n_saved - 1; i >= 0; i--)
+		x86_pop(buf, saved[i]);
+	x86_ret(buf);
+
+	for (int i = 0; i < jc.n_jumps; i++) {
+		x86_patch_rel32(buf, jc.jumps[i].at, x86_offset(buf));
+		x86_mov_imm(buf, x86_reg(X86_RAX), jc.jumps[i].pc);
+		x86_patch_rel32(buf, x86_jmp(buf), epilogue);
+	}
+	free(jc.jumps);
+
+	return x86_finish(buf, size);
+}
+
+vm_jit_t*
+vm_jit_compile (const vm_program_t *prog)
+{
+	jit_compiler_t jc;
+
+	memset(&jc, 0, sizeof(jc));
+	jc.prog = prog;
+	jc.function_at = calloc(prog->num_instructions + 1, sizeof(int32_t));
+	jc.visited = calloc(prog->num_instructions + 1, sizeof(int32_t));
+	jc.pc_offsets = calloc(prog->num_instructions + 1, sizeof(size_t));
+
+	vm_jit_t *jit = jit_compile(&jc);
+
+	for (int f = 0; f < jc.n_functions; f++)
+		free(jc.functions[f].pcs);
+	free(jc.function_at);
+	free(jc.visited);
+	free(jc.pc_offsets);
+	free(jc.functions);
+	free(jc.jumps);
+	free(jc.calls);
+	return jit;
+}
+
+void
+vm_jit_free (vm_jit_t *jit)
+{
+	if (jit->stack != NULL)
+		munmap(jit->stack, jit->stack_bytes);
+	x86_release(jit->code, jit->size);
+	free(jit);
+}
+
+// Compiles the program for VM, or returns the code compiled by an
+// earlier run, together with a native stack to run it on.
+static vm_jit_t*
+context_jit (vm_t *vm)
+{
+	if (vm->jit != NULL || vm->jit_failed)
+		return vm->jit;
+
+	vm_jit_t *jit = vm_jit_compile(vm->program);
+	if (jit != NULL) {
+		size_t page = 4096;
+		jit->stack_bytes = ((vm->call_stack_size + 2) * sizeof(void*) + page - 1) / page * page;
+		jit->stack = mmap(NULL, jit->stack_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (jit->stack == MAP_FAILED) {
+			jit->stack = NULL;
+			vm_jit_free(jit);
+			jit = NULL;
+		}
+	}
+	vm->jit = jit;
+	vm->jit_failed = jit == NULL;
+	return jit;
+}
+
+/*
+ * Runs the program with the JIT, and falls back to vm_run if it can't
+ * be compiled or if it runs out of stack.
+ */
+int64_t
+vm_run_jit (vm_t *vm)
+{
+	// Only vm_run does memoization and profiling.
+	if (vm->program->memo_ids != NULL || vm->profile != NULL)
+		return vm_run(vm);
+
+	vm_jit_t *jit = context_jit(vm);
+	if (jit == NULL)
+		return vm_run(vm);
+
+	jit_context_t ctx;
+	ctx.low = vm->value_array;
+	ctx.high = vm->value_array + vm->array_size;
+	ctx.native_stack_top = (char*)jit->stack + jit->stack_bytes;
+	ctx.native_stack_bytes = (vm->call_stack_size + 1) * sizeof(void*);
+	ctx.failed = 0;
+	ctx.high_water = vm->value_array + vm->used_slots;
+
+	// The arguments are all the state there is, so keep them around
+	// to be able to start over.
+	size_t n_args = vm->stack_pointer;
+	int64_t *args = malloc(sizeof(int64_t) * (n_args + 1));
+	memcpy(args, vm->value_array, sizeof(int64_t) * n_args);
+
+	int64_t result = jit->entry(vm->value_array + vm->stack_pointer, &ctx);
+
+	vm->used_slots = ctx.high_water - vm->value_array;
+
+	if (ctx.failed) {
+		memcpy(vm->value_array, args, sizeof(int64_t) * n_args);
+		result = vm_run(vm);
+	}
+	free(args);
+	return result;
+}
+
+#else
+
+vm_jit_t*
+vm_jit_compile (const vm_program_t *prog)
+{
+	return NULL;
+}
+
+void
+vm_jit_free (vm_jit_t *jit)
+{
+}
+
+int64_t
+vm_run_jit (vm_t *vm)
+{
+	return vm_run(vm);
+}
+
+void*
+vm_jit_compile_trace (const vm_program_t *prog, int32_t *pcs, int32_t n, size_t *size)
+{
+	return NULL;
+}
+
+#endif
@@ -3,16 +3,15 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "compiler.h"
 
 static void
 scan_main (context_t *ctx)
 {
-	for (;;) {
-		token_t token = scan(ctx);
-		if (token.type == TOKEN_EOF)
-			break;
+	for (size_t i = 0; ctx->tokens[i].type != TOKEN_EOF; i++) {
+		token_t token = ctx->tokens[i];
 
 		if (token_type_is_keyword(token.type)) {
 			printf("keyword %s\n", token_type_keyword_name(token.type));
@@ -21,7 +20,7 @@ scan_main (context_t *ctx)
 		} else if (token.type == TOKEN_INTEGER) {
 			printf("integer %" PRId64 "\n", token.v.i);
 		} else if (token.type == TOKEN_IDENT) {
-			printf("identifier %s\n", token.v.name);
+			printf("identifier %.*s\n", (int)token.v.ident.length, ctx->source + token.start);
 		} else {
 			assert(false);
 		}
@@ -44,7 +43,7 @@ print_expr (expr_t *expr, int indent)
 			printf("%" PRId64 "\n", expr->v.i);
 			break;
 		case EXPR_IDENT:
-			printf("%s\n", expr->v.ident);
+			printf("%s\n", expr->v.ident.name);
 			break;
 		case EXPR_IF:
 			printf("if\n");
@@ -107,6 +106,76 @@ print_program (program_t *prog)
 		print_function(func);
 }
 
+static void
+print_flat_expr (flat_program_t *flat, int32_t index, int indent)
+{
+	flat_expr_t *expr = &flat->exprs[index];
+	int32_t refs = expr->v.x.a;
+
+	print_indent(indent);
+	switch (expr->type) {
+		case EXPR_INTEGER:
+			printf("%" PRId64 "\n", expr->v.i);
+			break;
+		case EXPR_IDENT:
+			printf("%s\n", symtab_name(&flat->symbols, expr->v.x.a));
+			break;
+		case EXPR_IF:
+			printf("if\n");
+			print_flat_expr(flat, index + 1, indent + 1);
+			print_flat_expr(flat, expr->v.x.a, indent + 1);
+			print_flat_expr(flat, expr->v.x.b, indent + 1);
+			break;
+		case EXPR_LET:
+		case EXPR_LOOP:
+			printf("%s\n", expr->type == EXPR_LET ? "let" : "loop");
+			for (int i = 0; i < expr->n; i++) {
+				print_indent(indent + 2);
+				printf("%s\n", symtab_name(&flat->symbols, flat->refs[refs + 1 + expr->n + i]));
+				print_flat_expr(flat, flat->refs[refs + 1 + i], indent + 3);
+			}
+			print_flat_expr(flat, expr->v.x.b, indent + 1);
+			break;
+		case EXPR_RECUR:
+			printf("recur\n");
+			for (int i = 0; i < expr->n; i++)
+				print_flat_expr(flat, flat->refs[refs + 2 + i], indent + 1);
+			break;
+		case EXPR_CALL:
+			printf("%s\n", symtab_name(&flat->symbols, flat->refs[refs]));
+			for (int i = 0; i < expr->n; i++)
+				print_flat_expr(flat, flat->refs[refs + 1 + i], indent + 1);
+			break;
+		case EXPR_UNARY:
+			printf("%s\n", token_type_operator_name(expr->op));
+			print_flat_expr(flat, index + 1, indent + 1);
+			break;
+		case EXPR_BINARY:
+			printf("%s\n", token_type_operator_name(expr->op));
+			print_flat_expr(flat, index + 1, indent + 1);
+			print_flat_expr(flat, expr->v.x.a, indent + 1);
+			break;
+		default:
+			assert(false);
+	}
+}
+
+static void
+print_flat_program (flat_program_t *flat)
+{
+	for (int32_t i = 0; i < flat->n_functions; i++) {
+		flat_function_t *function = &flat->functions[i];
+		printf("function\n");
+		print_indent(2);
+		printf("%s\n", symtab_name(&flat->symbols, function->name));
+		for (int j = 0; j < function->n_args; j++) {
+			print_indent(3);
+			printf("%s\n", symtab_name(&flat->symbols, flat->refs[function->args + j]));
+		}
+		print_flat_expr(flat, function->body, 1);
+	}
+}
+
 static void
 parse_main (context_t *ctx)
 {
@@ -121,21 +190,72 @@ parse_function_main (context_t *ctx)
 	print_function(function);
 }
 
+static bool use_flat_tree = false;
+
 static void
 parse_program_main (context_t *ctx)
 {
 	program_t *prog = parse_program(ctx);
-	print_program(prog);
+	if (use_flat_tree) {
+		flat_program_t *flat = flatten_program(prog);
+		print_flat_program(flat);
+		flat_program_free(flat);
+	} else {
+		print_program(prog);
+	}
 }
 
 static void
 eval_main (context_t *ctx)
 {
 	expr_t *expr = parse_expr(ctx);
-	int64_t result = eval_expr(NULL, NULL, expr);
+	int n_slots = resolve_expr(NULL, expr);
+	int64_t result = eval_expr(NULL, expr, n_slots);
 	printf("%" PRId64 "\n", result);
 }
 
+static const char *memo_names = NULL;
+static bool parallel = false;
+static int n_threads = 0;
+
+// The number of threads to use if --threads isn't given.
+static int
+default_threads (void)
+{
+	if (n_threads <= 0)
+		n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_threads <= 0)
+		n_threads = 1;
+	return n_threads;
+}
+
+static size_t memo_size = 64 << 20;
+static bool memo_stats = false;
+static bool parallel_front_end = false;
+
+static program_t*
+load_program (context_t *ctx)
+{
+	program_t *program;
+
+	if (parallel_front_end) {
+		program = parse_program_parallel(ctx, default_threads());
+	} else {
+		program = parse_program(ctx);
+		resolve_program(program);
+	}
+	if (memo_names != NULL)
+		memo_select(memo_new(memo_size), &ctx->symbols, program, memo_names);
+	return program;
+}
+
+static void
+print_memo_stats (program_t *program)
+{
+	if (memo_stats && program->memo != NULL)
+		memo_print_stats(program->memo, stderr);
+}
+
 static int64_t*
 parse_cmdline_args (context_t *ctx, int argc, const char **argv)
 {
@@ -145,25 +265,64 @@ parse_cmdline_args (context_t *ctx, int argc, const char **argv)
 	return args;
 }
 
-static int
-eval_program_main (context_t *ctx, int argc, const char **argv)
+static function_t*
+find_main (program_t *program, int argc)
 {
-	program_t *program = parse_program(ctx);
 	function_t *function = lookup_function(program, "main");
 
 	if (function == NULL) {
 		fprintf(stderr, "Error: Function main must be defined.\n");
-		return 1;
+		exit(1);
 	}
 
 	if (function->n_args != argc) {
 		fprintf(stderr, "Error: main expects %d args, but got %d.\n", function->n_args, argc);
-		return 2;
+		exit(2);
 	}
 
+	return function;
+}
+
+/*
+ * The flat tree has everything the interpreter needs, so the pool,
+ * with the syntax tree, can be emptied before it runs.
+ */
+static int
+eval_flat_main (context_t *ctx, program_t *program, int argc, const char **argv)
+{
+	find_main(program, argc);
+	flat_program_t *flat = flatten_program(program);
+
+	error_assert(!parallel, "--flat can't be used with --parallel");
+	pool_reset(&ctx->pool);
+	int64_t *args = parse_cmdline_args(ctx, argc, argv);
+	int64_t result = eval_flat_function(flat, flat_lookup_function(flat, "main"), args);
+	printf("%" PRId64 "\n", result);
+	if (memo_stats && flat->memo != NULL)
+		memo_print_stats(flat->memo, stderr);
+	flat_program_free(flat);
+	return 0;
+}
+
+static int
+eval_program_main (context_t *ctx, int argc, const char **argv)
+{
+	program_t *program = load_program(ctx);
+	if (use_flat_tree)
+		return eval_flat_main(ctx, program, argc, argv);
+	function_t *function = find_main(program, argc);
+
 	int64_t *args = parse_cmdline_args(ctx, function->n_args, argv);
-	int64_t result = eval_function(program, function, args);
+	int64_t result;
+	if (parallel) {
+		// The memo table isn't shared between threads.
+		error_assert(program->memo == NULL, "--memo can't be used with --parallel");
+		result = eval_function_parallel(program, function, args, default_threads());
+	} else {
+		result = eval_function(program, function, args);
+	}
 	printf("%" PRId64 "\n", result);
+	print_memo_stats(program);
 
 	return 0;
 }
@@ -172,49 +331,441 @@ static void
 vm_test_main (void)
 {
 	vm_t vm;
-	vm_init(&vm, 32768, 1024);
+	vm_init(&vm, NULL, 32768, 1024, false);
 	vm_test_value_stack(&vm);
+	vm_free(&vm);
 }
 
-static int
-vm_main (context_t *ctx, const char *filename, int argc, const char **argv)
+static vm_engine_t vm_engine = vm_run;
+static bool huge_pages = false;
+static bool fuse = true;
+static bool fuse_output = false;
+static bool verify = true;
+static const char *batch_file = NULL;
+static int lanes = 0;
+static const char *profile_file = NULL;
+static const char *folded_file = NULL;
+static bool count_instructions = false;
+
+static void
+compile_vm_program (context_t *ctx, program_t *program, vm_program_t *prog)
+{
+	if (parallel_front_end)
+		compile_program_parallel(ctx, program, prog);
+	else
+		compile_program(ctx, program, prog);
+}
+
+// Gets loaded or compiled VM code ready to run.
+static void
+prepare_vm (vm_program_t *prog)
+{
+	if (fuse)
+		vm_fuse(prog);
+	if (verify)
+		vm_verify(prog);
+}
+
+// Opens FILENAME for writing, or returns stderr for "-".
+static FILE*
+open_output (const char *filename)
+{
+	if (strcmp(filename, "-") == 0)
+		return stderr;
+	FILE *f = fopen(filename, "w");
+	error_assert(f != NULL, "cannot open output file");
+	return f;
+}
+
+static void
+close_output (FILE *f)
+{
+	if (f != stderr)
+		error_assert(fclose(f) == 0, "cannot write output file");
+}
+
+static void
+write_profile (vm_profile_t *profile)
+{
+	if (count_instructions)
+		fprintf(stderr, "instructions: %" PRIu64 "\n", profile->total);
+	if (profile_file != NULL) {
+		FILE *f = open_output(profile_file);
+		vm_profile_write_report(profile, f);
+		close_output(f);
+	}
+	if (folded_file != NULL) {
+		FILE *f = open_output(folded_file);
+		vm_profile_write_folded(profile, f);
+		close_output(f);
+	}
+}
+
+static int64_t
+run_vm (context_t *ctx, vm_program_t *prog, memo_t *memo, int argc, const char **argv)
 {
-	//assert(argc >= 3);
-	int64_t *args = parse_cmdline_args(ctx, argc, argv);
 	vm_t vm;
-	vm_init(&vm, 32768, 1024);
-	vm_load(&vm, filename);
+	vm_init(&vm, prog, VM_STACK_SLOTS, VM_CALL_STACK_SIZE, huge_pages);
+	vm.memo = memo;
+	if (profile_file != NULL || folded_file != NULL || count_instructions) {
+		error_assert(vm_engine == vm_run, "profiles can only be made with --engine=switch");
+		vm.profile = vm_profile_new(prog);
+	}
+	int64_t *args = parse_cmdline_args(ctx, argc, argv);
 	vm_push_args(&vm, argc, args);
-	int64_t result = vm_run(&vm);
+	int64_t result = vm_engine(&vm);
+	if (vm.profile != NULL) {
+		vm_profile_finish(vm.profile);
+		write_profile(vm.profile);
+		vm_profile_free(vm.profile);
+	}
+	return result;
+}
+
+// Runs PROG on each line of arguments in the batch file.  N_ARGS is
+// the number of arguments main takes, or -1 if that's not known.
+static void
+run_batch (vm_program_t *prog, int n_args)
+{
+	FILE *in = stdin;
+
+	if (strcmp(batch_file, "-") != 0) {
+		in = fopen(batch_file, "r");
+		error_assert(in != NULL, "cannot open batch file");
+	}
+	if (lanes > 0)
+		error_assert(prog->frame_sizes != NULL, "--lanes can't be used with --no-verify");
+	error_assert(profile_file == NULL && folded_file == NULL && !count_instructions,
+		     "profiles can't be made with --batch");
+	vm_run_batch(prog, vm_engine, lanes, n_args, in, stdout, default_threads(), huge_pages);
+	if (in != stdin)
+		fclose(in);
+}
+
+static int
+vm_main (context_t *ctx, const char *filename, int argc, const char **argv)
+{
+	vm_program_t prog;
+	vm_load(&prog, filename);
+	prepare_vm(&prog);
+	if (batch_file != NULL) {
+		error_assert(argc == 0, "arguments can't be given with --batch");
+		run_batch(&prog, prog.frame_sizes != NULL ? prog.entry_args : -1);
+		return 0;
+	}
+	int64_t result = run_vm(ctx, &prog, NULL, argc, argv);
 	printf("%" PRId64 "\n", result);
 	return 0;
 }
 
+static int
+compile_main (context_t *ctx, int argc, const char **argv)
+{
+	program_t *program = load_program(ctx);
+	vm_program_t prog;
+
+	if (batch_file != NULL) {
+		error_assert(argc == 0, "arguments can't be given with --batch");
+		// The memo table isn't shared between threads.
+		error_assert(program->memo == NULL, "--memo can't be used with --batch");
+		function_t *function = lookup_function(program, "main");
+		error_assert(function != NULL, "Function main must be defined.");
+		compile_vm_program(ctx, program, &prog);
+		prepare_vm(&prog);
+		run_batch(&prog, function->n_args);
+		return 0;
+	}
+
+	find_main(program, argc);
+	compile_vm_program(ctx, program, &prog);
+	prepare_vm(&prog);
+	int64_t result = run_vm(ctx, &prog, program->memo, argc, argv);
+	printf("%" PRId64 "\n", result);
+	print_memo_stats(program);
+	return 0;
+}
+
+static int
+serve_main (const char *socket_path)
+{
+	server_options_t options;
+
+	error_assert(batch_file == NULL, "--batch can't be used with --serve");
+	error_assert(profile_file == NULL && folded_file == NULL && !count_instructions,
+		     "profiles can't be made with --serve");
+	options.engine = vm_engine;
+	options.fuse = fuse;
+	options.verify = verify;
+	options.huge_pages = huge_pages;
+	options.memo_names = memo_names;
+	options.memo_size = memo_size;
+	serve(&options, socket_path);
+	return 0;
+}
+
+static void
+emit_sbc_main (context_t *ctx)
+{
+	program_t *program = load_program(ctx);
+	vm_program_t prog;
+	compile_vm_program(ctx, program, &prog);
+	if (fuse_output)
+		vm_fuse(&prog);
+	vm_write(&prog, stdout);
+}
+
+static int
+convert_sbc_main (const char *filename, int argc, const char **argv)
+{
+	error_assert(argc == 1, "--convert-sbc needs the name of the output file");
+
+	vm_program_t prog;
+	vm_load(&prog, filename);
+	if (fuse_output)
+		vm_fuse(&prog);
+
+	FILE *f = fopen(argv[0], "wb");
+	error_assert(f != NULL, "cannot open output file");
+	vm_write_binary(&prog, f);
+	error_assert(fclose(f) == 0, "cannot write output file");
+	return 0;
+}
+
+static void
+emit_asm_main (context_t *ctx)
+{
+	program_t *program = load_program(ctx);
+	emit_asm_program(ctx, program, stdout);
+}
+
+/*
+ * The kernel carries a process's peak RSS over exec, so what the
+ * parent gets from wait4 is never less than its own.  The high water
+ * mark of our address space is what we really used.
+ */
+static void
+print_peak_rss (void)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	char line[256];
+
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "VmHWM:", 6) == 0)
+			fprintf(stderr, "peak RSS: %" PRId64 " kB\n", (int64_t)strtoll(line + 6, NULL, 10));
+	}
+	fclose(f);
+}
+
+static pool_t *stats_pool = NULL;
+
+static void
+print_pool_stats (void)
+{
+	fprintf(stderr, "pool: %zu bytes requested, %zu wasted, %zu high water\n",
+		stats_pool->requested, stats_pool->wasted, pool_high_water(stats_pool));
+}
+
+static void
+usage (void)
+{
+	fprintf(stderr,
+		"Usage: simplang [OPTIONS] [MODE] FILE [ARGS]\n"
+		"\n"
+		"Modes:\n"
+		"  --vm              run the VM code, text or binary, in FILE (default)\n"
+		"  --convert-sbc     convert the VM code in FILE to the binary format\n"
+		"                    and write it to the file given as the argument\n"
+		"  --compile         compile the program in FILE and run it on the VM\n"
+		"  --emit-sbc        compile the program in FILE and print the VM code\n"
+		"  --emit-asm        compile the program in FILE to x86-64 assembly,\n"
+		"                    to be linked with runtime.c\n"
+		"  --interpret       interpret the program in FILE\n"
+		"  --eval-expr       interpret the single expression in FILE\n"
+		"  --scan            print the tokens in FILE\n"
+		"  --parse-expr      print the syntax tree of the expression in FILE\n"
+		"  --parse-function  print the syntax tree of the function in FILE\n"
+		"  --parse           print the syntax tree of the program in FILE\n"
+		"  --vm-test         test the VM's value stack\n"
+		"  --serve           compile and run programs on request, without\n"
+		"                    FILE: each line on stdin is the path of a\n"
+		"                    program and its ARGS, and gets the result, or\n"
+		"                    an error, as a line on stdout.  Programs stay\n"
+		"                    compiled until their files change.\n"
+		"\n"
+		"Options:\n"
+		"  --engine=ENGINE   VM engine to use: switch (default), threaded,\n"
+		"                    jit, or trace, which is switch with hot loops\n"
+		"                    compiled to native code\n"
+		"  --memo=FUNCTIONS  memoize the comma-separated FUNCTIONS, or with\n"
+		"                    \"auto\" the ones that call themselves more\n"
+		"                    than once (--interpret and --compile)\n"
+		"  --memo-size=BYTES limit the memo table to BYTES (default 64M)\n"
+		"  --memo-stats      print memo hits and misses to stderr\n"
+		"  --no-fuse         don't combine VM instructions into\n"
+		"                    superinstructions\n"
+		"  --fuse            write superinstructions in the VM code from\n"
+		"                    --emit-sbc and --convert-sbc\n"
+		"  --no-verify       don't verify VM code, but check every slot\n"
+		"                    access while running it\n"
+		"  --huge-pages      back the VM's value stack with huge pages\n"
+		"                    if the system supports it\n"
+		"  --batch=FILE      instead of taking ARGS, run the program once for\n"
+		"                    each line of arguments in FILE, or stdin if FILE\n"
+		"                    is -, and print the results in order (--vm and\n"
+		"                    --compile)\n"
+		"  --threads=N       run batches, parallel interpretation and the\n"
+		"                    parallel front end on N threads (default: one\n"
+		"                    per CPU)\n"
+		"  --lanes=N         run batches on the SIMD engine, N (4 or 8)\n"
+		"                    argument vectors at a time per thread\n"
+		"  --parallel        interpret independent calls in parallel\n"
+		"                    (--interpret)\n"
+		"  --flat            use the flat syntax tree, with all expressions\n"
+		"                    in one array (--interpret and --parse)\n"
+		"  --parallel-front-end\n"
+		"                    parse, resolve and compile the functions in\n"
+		"                    FILE on several threads (--compile,\n"
+		"                    --emit-sbc, --emit-asm and --interpret)\n"
+		"  --profile=FILE    count the VM instructions executed, per\n"
+		"                    instruction, opcode and function, and write a\n"
+		"                    report to FILE, or stderr if FILE is -\n"
+		"                    (--vm and --compile, with --engine=switch)\n"
+		"  --profile-folded=FILE\n"
+		"                    write the instruction counts per call stack\n"
+		"                    to FILE, for flame graphs\n"
+		"  --count-instructions\n"
+		"                    print the number of VM instructions executed\n"
+		"                    to stderr\n"
+		"  --peak-rss        print the peak resident memory to stderr at\n"
+		"                    exit\n"
+		"  --socket=PATH     serve on a Unix domain socket at PATH instead\n"
+		"                    of stdin and stdout (--serve)\n"
+		"  --pool-stats      print how much memory the front end allocated\n"
+		"                    to stderr at exit\n");
+	exit(1);
+}
+
 int
 main (int argc, const char *argv[])
 {
-	context_t ctx;
+	// Static, so that it's still there for the exit handlers.
+	static context_t ctx;
+	const char *mode = "--vm";
+	const char *socket_path = NULL;
+
 	pool_init(&ctx.pool);
+	stats_pool = &ctx.pool;
 
-/*
-	if (argc < 2) {
-		fprintf(stderr, "Usage: simplang FILE [ARGS]\n");
-		return 1;
+	while (argc >= 2 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--engine=switch") == 0)
+			vm_engine = vm_run;
+		else if (strcmp(argv[1], "--engine=threaded") == 0)
+			vm_engine = vm_run_threaded;
+		else if (strcmp(argv[1], "--engine=jit") == 0)
+			vm_engine = vm_run_jit;
+		else if (strcmp(argv[1], "--engine=trace") == 0)
+			vm_engine = vm_run_trace;
+		else if (strncmp(argv[1], "--engine=", 9) == 0)
+			usage();
+		else if (strncmp(argv[1], "--memo=", 7) == 0)
+			memo_names = argv[1] + 7;
+		else if (strncmp(argv[1], "--memo-size=", 12) == 0)
+			memo_size = (size_t)strtoull(argv[1] + 12, NULL, 10);
+		else if (strcmp(argv[1], "--memo-stats") == 0)
+			memo_stats = true;
+		else if (strcmp(argv[1], "--no-fuse") == 0)
+			fuse = false;
+		else if (strcmp(argv[1], "--fuse") == 0)
+			fuse_output = true;
+		else if (strcmp(argv[1], "--no-verify") == 0)
+			verify = false;
+		else if (strcmp(argv[1], "--huge-pages") == 0)
+			huge_pages = true;
+		else if (strncmp(argv[1], "--batch=", 8) == 0)
+			batch_file = argv[1] + 8;
+		else if (strncmp(argv[1], "--threads=", 10) == 0)
+			n_threads = atoi(argv[1] + 10);
+		else if (strcmp(argv[1], "--parallel") == 0)
+			parallel = true;
+		else if (strcmp(argv[1], "--lanes=4") == 0)
+			lanes = 4;
+		else if (strcmp(argv[1], "--lanes=8") == 0)
+			lanes = 8;
+		else if (strncmp(argv[1], "--lanes=", 8) == 0)
+			usage();
+		else if (strncmp(argv[1], "--profile=", 10) == 0)
+			profile_file = argv[1] + 10;
+		else if (strncmp(argv[1], "--profile-folded=", 17) == 0)
+			folded_file = argv[1] + 17;
+		else if (strcmp(argv[1], "--count-instructions") == 0)
+			count_instructions = true;
+		else if (strcmp(argv[1], "--peak-rss") == 0)
+			atexit(print_peak_rss);
+		else if (strcmp(argv[1], "--pool-stats") == 0)
+			atexit(print_pool_stats);
+		else if (strcmp(argv[1], "--flat") == 0)
+			use_flat_tree = true;
+		else if (strcmp(argv[1], "--parallel-front-end") == 0)
+			parallel_front_end = true;
+		else if (strncmp(argv[1], "--socket=", 9) == 0)
+			socket_path = argv[1] + 9;
+		else
+			mode = argv[1];
+		argc--;
+		argv++;
 	}
 
-	scan_init(&ctx, argv[1]);
-	parser_init(&ctx);
-*/
+	if (strcmp(mode, "--vm-test") == 0) {
+		vm_test_main();
+		return 0;
+	}
+	if (strcmp(mode, "--serve") == 0) {
+		if (argc != 1)
+			usage();
+		return serve_main(socket_path);
+	}
+
+	if (argc < 2)
+		usage();
+
+	const char *filename = argv[1];
+	argc -= 2;
+	argv += 2;
 
-	//scan_main(&ctx);
-	//parse_main(&ctx);
-	//parse_function_main(&ctx);
-	//eval_main(&ctx);
-	//parse_program_main(&ctx);
-	//return eval_program_main(&ctx, argc - 2, argv + 2);
+	if (strcmp(mode, "--vm") == 0)
+		return vm_main(&ctx, filename, argc, argv);
+	if (strcmp(mode, "--convert-sbc") == 0)
+		return convert_sbc_main(filename, argc, argv);
+
+	scan_init(&ctx, filename);
+
+	if (strcmp(mode, "--scan") == 0) {
+		scan_main(&ctx);
+		return 0;
+	}
+
+	parser_init(&ctx);
 
-	//vm_test_main();
-	return vm_main(&ctx, argv[1], argc - 2, argv + 2);
+	if (strcmp(mode, "--compile") == 0)
+		return compile_main(&ctx, argc, argv);
+	if (strcmp(mode, "--emit-sbc") == 0)
+		emit_sbc_main(&ctx);
+	else if (strcmp(mode, "--emit-asm") == 0)
+		emit_asm_main(&ctx);
+	else if (strcmp(mode, "--interpret") == 0)
+		return eval_program_main(&ctx, argc, argv);
+	else if (strcmp(mode, "--eval-expr") == 0)
+		eval_main(&ctx);
+	else if (strcmp(mode, "--parse-expr") == 0)
+		parse_main(&ctx);
+	else if (strcmp(mode, "--parse-function") == 0)
+		parse_function_main(&ctx);
+	else if (strcmp(mode, "--parse") == 0)
+		parse_program_main(&ctx);
+	else
+		usage();
 
 	return 0;
 }
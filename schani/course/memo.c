@@ -0,0 +1,280 @@
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "compiler.h"
+#include "dynarr.h"
+
+/*
+ * A cache of function results, keyed by the function and its
+ * arguments.  SimpLang functions are pure, so a cached result can
+ * always be reused.
+ *
+ * The table is set-associative: a key hashes to a set of MEMO_WAYS
+ * entries, and when the set is full the least recently used entry in it
+ * is evicted.  The number of sets is the largest power of two that
+ * keeps the table within the memory cap.
+ */
+
+#define MEMO_WAYS	4
+
+typedef struct
+{
+	uint64_t hash;		// 0 if the entry is empty
+	int32_t id;
+	uint32_t stamp;		// for LRU; wrapping only makes eviction less accurate
+	int64_t args[MEMO_MAX_ARGS];
+	int64_t result;
+} memo_entry_t;
+
+typedef struct
+{
+	const char *name;
+	int n_args;
+	uint64_t hits;
+	uint64_t misses;
+} memo_function_t;
+
+struct _memo_t
+{
+	pool_t pool;
+	memo_entry_t *entries;
+	size_t n_sets;
+	uint32_t clock;
+	size_t n_used;
+	uint64_t evictions;
+	dynarr_t functions;
+};
+
+memo_t*
+memo_new (size_t max_bytes)
+{
+	memo_t *memo = malloc(sizeof(memo_t));
+	assert(memo != NULL);
+
+	memo->n_sets = 1;
+	while (memo->n_sets * 2 * MEMO_WAYS * sizeof(memo_entry_t) <= max_bytes)
+		memo->n_sets *= 2;
+	memo->entries = calloc(memo->n_sets * MEMO_WAYS, sizeof(memo_entry_t));
+	assert(memo->entries != NULL);
+
+	memo->clock = 0;
+	memo->n_used = 0;
+	memo->evictions = 0;
+	pool_init(&memo->pool);
+	dynarr_init(&memo->functions, &memo->pool);
+	return memo;
+}
+
+void
+memo_free (memo_t *memo)
+{
+	free(memo->entries);
+	pool_free(&memo->pool);
+	free(memo);
+}
+
+// Returns the id for looking up results of the function, or -1 if it
+// has too many arguments to be memoized.
+int
+memo_register (memo_t *memo, const char *name, int n_args)
+{
+	if (n_args > MEMO_MAX_ARGS)
+		return -1;
+
+	memo_function_t *function = pool_alloc(&memo->pool, sizeof(memo_function_t));
+	function->name = name;
+	function->n_args = n_args;
+	function->hits = 0;
+	function->misses = 0;
+	dynarr_append(&memo->functions, function);
+	return (int)dynarr_length(&memo->functions) - 1;
+}
+
+int
+memo_n_args (memo_t *memo, int id)
+{
+	memo_function_t *function = dynarr_nth(&memo->functions, id);
+	return function->n_args;
+}
+
+static uint64_t
+hash_key (int id, int n_args, const int64_t *args)
+{
+	uint64_t h = (uint64_t)id * 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < n_args; i++) {
+		h = (h ^ (uint64_t)args[i]) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	// 0 marks empty entries.
+	return h | 1;
+}
+
+static memo_entry_t*
+find_set (memo_t *memo, uint64_t hash)
+{
+	return &memo->entries[((hash >> 1) & (memo->n_sets - 1)) * MEMO_WAYS];
+}
+
+static bool
+entry_matches (memo_entry_t *entry, uint64_t hash, int id, int n_args, const int64_t *args)
+{
+	return entry->hash == hash && entry->id == id
+		&& memcmp(entry->args, args, sizeof(int64_t) * n_args) == 0;
+}
+
+bool
+memo_lookup (memo_t *memo, int id, const int64_t *args, int64_t *result)
+{
+	memo_function_t *function = dynarr_nth(&memo->functions, id);
+	uint64_t hash = hash_key(id, function->n_args, args);
+	memo_entry_t *set = find_set(memo, hash);
+
+	for (int i = 0; i < MEMO_WAYS; i++) {
+		if (entry_matches(&set[i], hash, id, function->n_args, args)) {
+			set[i].stamp = ++memo->clock;
+			*result = set[i].result;
+			function->hits++;
+			return true;
+		}
+	}
+
+	function->misses++;
+	return false;
+}
+
+void
+memo_insert (memo_t *memo, int id, const int64_t *args, int64_t result)
+{
+	memo_function_t *function = dynarr_nth(&memo->functions, id);
+	uint64_t hash = hash_key(id, function->n_args, args);
+	memo_entry_t *set = find_set(memo, hash);
+	memo_entry_t *victim = &set[0];
+
+	for (int i = 0; i < MEMO_WAYS; i++) {
+		if (set[i].hash == 0 || entry_matches(&set[i], hash, id, function->n_args, args)) {
+			victim = &set[i];
+			break;
+		}
+		if ((int32_t)(set[i].stamp - victim->stamp) < 0)
+			victim = &set[i];
+	}
+
+	if (victim->hash == 0)
+		memo->n_used++;
+	else if (!entry_matches(victim, hash, id, function->n_args, args))
+		memo->evictions++;
+
+	victim->hash = hash;
+	victim->id = id;
+	victim->stamp = ++memo->clock;
+	memcpy(victim->args, args, sizeof(int64_t) * function->n_args);
+	victim->result = result;
+}
+
+void
+memo_print_stats (memo_t *memo, FILE *f)
+{
+	for (size_t i = 0; i < dynarr_length(&memo->functions); i++) {
+		memo_function_t *function = dynarr_nth(&memo->functions, i);
+		fprintf(f, "memo: %s: %" PRIu64 " hits, %" PRIu64 " misses\n",
+			function->name, function->hits, function->misses);
+	}
+	fprintf(f, "memo: %zu of %zu entries used, %" PRIu64 " evictions\n",
+		memo->n_used, memo->n_sets * MEMO_WAYS, memo->evictions);
+}
+
+static int
+count_self_calls (function_t *function, expr_t *expr)
+{
+	int n = 0;
+
+	switch (expr->type) {
+		case EXPR_INTEGER:
+		case EXPR_IDENT:
+			return 0;
+		case EXPR_IF:
+			return count_self_calls(function, expr->v.if_expr.condition)
+				+ count_self_calls(function, expr->v.if_expr.consequent)
+				+ count_self_calls(function, expr->v.if_expr.alternative);
+		case EXPR_UNARY:
+			return count_self_calls(function, expr->v.unary.operand);
+		case EXPR_BINARY:
+			return count_self_calls(function, expr->v.binary.left)
+				+ count_self_calls(function, expr->v.binary.right);
+		case EXPR_LET:
+		case EXPR_LOOP:
+			for (int i = 0; i < expr->v.let_loop.n; i++)
+				n += count_self_calls(function, expr->v.let_loop.bindings[i].expr);
+			return n + count_self_calls(function, expr->v.let_loop.body);
+		case EXPR_RECUR:
+			for (int i = 0; i < expr->v.recur.n; i++)
+				n += count_self_calls(function, expr->v.recur.args[i]);
+			return n;
+		case EXPR_CALL:
+			if (expr->v.call.function == function)
+				n++;
+			for (int i = 0; i < expr->v.call.n; i++)
+				n += count_self_calls(function, expr->v.call.args[i]);
+			return n;
+		default:
+			assert(false);
+			return 0;
+	}
+}
+
+// Returns the next name in the comma-separated *LIST and sets *LENGTH
+// to its length, or returns NULL after the last one.
+static const char*
+next_name (const char **list, size_t *length)
+{
+	const char *name = *list;
+	const char *end;
+
+	if (name == NULL)
+		return NULL;
+	end = strchr(name, ',');
+	*length = end != NULL ? (size_t)(end - name) : strlen(name);
+	*list = end != NULL ? end + 1 : NULL;
+	return name;
+}
+
+static void
+select_function (memo_t *memo, function_t *func)
+{
+	func->memo_id = memo_register(memo, func->name, func->n_args);
+	error_assert(func->memo_id >= 0, "function has too many arguments to be memoized");
+}
+
+/*
+ * Chooses the functions of a resolved program to memoize.  NAMES is a
+ * comma-separated list of function names, which are looked up in
+ * SYMBOLS, or "auto" to pick the functions that call themselves more
+ * than once, since those are the ones that tend to recompute the same
+ * calls over and over.  A name can be given more than once.
+ */
+void
+memo_select (memo_t *memo, symtab_t *symbols, program_t *program, const char *names)
+{
+	if (strcmp(names, "auto") == 0) {
+		for (function_t *func = program->functions; func != NULL; func = func->next) {
+			if (func->n_args <= MEMO_MAX_ARGS && count_self_calls(func, func->body) >= 2)
+				select_function(memo, func);
+		}
+	} else {
+		const char *list = names;
+		const char *name;
+		size_t length;
+
+		while ((name = next_name(&list, &length)) != NULL) {
+			error_assert(length > 0, "empty function name in memo list");
+			int32_t symbol = symtab_lookup(symbols, name, length);
+			function_t *func = symbol >= 0 ? lookup_function_symbol(program, symbol) : NULL;
+			error_assert(func != NULL, "memoized function is not defined");
+			if (func->memo_id < 0)
+				select_function(memo, func);
+		}
+	}
+
+	program->memo = memo;
+}
@@ -4,20 +4,32 @@
 #include "compiler.h"
 #include "dynarr.h"
 
-static token_t lookahead;
+static token_type_t
+lookahead (context_t *ctx)
+{
+	return ctx->tokens[ctx->next_token].type;
+}
 
+// At the end, this keeps returning the TOKEN_EOF.
 static token_t
 consume (context_t *ctx)
 {
-	token_t result = lookahead;
-	lookahead = scan(ctx);
+	token_t result = ctx->tokens[ctx->next_token];
+	if (result.type != TOKEN_EOF)
+		ctx->next_token++;
 	return result;
 }
 
+static char*
+token_name (context_t *ctx, token_t t)
+{
+	return (char*)symtab_name(&ctx->symbols, t.v.ident.symbol);
+}
+
 void
 parser_init (context_t *ctx)
 {
-	lookahead = scan(ctx);
+	ctx->next_token = 0;
 }
 
 static expr_t*
@@ -42,6 +54,9 @@ is_binary_operator (token_type_t t)
 	return t >= TOKEN_FIRST_BINARY_OPERATOR && t <= TOKEN_LAST_BINARY_OPERATOR;
 }
 
+// Lower binds tighter.
+#define LOWEST_PRECEDENCE	3
+
 static int
 operator_precedence (token_type_t t)
 {
@@ -63,46 +78,34 @@ operator_precedence (token_type_t t)
 
 static expr_t* parse_primary (context_t *ctx);
 
-expr_t*
-parse_expr (context_t *ctx)
+/*
+ * Parses a chain of binary operators of precedence LEVEL, whose
+ * operands are chains of tighter binding operators.  The chain is
+ * parsed in a loop, so operators of equal precedence associate to the
+ * left, and the recursion only goes as deep as there are precedence
+ * levels, however long the expression is.
+ */
+static expr_t*
+parse_binary (context_t *ctx, int level)
 {
-	dynarr_t expr_arr;
-	dynarr_t op_arr;
-
-	dynarr_init(&expr_arr, &ctx->pool);
-	dynarr_init(&op_arr, &ctx->pool);
-
-	dynarr_append(&expr_arr, parse_primary(ctx));
-	while (is_binary_operator(lookahead.type)) {
-		dynarr_append(&op_arr, (void*)lookahead.type);
-		consume(ctx);
-		dynarr_append(&expr_arr, parse_primary(ctx));
+	if (level < 0)
+		return parse_primary(ctx);
+
+	expr_t *left = parse_binary(ctx, level - 1);
+	while (is_binary_operator(lookahead(ctx)) && operator_precedence(lookahead(ctx)) == level) {
+		expr_t *expr = alloc_expr(ctx, EXPR_BINARY);
+		expr->v.binary.op = consume(ctx).type;
+		expr->v.binary.left = left;
+		expr->v.binary.right = parse_binary(ctx, level - 1);
+		left = expr;
 	}
+	return left;
+}
 
-	for (int p = 0; p < 4; p++) {
-		int i = 0;
-		while (i < dynarr_length(&op_arr)) {
-			token_type_t op = (token_type_t)dynarr_nth(&op_arr, i);
-			if (operator_precedence(op) != p) {
-				i++;
-				continue;
-			}
-
-			expr_t *expr = alloc_expr(ctx, EXPR_BINARY);
-			expr->v.binary.op = op;
-			expr->v.binary.left = dynarr_nth(&expr_arr, i);
-			expr->v.binary.right = dynarr_nth(&expr_arr, i + 1);
-
-			dynarr_remove(&op_arr, i);
-			dynarr_remove(&expr_arr, i);
-			dynarr_set(&expr_arr, i, expr);
-		}
-	}
-
-	assert(dynarr_length(&op_arr) == 0);
-	assert(dynarr_length(&expr_arr) == 1);
-
-	return dynarr_nth(&expr_arr, 0);
+expr_t*
+parse_expr (context_t *ctx)
+{
+	return parse_binary(ctx, LOWEST_PRECEDENCE);
 }
 
 static dynarr_t
@@ -116,7 +119,7 @@ parse_args (context_t *ctx)
 		expect_token(ctx, TOKEN_OPEN_PAREN);
 		dynarr_append(&arr, parse_expr(ctx));
 		expect_token(ctx, TOKEN_CLOSE_PAREN);
-	} while (lookahead.type == TOKEN_OPEN_PAREN);
+	} while (lookahead(ctx) == TOKEN_OPEN_PAREN);
 
 	return arr;
 }
@@ -137,9 +140,11 @@ parse_primary (context_t *ctx)
 			//| ident
 			//| ident arg {arg}
 		case TOKEN_IDENT:
-			if (lookahead.type == TOKEN_OPEN_PAREN) {
+			if (lookahead(ctx) == TOKEN_OPEN_PAREN) {
 				expr = alloc_expr(ctx, EXPR_CALL);
-				expr->v.call.name = t.v.name;
+				expr->v.call.name = token_name(ctx, t);
+				expr->v.call.symbol = t.v.ident.symbol;
+				expr->v.call.function = NULL;
 
 				dynarr_t arr = parse_args(ctx);
 
@@ -147,7 +152,9 @@ parse_primary (context_t *ctx)
 				expr->v.call.args = (expr_t**)dynarr_data(&arr);
 			} else {
 				expr = alloc_expr(ctx, EXPR_IDENT);
-				expr->v.ident = t.v.name;
+				expr->v.ident.name = token_name(ctx, t);
+				expr->v.ident.symbol = t.v.ident.symbol;
+				expr->v.ident.slot = -1;
 			}
 			break;
 
@@ -172,7 +179,8 @@ parse_primary (context_t *ctx)
 				binding_t *binding = pool_alloc(&ctx->pool, sizeof(binding_t));
 
 				t = expect_token(ctx, TOKEN_IDENT);
-				binding->name = t.v.name;
+				binding->name = token_name(ctx, t);
+				binding->symbol = t.v.ident.symbol;
 				expect_token(ctx, TOKEN_ASSIGN);
 				binding->expr = parse_expr(ctx);
 
@@ -194,6 +202,7 @@ parse_primary (context_t *ctx)
 
 			expr->v.let_loop.n = dynarr_length(&arr);
 			expr->v.let_loop.bindings = bindings;
+			expr->v.let_loop.first_slot = -1;
 
 			break;
 		}
@@ -206,6 +215,8 @@ parse_primary (context_t *ctx)
 			expr = alloc_expr(ctx, EXPR_RECUR);
 			expr->v.recur.n = dynarr_length(&arr);
 			expr->v.recur.args = (expr_t**)dynarr_data(&arr);
+			expr->v.recur.first_slot = -1;
+			expr->v.recur.scratch_slot = -1;
 
 			break;
 		}
@@ -238,22 +249,32 @@ parse_function (context_t *ctx)
 {
 	token_t t;
 	dynarr_t arr;
+	dynarr_t symbols;
 	function_t *function = pool_alloc(&ctx->pool, sizeof(function_t));
 
+	function->n_slots = 0;
+	function->memo_id = -1;
+	function->index = -1;
 	function->next = NULL;
 
 	expect_token(ctx, TOKEN_LET);
 	t = expect_token(ctx, TOKEN_IDENT);
-	function->name = t.v.name;
+	function->name = token_name(ctx, t);
+	function->symbol = t.v.ident.symbol;
 
 	dynarr_init(&arr, &ctx->pool);
+	dynarr_init(&symbols, &ctx->pool);
 	do {
 		t = expect_token(ctx, TOKEN_IDENT);
-		dynarr_append(&arr, t.v.name);
-	} while (lookahead.type == TOKEN_IDENT);
+		dynarr_append(&arr, token_name(ctx, t));
+		dynarr_append(&symbols, (void*)(intptr_t)t.v.ident.symbol);
+	} while (lookahead(ctx) == TOKEN_IDENT);
 
 	function->n_args = dynarr_length(&arr);
 	function->args = (char**)dynarr_data(&arr);
+	function->arg_symbols = pool_alloc(&ctx->pool, sizeof(int32_t) * function->n_args);
+	for (int i = 0; i < function->n_args; i++)
+		function->arg_symbols[i] = (int32_t)(intptr_t)dynarr_nth(&symbols, i);
 
 	expect_token(ctx, TOKEN_ASSIGN);
 
@@ -279,10 +300,27 @@ parse_program (context_t *ctx)
 			last->next = func;
 			last = func;
 		}
-	} while (lookahead.type != TOKEN_EOF);
+	} while (lookahead(ctx) != TOKEN_EOF);
 
+	return new_program(ctx, first);
+}
+
+program_t*
+new_program (context_t *ctx, function_t *functions)
+{
 	program_t *prog = pool_alloc(&ctx->pool, sizeof(program_t));
-	prog->functions = first;
+	int32_t index = 0;
+
+	prog->functions = functions;
+	prog->memo = NULL;
+
+	prog->n_symbols = ctx->symbols.n_symbols;
+	prog->functions_by_symbol = pool_alloc_zeroed(&ctx->pool, sizeof(function_t*) * prog->n_symbols);
+	for (function_t *func = functions; func != NULL; func = func->next) {
+		func->index = index++;
+		if (prog->functions_by_symbol[func->symbol] == NULL)
+			prog->functions_by_symbol[func->symbol] = func;
+	}
 
 	return prog;
 }
@@ -26,6 +26,8 @@
 
 #include "pools.h"
 
+#define CHUNK_SIZE(i)	(POOLS_FIRST_CHUNK_SIZE << (i))
+
 bool
 pool_init (pool_t *pool)
 {
@@ -36,25 +38,20 @@ pool_init (pool_t *pool)
 
     for (i = 0; i < POOLS_NUM_CHUNKS; ++i)
 	pool->chunks[i] = 0;
+    for (i = 0; i < POOLS_NUM_FREE_LISTS; ++i)
+	pool->free_lists[i] = 0;
+
+    pool->requested = 0;
+    pool->wasted = 0;
+    pool->high_water = 0;
 
     pool->chunks[0] = (long*)malloc(POOLS_GRANULARITY * POOLS_FIRST_CHUNK_SIZE);
     if (pool->chunks[0] == 0)
 	return false;
 
-    memset(pool->chunks[0], 0, POOLS_GRANULARITY * POOLS_FIRST_CHUNK_SIZE);
-
     return true;
 }
 
-#ifndef __GNUC__
-void
-pool_reset (pool_t *pool)
-{
-    pool->active_chunk = 0;
-    pool->fill_ptr = 0;
-}
-#endif
-
 void
 pool_free (pool_t *pool)
 {
@@ -66,6 +63,74 @@ pool_free (pool_t *pool)
 	    free(pool->chunks[i]);
 }
 
+size_t
+pool_used (pool_t *pool)
+{
+    size_t used = pool->fill_ptr;
+    int i;
+
+    for (i = 0; i < pool->active_chunk; ++i)
+	if (pool->chunks[i] != 0)
+	    used += CHUNK_SIZE(i);
+
+    return used * POOLS_GRANULARITY;
+}
+
+/* Called before the pool shrinks, because that's when the amount of
+   memory in use can be at a maximum. */
+static void
+update_high_water (pool_t *pool)
+{
+    size_t used = pool_used(pool);
+
+    if (used > pool->high_water)
+	pool->high_water = used;
+}
+
+size_t
+pool_high_water (pool_t *pool)
+{
+    update_high_water(pool);
+
+    return pool->high_water;
+}
+
+pool_mark_t
+pool_mark (pool_t *pool)
+{
+    pool_mark_t mark;
+
+    mark.active_chunk = pool->active_chunk;
+    mark.fill_ptr = pool->fill_ptr;
+
+    return mark;
+}
+
+void
+pool_release (pool_t *pool, pool_mark_t mark)
+{
+    int i;
+
+    assert(mark.active_chunk < pool->active_chunk
+	   || (mark.active_chunk == pool->active_chunk && mark.fill_ptr <= pool->fill_ptr));
+
+    update_high_water(pool);
+    pool->active_chunk = mark.active_chunk;
+    pool->fill_ptr = mark.fill_ptr;
+
+    /* the free blocks might have been released, too */
+    for (i = 0; i < POOLS_NUM_FREE_LISTS; ++i)
+	pool->free_lists[i] = 0;
+}
+
+void
+pool_reset (pool_t *pool)
+{
+    pool_mark_t start = { 0, 0 };
+
+    pool_release(pool, start);
+}
+
 #ifdef __GNUC__
 void*
 _pool_alloc (pool_t *pool, size_t byte_size)
@@ -77,43 +142,123 @@ pool_alloc (pool_t *pool, size_t byte_size)
     size_t pool_size, size;
     void *p;
 
-    pool_size = POOLS_FIRST_CHUNK_SIZE << pool->active_chunk;
+    pool_size = CHUNK_SIZE(pool->active_chunk);
     size = (byte_size + POOLS_GRANULARITY - 1) / POOLS_GRANULARITY;
 
+    if (pool->fill_ptr + size >= pool_size)
+	pool->wasted += (pool_size - pool->fill_ptr) * POOLS_GRANULARITY;
+
     while (pool->fill_ptr + size >= pool_size)
     {
-	size_t new_pool_size;
-
 	++pool->active_chunk;
 	assert(pool->active_chunk < POOLS_NUM_CHUNKS);
 
 	pool->fill_ptr = 0;
+	pool_size = CHUNK_SIZE(pool->active_chunk);
+
+	/* chunks that are too small for the block are skipped,
+	   without allocating them */
+	if (size >= pool_size)
+	    continue;
 
-	new_pool_size = POOLS_FIRST_CHUNK_SIZE << pool->active_chunk;
-	/* TODO: if the requested block is too big to fit into the
-	   pool to be allocated, it should simply be skipped, which
-	   would save memory. */
 	if (pool->chunks[pool->active_chunk] == 0)
 	{
-	    size_t new_pool_byte_size = POOLS_GRANULARITY * new_pool_size;
+	    size_t new_pool_byte_size = POOLS_GRANULARITY * pool_size;
 
 	    /* printf("allocing pool %d with size %ld\n", pool->active_chunk, (long)new_pool_byte_size); */
 
 	    pool->chunks[pool->active_chunk] = (long*)malloc(new_pool_byte_size);
 	    if (pool->chunks[pool->active_chunk] == 0)
 		return 0;
-	    /* FIXME: either remove the memset here or memset the pool
-	       even if it's not newly allocated, because pools can be
-	       reset. */
-	    memset(pool->chunks[pool->active_chunk], 0, new_pool_byte_size);
 	}
-	pool_size = new_pool_size;
     }
 
     assert(pool->fill_ptr + size < pool_size);
 
     p = pool->chunks[pool->active_chunk] + pool->fill_ptr;
     pool->fill_ptr += size;
+    pool->requested += byte_size;
+    pool->wasted += size * POOLS_GRANULARITY - byte_size;
+
+    return p;
+}
+
+void*
+pool_alloc_zeroed (pool_t *pool, size_t size)
+{
+    void *p = pool_alloc(pool, size);
+
+    if (p != 0)
+	memset(p, 0, size);
 
     return p;
 }
+
+/* Returns the free list for blocks of SIZE bytes, or -1 if they're not
+   kept. */
+static int
+free_list_index (size_t size)
+{
+    int i;
+
+    for (i = 0; i < POOLS_NUM_FREE_LISTS; ++i)
+	if (size == POOLS_GRANULARITY << i)
+	    return i;
+
+    return -1;
+}
+
+void*
+pool_realloc (pool_t *pool, void *p, size_t old_size, size_t new_size)
+{
+    size_t old_padded = (old_size + POOLS_GRANULARITY - 1) / POOLS_GRANULARITY;
+    size_t new_padded = (new_size + POOLS_GRANULARITY - 1) / POOLS_GRANULARITY;
+    long *chunk = pool->chunks[pool->active_chunk];
+    int index;
+    void *new_p;
+
+    if (p == 0)
+	old_padded = old_size = 0;
+
+    /* the last block in the active chunk can just grow */
+    if (p != 0 && (long*)p + old_padded == chunk + pool->fill_ptr
+	&& (long*)p - chunk + new_padded < CHUNK_SIZE(pool->active_chunk))
+    {
+	pool->fill_ptr += new_padded - old_padded;
+	pool->requested += new_size - old_size;
+	pool->wasted += new_padded * POOLS_GRANULARITY - new_size;
+	pool->wasted -= old_padded * POOLS_GRANULARITY - old_size;
+	return p;
+    }
+
+    index = free_list_index(new_padded * POOLS_GRANULARITY);
+    if (index >= 0 && pool->free_lists[index] != 0)
+    {
+	new_p = pool->free_lists[index];
+	pool->free_lists[index] = *(void**)new_p;
+	pool->wasted -= new_size;
+	pool->requested += new_size;
+    }
+    else
+    {
+	new_p = pool_alloc(pool, new_size);
+	if (new_p == 0)
+	    return 0;
+    }
+
+    if (p != 0)
+    {
+	memcpy(new_p, p, old_size);
+
+	/* the old block is wasted until someone reuses it */
+	pool->wasted += old_size;
+	index = free_list_index(old_padded * POOLS_GRANULARITY);
+	if (index >= 0)
+	{
+	    *(void**)p = pool->free_lists[index];
+	    pool->free_lists[index] = p;
+	}
+    }
+
+    return new_p;
+}
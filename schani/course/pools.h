@@ -31,16 +31,34 @@
 #define POOLS_FIRST_CHUNK_SIZE           ((size_t)2048)
 #define POOLS_NUM_CHUNKS                 20
 
+/* blocks given up by pool_realloc are kept for reuse if their size is
+   a power of two from POOLS_GRANULARITY up to this many bytes */
+#define POOLS_NUM_FREE_LISTS             10
+
 typedef struct
 {
     int active_chunk;
     size_t fill_ptr;
     long *chunks[POOLS_NUM_CHUNKS];
+    void *free_lists[POOLS_NUM_FREE_LISTS];
+
+    /* accounting, in bytes */
+    size_t requested;		/* asked for, in total */
+    size_t wasted;		/* padding, chunk ends and abandoned blocks */
+    size_t high_water;		/* most in use at once */
 } pool_t;
 
+/* everything allocated after a mark is freed by releasing it */
+typedef struct
+{
+    int active_chunk;
+    size_t fill_ptr;
+} pool_mark_t;
+
 bool pool_init (pool_t *pool);
 void pool_free (pool_t *pool);
 
+/* memory from pool_alloc is not cleared */
 #ifdef __GNUC__
 void* _pool_alloc (pool_t *pool, size_t size);
 
@@ -55,6 +73,8 @@ pool_alloc (pool_t *pool, size_t size)
 
     p = pool->chunks[pool->active_chunk] + pool->fill_ptr;
     pool->fill_ptr += padded_size;
+    pool->requested += size;
+    pool->wasted += padded_size * POOLS_GRANULARITY - size;
 
     return p;
 }
@@ -62,15 +82,20 @@ pool_alloc (pool_t *pool, size_t size)
 void* pool_alloc (pool_t *pool, size_t size);
 #endif
 
-#ifdef __GNUC__
-static inline void
-pool_reset (pool_t *pool)
-{
-    pool->active_chunk = 0;
-    pool->fill_ptr = 0;
-}
-#else
-void reset_pool (pool_t *pool);
-#endif
+void* pool_alloc_zeroed (pool_t *pool, size_t size);
+
+/* Grows the block at P from OLD_SIZE to NEW_SIZE bytes, in place if it
+   is the last one allocated, otherwise by moving it.  P can be NULL. */
+void* pool_realloc (pool_t *pool, void *p, size_t old_size, size_t new_size);
+
+pool_mark_t pool_mark (pool_t *pool);
+void pool_release (pool_t *pool, pool_mark_t mark);
+
+/* frees everything, but keeps the chunks for reuse */
+void pool_reset (pool_t *pool);
+
+/* the number of bytes currently in use, and the most there ever were */
+size_t pool_used (pool_t *pool);
+size_t pool_high_water (pool_t *pool);
 
 #endif
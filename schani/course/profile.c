@@ -0,0 +1,295 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+
+/*
+ * Besides the counts per instruction, the profile keeps a shadow of the
+ * call stack.  Each frame remembers the total instruction count when it
+ * was entered and how many instructions its callees executed, which is
+ * all it takes to get a function's inclusive and exclusive counts when
+ * it returns.
+ *
+ * The frames also point into a calling context tree, which has a node
+ * for each distinct call stack, for the folded output.  Direct
+ * recursion stays in its node, so that a deep recursion doesn't produce
+ * a call stack per level.
+ *
+ * A function's inclusive count is only added up when its outermost
+ * frame returns, so that recursive calls are not counted twice.
+ */
+
+typedef struct _vm_profile_node_t
+{
+	int32_t entry;
+	uint64_t exclusive;
+	struct _vm_profile_node_t *parent;
+	struct _vm_profile_node_t *children;
+	struct _vm_profile_node_t *next;
+} node_t;
+
+typedef struct _vm_profile_frame_t
+{
+	node_t *node;
+	int32_t entry;
+	uint64_t start;		// the total when the frame was entered
+	uint64_t children;	// instructions executed by callees
+} frame_t;
+
+#define NUM_OPCODES	(VM_OP_MOVE_MOVE + 1)
+
+static node_t*
+new_node (node_t *parent, int32_t entry)
+{
+	node_t *node = malloc(sizeof(node_t));
+	assert(node != NULL);
+	node->entry = entry;
+	node->exclusive = 0;
+	node->parent = parent;
+	node->children = NULL;
+	node->next = NULL;
+	if (parent != NULL) {
+		node->next = parent->children;
+		parent->children = node;
+	}
+	return node;
+}
+
+static node_t*
+child_node (node_t *parent, int32_t entry)
+{
+	if (parent->entry == entry)
+		return parent;
+	for (node_t *child = parent->children; child != NULL; child = child->next) {
+		if (child->entry == entry)
+			return child;
+	}
+	return new_node(parent, entry);
+}
+
+static void
+push_frame (vm_profile_t *profile, node_t *node, int32_t entry)
+{
+	if (profile->n_frames == profile->frames_size) {
+		profile->frames_size = profile->frames_size == 0 ? 64 : profile->frames_size * 2;
+		profile->frames = realloc(profile->frames, sizeof(frame_t) * profile->frames_size);
+		assert(profile->frames != NULL);
+	}
+
+	frame_t *frame = &profile->frames[profile->n_frames++];
+	frame->node = node;
+	frame->entry = entry;
+	frame->start = profile->total;
+	frame->children = 0;
+	profile->calls[entry]++;
+	profile->active[entry]++;
+}
+
+vm_profile_t*
+vm_profile_new (const vm_program_t *prog)
+{
+	vm_profile_t *profile = malloc(sizeof(vm_profile_t));
+	size_t n = prog->num_instructions;
+
+	assert(profile != NULL);
+	profile->program = prog;
+	profile->total = 0;
+	profile->counts = calloc(n, sizeof(uint64_t));
+	profile->calls = calloc(n, sizeof(uint64_t));
+	profile->inclusive = calloc(n, sizeof(uint64_t));
+	profile->exclusive = calloc(n, sizeof(uint64_t));
+	profile->active = calloc(n, sizeof(uint32_t));
+	assert(profile->counts != NULL && profile->calls != NULL && profile->inclusive != NULL
+	       && profile->exclusive != NULL && profile->active != NULL);
+	profile->frames = NULL;
+	profile->n_frames = 0;
+	profile->frames_size = 0;
+
+	// Compiled code starts with a jump to main, which we'd rather see
+	// as the outermost function than instruction 0.
+	int32_t entry = 0;
+	if (n > 0 && prog->instructions[0].opcode == VM_OP_JUMP)
+		entry = prog->instructions[0].args.slot.arg1;
+	profile->root = new_node(NULL, entry);
+	push_frame(profile, profile->root, entry);
+	return profile;
+}
+
+static void
+free_nodes (node_t *node)
+{
+	while (node != NULL) {
+		node_t *next = node->next;
+		free_nodes(node->children);
+		free(node);
+		node = next;
+	}
+}
+
+void
+vm_profile_free (vm_profile_t *profile)
+{
+	free_nodes(profile->root);
+	free(profile->frames);
+	free(profile->counts);
+	free(profile->calls);
+	free(profile->inclusive);
+	free(profile->exclusive);
+	free(profile->active);
+	free(profile);
+}
+
+void
+vm_profile_call (vm_profile_t *profile, int32_t entry)
+{
+	assert(profile->n_frames > 0);
+	node_t *node = child_node(profile->frames[profile->n_frames - 1].node, entry);
+	push_frame(profile, node, entry);
+}
+
+void
+vm_profile_return (vm_profile_t *profile)
+{
+	assert(profile->n_frames > 0);
+	frame_t *frame = &profile->frames[--profile->n_frames];
+	uint64_t inclusive = profile->total - frame->start;
+	uint64_t exclusive = inclusive - frame->children;
+
+	frame->node->exclusive += exclusive;
+	profile->exclusive[frame->entry] += exclusive;
+	if (--profile->active[frame->entry] == 0)
+		profile->inclusive[frame->entry] += inclusive;
+	if (profile->n_frames > 0)
+		profile->frames[profile->n_frames - 1].children += inclusive;
+}
+
+void
+vm_profile_finish (vm_profile_t *profile)
+{
+	while (profile->n_frames > 0)
+		vm_profile_return(profile);
+}
+
+// Functions without a name, in loaded VM code, are named by their entry.
+static const char*
+function_name (vm_profile_t *profile, int32_t entry, char *buf, size_t size)
+{
+	const char **names = profile->program->names;
+
+	if (names != NULL && names[entry] != NULL)
+		return names[entry];
+	snprintf(buf, size, "@%d", entry);
+	return buf;
+}
+
+static double
+percent (vm_profile_t *profile, uint64_t count)
+{
+	return profile->total == 0 ? 0.0 : 100.0 * count / profile->total;
+}
+
+typedef struct
+{
+	int32_t key;
+	uint64_t count;
+} sort_entry_t;
+
+// By descending count, then ascending key.
+static int
+compare_entries (const void *a, const void *b)
+{
+	const sort_entry_t *x = a, *y = b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return x->key - y->key;
+}
+
+void
+vm_profile_write_report (vm_profile_t *profile, FILE *f)
+{
+	const vm_program_t *prog = profile->program;
+	int32_t n = prog->num_instructions;
+	sort_entry_t opcodes[NUM_OPCODES];
+	sort_entry_t *functions = malloc(sizeof(sort_entry_t) * n);
+	int n_functions = 0;
+
+	assert(functions != NULL);
+	fprintf(f, "Instructions executed: %" PRIu64 "\n", profile->total);
+
+	for (int i = 0; i < NUM_OPCODES; i++) {
+		opcodes[i].key = i;
+		opcodes[i].count = 0;
+	}
+	for (int32_t pc = 0; pc < n; pc++)
+		opcodes[prog->instructions[pc].opcode].count += profile->counts[pc];
+	qsort(opcodes, NUM_OPCODES, sizeof(sort_entry_t), compare_entries);
+
+	fprintf(f, "\n%-16s %16s %7s\n", "Opcode", "Count", "%");
+	for (int i = 0; i < NUM_OPCODES && opcodes[i].count > 0; i++)
+		fprintf(f, "%-16s %16" PRIu64 " %6.2f%%\n", vm_opcode_name(opcodes[i].key),
+			opcodes[i].count, percent(profile, opcodes[i].count));
+
+	for (int32_t pc = 0; pc < n; pc++) {
+		if (profile->calls[pc] == 0)
+			continue;
+		functions[n_functions].key = pc;
+		functions[n_functions].count = profile->inclusive[pc];
+		n_functions++;
+	}
+	qsort(functions, n_functions, sizeof(sort_entry_t), compare_entries);
+
+	fprintf(f, "\n%-16s %12s %16s %7s %16s %7s\n", "Function", "Calls", "Inclusive", "%", "Exclusive", "%");
+	for (int i = 0; i < n_functions; i++) {
+		int32_t entry = functions[i].key;
+		char buf[16];
+
+		fprintf(f, "%-16s %12" PRIu64 " %16" PRIu64 " %6.2f%% %16" PRIu64 " %6.2f%%\n",
+			function_name(profile, entry, buf, sizeof(buf)), profile->calls[entry],
+			profile->inclusive[entry], percent(profile, profile->inclusive[entry]),
+			profile->exclusive[entry], percent(profile, profile->exclusive[entry]));
+	}
+	free(functions);
+
+	fprintf(f, "\n%16s %7s  Instruction\n", "Count", "%");
+	for (int32_t pc = 0; pc < n; pc++) {
+		if (prog->names != NULL && prog->names[pc] != NULL)
+			fprintf(f, "%s:\n", prog->names[pc]);
+		if (profile->counts[pc] == 0)
+			continue;
+		fprintf(f, "%16" PRIu64 " %6.2f%%  ", profile->counts[pc], percent(profile, profile->counts[pc]));
+		vm_write_ins(prog, pc, f);
+		fprintf(f, "\n");
+	}
+}
+
+static void
+write_stack (vm_profile_t *profile, node_t *node, FILE *f)
+{
+	if (node->parent != NULL) {
+		write_stack(profile, node->parent, f);
+		fprintf(f, ";");
+	}
+	char buf[16];
+	fprintf(f, "%s", function_name(profile, node->entry, buf, sizeof(buf)));
+}
+
+static void
+write_folded (vm_profile_t *profile, node_t *node, FILE *f)
+{
+	for (; node != NULL; node = node->next) {
+		if (node->exclusive > 0) {
+			write_stack(profile, node, f);
+			fprintf(f, " %" PRIu64 "\n", node->exclusive);
+		}
+		write_folded(profile, node->children, f);
+	}
+}
+
+void
+vm_profile_write_folded (vm_profile_t *profile, FILE *f)
+{
+	write_folded(profile, profile->root, f);
+}
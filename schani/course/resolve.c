@@ -0,0 +1,317 @@
+#include <assert.h>
+
+#include "compiler.h"
+
+/*
+ * Resolves the names in a program, so that the interpreter doesn't have
+ * to look them up at runtime.
+ *
+ * Every variable gets a slot in its function's frame.  The arguments
+ * come first, followed by the bindings of the let and loop expressions,
+ * which get consecutive slots.  Bindings whose scopes don't overlap
+ * share slots.  Calls get a pointer to the function they call, and
+ * recur expressions the first slot of the loop they belong to, plus
+ * scratch slots for the new values if they can't be assigned in place.
+ *
+ * For the parallel interpreter, calls are marked to be spawned if
+ * there is other expensive work to do while they run, and let bindings
+ * get the last earlier binding they depend on.
+ */
+
+typedef struct _resolve_scope_t
+{
+	int32_t symbol;
+	int slot;
+	struct _resolve_scope_t *next;
+} resolve_scope_t;
+
+typedef struct
+{
+	program_t *program;
+	int n_slots;
+} resolver_t;
+
+static int
+scope_lookup (resolve_scope_t *scope, int32_t symbol)
+{
+	for (; scope != NULL; scope = scope->next) {
+		if (scope->symbol == symbol)
+			return scope->slot;
+	}
+	error_assert(false, "unbound variable");
+	return -1;
+}
+
+static void
+use_slots (resolver_t *r, int n)
+{
+	if (n > r->n_slots)
+		r->n_slots = n;
+}
+
+static bool
+uses_slot (expr_t *expr, int slot)
+{
+	switch (expr->type) {
+		case EXPR_INTEGER:
+			return false;
+		case EXPR_IDENT:
+			return expr->v.ident.slot == slot;
+		case EXPR_IF:
+			return uses_slot(expr->v.if_expr.condition, slot)
+				|| uses_slot(expr->v.if_expr.consequent, slot)
+				|| uses_slot(expr->v.if_expr.alternative, slot);
+		case EXPR_UNARY:
+			return uses_slot(expr->v.unary.operand, slot);
+		case EXPR_BINARY:
+			return uses_slot(expr->v.binary.left, slot) || uses_slot(expr->v.binary.right, slot);
+		case EXPR_LET:
+		case EXPR_LOOP:
+			for (int i = 0; i < expr->v.let_loop.n; i++) {
+				if (uses_slot(expr->v.let_loop.bindings[i].expr, slot))
+					return true;
+			}
+			return uses_slot(expr->v.let_loop.body, slot);
+		case EXPR_RECUR:
+			for (int i = 0; i < expr->v.recur.n; i++) {
+				if (uses_slot(expr->v.recur.args[i], slot))
+					return true;
+			}
+			return false;
+		case EXPR_CALL:
+			for (int i = 0; i < expr->v.call.n; i++) {
+				if (uses_slot(expr->v.call.args[i], slot))
+					return true;
+			}
+			return false;
+		default:
+			assert(false);
+			return true;
+	}
+}
+
+// Whether EXPR might take long enough to be worth doing in parallel.
+static bool
+expensive (expr_t *expr)
+{
+	switch (expr->type) {
+		case EXPR_INTEGER:
+		case EXPR_IDENT:
+			return false;
+		case EXPR_IF:
+			return expensive(expr->v.if_expr.condition)
+				|| expensive(expr->v.if_expr.consequent)
+				|| expensive(expr->v.if_expr.alternative);
+		case EXPR_UNARY:
+			return expensive(expr->v.unary.operand);
+		case EXPR_BINARY:
+			return expensive(expr->v.binary.left) || expensive(expr->v.binary.right);
+		case EXPR_LET:
+			for (int i = 0; i < expr->v.let_loop.n; i++) {
+				if (expensive(expr->v.let_loop.bindings[i].expr))
+					return true;
+			}
+			return expensive(expr->v.let_loop.body);
+		case EXPR_RECUR:
+			for (int i = 0; i < expr->v.recur.n; i++) {
+				if (expensive(expr->v.recur.args[i]))
+					return true;
+			}
+			return false;
+		case EXPR_LOOP:
+		case EXPR_CALL:
+			return true;
+		default:
+			assert(false);
+			return true;
+	}
+}
+
+static void
+mark_spawn (expr_t *expr)
+{
+	if (expr->type == EXPR_CALL)
+		expr->v.call.spawn = true;
+}
+
+// Marks the calls among the arguments of EXPR that can run while the
+// ones after them are evaluated.
+static void
+mark_call_args (expr_t *expr)
+{
+	int last_expensive = -1;
+
+	for (int i = 0; i < expr->v.call.n; i++) {
+		if (expensive(expr->v.call.args[i]))
+			last_expensive = i;
+	}
+	for (int i = 0; i < last_expensive; i++)
+		mark_spawn(expr->v.call.args[i]);
+}
+
+// A binding that's a call is spawned if a later binding that doesn't
+// depend on it is expensive.
+static void
+mark_bindings (expr_t *expr)
+{
+	binding_t *bindings = expr->v.let_loop.bindings;
+	int n = expr->v.let_loop.n;
+	int first = expr->v.let_loop.first_slot;
+
+	for (int j = 0; j < n; j++) {
+		bindings[j].depends_on = -1;
+		for (int i = 0; i < j; i++) {
+			if (uses_slot(bindings[j].expr, first + i))
+				bindings[j].depends_on = i;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		for (int j = i + 1; j < n && bindings[j].depends_on < i; j++) {
+			if (expensive(bindings[j].expr)) {
+				mark_spawn(bindings[i].expr);
+				break;
+			}
+		}
+	}
+}
+
+// LOOP is the innermost loop if EXPR is in tail position with respect
+// to it, otherwise NULL.  All slots from FREE upwards are unused.
+static void
+resolve (resolver_t *r, resolve_scope_t *scope, expr_t *expr, expr_t *loop, int free)
+{
+	switch (expr->type) {
+		case EXPR_INTEGER:
+			break;
+
+		case EXPR_IDENT:
+			expr->v.ident.slot = scope_lookup(scope, expr->v.ident.symbol);
+			break;
+
+		case EXPR_IF:
+			resolve(r, scope, expr->v.if_expr.condition, NULL, free);
+			resolve(r, scope, expr->v.if_expr.consequent, loop, free);
+			resolve(r, scope, expr->v.if_expr.alternative, loop, free);
+			break;
+
+		case EXPR_UNARY:
+			resolve(r, scope, expr->v.unary.operand, NULL, free);
+			break;
+
+		case EXPR_BINARY:
+			resolve(r, scope, expr->v.binary.left, NULL, free);
+			resolve(r, scope, expr->v.binary.right, NULL, free);
+			if (expr->v.binary.op == TOKEN_LOGIC_AND || expr->v.binary.op == TOKEN_LOGIC_OR)
+				break;
+			if (expr->v.binary.right->type == EXPR_CALL && expensive(expr->v.binary.left))
+				mark_spawn(expr->v.binary.right);
+			else if (expensive(expr->v.binary.right))
+				mark_spawn(expr->v.binary.left);
+			break;
+
+		case EXPR_LET:
+		case EXPR_LOOP: {
+			int n = expr->v.let_loop.n;
+			resolve_scope_t bindings[n];
+
+			expr->v.let_loop.first_slot = free;
+			use_slots(r, free + n);
+			for (int i = 0; i < n; i++) {
+				resolve(r, scope, expr->v.let_loop.bindings[i].expr, NULL, free + i);
+				bindings[i].symbol = expr->v.let_loop.bindings[i].symbol;
+				bindings[i].slot = free + i;
+				bindings[i].next = scope;
+				scope = &bindings[i];
+			}
+
+			mark_bindings(expr);
+			if (expr->type == EXPR_LOOP)
+				loop = expr;
+			resolve(r, scope, expr->v.let_loop.body, loop, free + n);
+			break;
+		}
+
+		case EXPR_RECUR: {
+			int n = expr->v.recur.n;
+
+			error_assert(loop != NULL, "recur not in tail position of a loop");
+			error_assert(n == loop->v.let_loop.n, "recur has the wrong number of arguments");
+
+			int first = loop->v.let_loop.first_slot;
+			expr->v.recur.first_slot = first;
+			// If the arguments go to scratch slots, argument I is
+			// computed with the previous ones already stored there.
+			for (int i = 0; i < n; i++)
+				resolve(r, scope, expr->v.recur.args[i], NULL, free + i);
+
+			// Each argument can be stored in its loop variable right
+			// away unless a later argument uses that variable.
+			expr->v.recur.scratch_slot = -1;
+			for (int j = 1; j < n; j++) {
+				for (int i = 0; i < j; i++) {
+					if (uses_slot(expr->v.recur.args[j], first + i))
+						expr->v.recur.scratch_slot = free;
+				}
+			}
+			if (expr->v.recur.scratch_slot >= 0)
+				use_slots(r, free + n);
+			break;
+		}
+
+		case EXPR_CALL: {
+			function_t *function = NULL;
+			if (r->program != NULL)
+				function = lookup_function_symbol(r->program, expr->v.call.symbol);
+			error_assert(function != NULL, "call to undefined function");
+			error_assert(function->n_args == expr->v.call.n, "function called with the wrong number of arguments");
+			expr->v.call.function = function;
+			expr->v.call.spawn = false;
+			for (int i = 0; i < expr->v.call.n; i++)
+				resolve(r, scope, expr->v.call.args[i], NULL, free);
+			mark_call_args(expr);
+			break;
+		}
+
+		default:
+			assert(false);
+	}
+}
+
+// Resolves a standalone expression and returns the number of slots its
+// frame needs.
+int
+resolve_expr (program_t *program, expr_t *expr)
+{
+	resolver_t r;
+
+	r.program = program;
+	r.n_slots = 0;
+	resolve(&r, NULL, expr, NULL, 0);
+	return r.n_slots;
+}
+
+void
+resolve_function (program_t *program, function_t *func)
+{
+	resolver_t r;
+	resolve_scope_t args[func->n_args];
+	resolve_scope_t *scope = NULL;
+
+	r.program = program;
+	r.n_slots = func->n_args;
+	for (int i = 0; i < func->n_args; i++) {
+		args[i].symbol = func->arg_symbols[i];
+		args[i].slot = i;
+		args[i].next = scope;
+		scope = &args[i];
+	}
+	resolve(&r, scope, func->body, NULL, func->n_args);
+	func->n_slots = r.n_slots;
+}
+
+void
+resolve_program (program_t *program)
+{
+	for (function_t *func = program->functions; func != NULL; func = func->next)
+		resolve_function(program, func);
+}
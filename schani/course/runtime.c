@@ -0,0 +1,34 @@
+/*
+ * Runtime for programs compiled with --emit-asm:
+ *
+ *   ./simplang --emit-asm prog.sl >prog.s
+ *   gcc -o prog prog.s runtime.c
+ *   ./prog ARGS
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+extern const int64_t simplang_main_nargs;
+extern int64_t simplang_main (int64_t *args);
+
+int
+main (int argc, const char *argv[])
+{
+	int n_args = argc - 1;
+
+	if (n_args != simplang_main_nargs) {
+		fprintf(stderr, "Error: main expects %d args, but got %d.\n", (int)simplang_main_nargs, n_args);
+		return 2;
+	}
+
+	int64_t *args = malloc(sizeof(int64_t) * (n_args > 0 ? n_args : 1));
+	for (int i = 0; i < n_args; i++)
+		args[i] = (int64_t)strtoll(argv[i + 1], NULL, 10);
+
+	printf("%" PRId64 "\n", simplang_main(args));
+	free(args);
+	return 0;
+}
@@ -1,22 +1,45 @@
 #include <assert.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include "dynstring.h"
 #include "compiler.h"
 
 static const char *keyword_names[] = { "let", "and", "in", "if", "then", "else", "recur", "loop", "end", NULL };
 static const char *single_letter_operators = "()!-<+*";
 
+/*
+ * The sum of the first and the last letter of a keyword is different
+ * for each keyword modulo 16, so that's a perfect hash for them.  An
+ * identifier can only be the keyword with its hash, so it takes only
+ * one comparison to tell.
+ */
+#define KEYWORD_HASH(name,length)	(((unsigned char)(name)[0] + (unsigned char)(name)[(length) - 1]) & 15)
+
+// One more than the index in KEYWORD_NAMES of the keyword with each
+// hash, or 0 if there is none.
+static const uint8_t keyword_table[16] = {
+	[0] = 1,	// let
+	[5] = 2,	// and
+	[7] = 3,	// in
+	[15] = 4,	// if
+	[2] = 5,	// then
+	[10] = 6,	// else
+	[4] = 7,	// recur
+	[12] = 8,	// loop
+	[9] = 9		// end
+};
+
 static token_type_t
-find_keyword (const char *name)
+find_keyword (const char *name, size_t length)
 {
-	int i;
-	for (i = 0; keyword_names[i]; i++) {
-		if (strcmp(name, keyword_names[i]) == 0)
-			return TOKEN_FIRST_KEYWORD + i;
-	}
+	int i = keyword_table[KEYWORD_HASH(name, length)] - 1;
+
+	if (i >= 0 && strncmp(name, keyword_names[i], length) == 0 && keyword_names[i][length] == '\0')
+		return TOKEN_FIRST_KEYWORD + i;
 	return TOKEN_EOF;
 }
 
@@ -36,94 +59,271 @@ token_type_operator_name (token_type_t t)
 	return names[t - TOKEN_FIRST_OPERATOR];
 }
 
-static int
-lookahead (context_t *ctx)
+/*
+ * The whole source is tokenized in one pass, before parsing.  Runs of
+ * whitespace and of identifier characters, which is where most of the
+ * bytes are, are skipped a chunk at a time, by comparing all the bytes
+ * in the chunk at once.  Everything else is a byte at a time, looking
+ * up its class in CHAR_CLASSES.
+ */
+
+enum {
+	CLASS_INVALID,
+	CLASS_SPACE,
+	CLASS_LETTER,		// or underscore
+	CLASS_DIGIT,
+	CLASS_OPERATOR
+};
+
+static const uint8_t char_classes[256] = {
+	['\t' ... '\r'] = CLASS_SPACE,
+	[' '] = CLASS_SPACE,
+	['a' ... 'z'] = CLASS_LETTER,
+	['A' ... 'Z'] = CLASS_LETTER,
+	['_'] = CLASS_LETTER,
+	['0' ... '9'] = CLASS_DIGIT,
+	['('] = CLASS_OPERATOR,
+	[')'] = CLASS_OPERATOR,
+	['!'] = CLASS_OPERATOR,
+	['-'] = CLASS_OPERATOR,
+	['<'] = CLASS_OPERATOR,
+	['+'] = CLASS_OPERATOR,
+	['*'] = CLASS_OPERATOR,
+	['&'] = CLASS_OPERATOR,
+	['|'] = CLASS_OPERATOR,
+	['='] = CLASS_OPERATOR
+};
+
+#define CHAR_CLASS(c)	(char_classes[(unsigned char)(c)])
+
+#define CHUNK_SIZE	16
+
+// Signed, so that bytes above 127 are negative, and not in any of the
+// ranges we compare with.
+typedef signed char chunk_t __attribute__ ((vector_size (CHUNK_SIZE)));
+
+static chunk_t
+load_chunk (const char *p)
 {
-	return ctx->lookahead;
+	chunk_t chunk;
+	memcpy(&chunk, p, CHUNK_SIZE);
+	return chunk;
 }
 
-static bool
-consume (context_t *ctx)
+// The index of the first byte in MASK that's set, or CHUNK_SIZE if
+// there is none.  The bytes of the comparison results are either all
+// ones or all zeros, and the first one is the lowest on a little
+// endian machine.
+static size_t
+first_set_byte (chunk_t mask)
 {
-	ctx->lookahead = fgetc(ctx->file);
-	return ctx->lookahead != EOF;
+	uint64_t words[CHUNK_SIZE / 8];
+
+	memcpy(words, &mask, CHUNK_SIZE);
+	for (int i = 0; i < CHUNK_SIZE / 8; i++) {
+		if (words[i] != 0)
+			return i * 8 + __builtin_ctzll(words[i]) / 8;
+	}
+	return CHUNK_SIZE;
 }
 
-bool
-scan_init (context_t *ctx, const char *filename)
+static const char*
+skip_space (const char *p, const char *end)
 {
-	bool ok;
-	ctx->file = fopen(filename, "r");
-	assert(ctx->file);
-	ok = consume(ctx);
-	assert(ok);
-	return true;
+	// Most runs are a single space, so that's looked at first.
+	if (p < end && CHAR_CLASS(*p) == CLASS_SPACE)
+		p++;
+	if (p == end || CHAR_CLASS(*p) != CLASS_SPACE)
+		return p;
+	while (end - p >= CHUNK_SIZE) {
+		chunk_t c = load_chunk(p);
+		size_t n = first_set_byte(~((c == ' ') | ((c >= '\t') & (c <= '\r'))));
+		p += n;
+		if (n < CHUNK_SIZE)
+			return p;
+	}
+	while (p < end && CHAR_CLASS(*p) == CLASS_SPACE)
+		p++;
+	return p;
 }
 
-token_t
-scan (context_t *ctx)
+static const char*
+skip_ident_chars (const char *p, const char *end)
 {
-	if (lookahead(ctx) == EOF) {
-		token_t t = { TOKEN_EOF };
-		return t;
+	// Likewise, most identifiers are short.
+	for (int i = 0; i < 2; i++) {
+		if (p == end || (CHAR_CLASS(*p) != CLASS_LETTER && CHAR_CLASS(*p) != CLASS_DIGIT))
+			return p;
+		p++;
 	}
-	while (isspace(lookahead(ctx))) {
-		if (!consume(ctx)) {
-			token_t t = { TOKEN_EOF };
-			return t;
-		}
+	while (end - p >= CHUNK_SIZE) {
+		chunk_t c = load_chunk(p);
+		chunk_t lower = c | 0x20;
+		size_t n = first_set_byte(~(((lower >= 'a') & (lower <= 'z'))
+					    | ((c >= '0') & (c <= '9'))
+					    | (c == '_')));
+		p += n;
+		if (n < CHUNK_SIZE)
+			return p;
 	}
+	while (p < end && (CHAR_CLASS(*p) == CLASS_LETTER || CHAR_CLASS(*p) == CLASS_DIGIT))
+		p++;
+	return p;
+}
 
-	int c = lookahead(ctx);
-	if (isalpha(c) || c == '_') {
-		dynstring_t ds = ds_new(&ctx->pool);
-		ds_append_char(&ds, c);
-		while (consume(ctx) && (isalnum(lookahead(ctx)) || lookahead(ctx) == '_'))
-			ds_append_char(&ds, lookahead(ctx));
-		token_type_t tt = find_keyword(ds.data);
-		if (tt == TOKEN_EOF) {
-			token_t t = { TOKEN_IDENT };
-			t.v.name = ds.data;
-			return t;
-		} else {
-			token_t t = { tt };
-			return t;
+static void
+tokenize (context_t *ctx)
+{
+	const char *source = ctx->source;
+	const char *end = source + ctx->source_size;
+	const char *p = source;
+
+	// Every token takes at least a byte, so this is enough for all of
+	// them and the TOKEN_EOF.  Only the memory we write to is ever
+	// touched, and the rest is given back at the end.
+	error_assert(ctx->source_size < UINT32_MAX, "program too big");
+	ctx->tokens = malloc(sizeof(token_t) * (ctx->source_size + 1));
+	assert(ctx->tokens != NULL);
+	ctx->n_tokens = 0;
+	ctx->next_token = 0;
+
+	for (;;) {
+		p = skip_space(p, end);
+
+		token_t *t = &ctx->tokens[ctx->n_tokens++];
+		t->start = p - source;
+		if (p == end) {
+			t->type = TOKEN_EOF;
+			break;
+		}
+
+		char c = *p;
+		switch (CHAR_CLASS(c)) {
+			case CLASS_LETTER: {
+				const char *q = skip_ident_chars(p + 1, end);
+				size_t length = q - p;
+				token_type_t tt = find_keyword(p, length);
+				if (tt == TOKEN_EOF) {
+					t->type = TOKEN_IDENT;
+					t->v.ident.symbol = symtab_intern(&ctx->symbols, p, length);
+					t->v.ident.length = length;
+				} else {
+					t->type = tt;
+				}
+				p = q;
+				break;
+			}
+
+			case CLASS_DIGIT: {
+				// Too big a number becomes the biggest there is, as with atol.
+				int64_t value = 0;
+				do {
+					int digit = *p - '0';
+					if (value > (INT64_MAX - digit) / 10)
+						value = INT64_MAX;
+					else
+						value = value * 10 + digit;
+					p++;
+				} while (p < end && CHAR_CLASS(*p) == CLASS_DIGIT);
+				t->type = TOKEN_INTEGER;
+				t->v.i = value;
+				break;
+			}
+
+			case CLASS_OPERATOR:
+				p++;
+				if (c == '&' || c == '|') {
+					error_assert(p < end && *p == c, "invalid token");
+					p++;
+					t->type = c == '&' ? TOKEN_LOGIC_AND : TOKEN_LOGIC_OR;
+				} else if (c == '=') {
+					if (p < end && *p == '=') {
+						p++;
+						t->type = TOKEN_EQUALS;
+					} else {
+						t->type = TOKEN_ASSIGN;
+					}
+				} else {
+					t->type = TOKEN_FIRST_SINGLE_LETTER_OPERATOR + (strchr(single_letter_operators, c) - single_letter_operators);
+				}
+				break;
+
+			default:
+				error_assert(false, "invalid character");
 		}
 	}
-	if (isdigit(c)) {
-		dynstring_t ds = ds_new(&ctx->pool);
-		ds_append_char(&ds, c);
-		while (consume(ctx) && isdigit(lookahead(ctx)))
-			ds_append_char(&ds, lookahead(ctx));
-		token_t t = { TOKEN_INTEGER };
-		t.v.i = atol(ds.data);
-		return t;
-	}
-	if (strchr(single_letter_operators, c)) {
-		token_t t = { TOKEN_FIRST_SINGLE_LETTER_OPERATOR + (strchr(single_letter_operators, c) - single_letter_operators) };
-		consume(ctx);
-		return t;
-	}
-	if (c == '&' || c == '|') {
-		consume(ctx);
-		error_assert(lookahead(ctx) == c, "invalid token");
-		consume(ctx);
-		token_t t = { c == '&' ? TOKEN_LOGIC_AND : TOKEN_LOGIC_OR };
-		return t;
-	}
-	if (c == '=') {
-		consume(ctx);
-		if (lookahead(ctx) != '=') {
-			token_t t = { TOKEN_ASSIGN };
-			return t;
-		} else {
-			token_t t = { TOKEN_EQUALS };
-			consume(ctx);
-			return t;
+
+	ctx->tokens = realloc(ctx->tokens, sizeof(token_t) * ctx->n_tokens);
+	assert(ctx->tokens != NULL);
+}
+
+void
+scan_init_source (context_t *ctx, const char *source, size_t size)
+{
+	ctx->source = source;
+	ctx->source_size = size;
+	ctx->mapping = NULL;
+	ctx->buffer = NULL;
+	ctx->threads = NULL;
+	ctx->n_threads = 0;
+	symtab_init(&ctx->symbols);
+	tokenize(ctx);
+}
+
+/*
+ * Regular files are mapped.  Anything else, like a pipe, is read into
+ * a buffer.
+ */
+bool
+scan_init (context_t *ctx, const char *filename)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	void *mapping = MAP_FAILED;
+	char *buffer = NULL;
+	size_t size = 0;
+
+	assert(fd >= 0);
+	error_assert(fstat(fd, &st) == 0, "cannot stat program");
+	if (S_ISREG(st.st_mode) && st.st_size > 0)
+		mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping != MAP_FAILED) {
+		size = st.st_size;
+	} else {
+		size_t capacity = 4096;
+		ssize_t n;
+
+		buffer = malloc(capacity);
+		assert(buffer != NULL);
+		while ((n = read(fd, buffer + size, capacity - size)) > 0) {
+			size += n;
+			if (size == capacity) {
+				capacity *= 2;
+				buffer = realloc(buffer, capacity);
+				assert(buffer != NULL);
+			}
 		}
+		error_assert(n == 0, "cannot read program");
 	}
+	close(fd);
 
-	token_t t = { TOKEN_EOF };
-	error_assert(false, "invalid character");
-	return t;
+	scan_init_source(ctx, mapping != MAP_FAILED ? mapping : buffer, size);
+	if (mapping != MAP_FAILED)
+		ctx->mapping = mapping;
+	ctx->buffer = buffer;
+	return true;
+}
+
+void
+scan_free (context_t *ctx)
+{
+	if (ctx->mapping != NULL)
+		munmap(ctx->mapping, ctx->source_size);
+	free(ctx->buffer);
+	free(ctx->tokens);
+	ctx->source = NULL;
+	ctx->mapping = NULL;
+	ctx->buffer = NULL;
+	ctx->tokens = NULL;
+	ctx->n_tokens = 0;
 }
@@ -0,0 +1,446 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "compiler.h"
+
+/*
+ * Requests come one per line: the path of a program followed by the
+ * arguments for its main.  Each gets one line back, main's result or
+ * an error message starting with "Error:".
+ *
+ * Programs are cached by the hash of their source.  If a program's
+ * file looks different than when it was last read, by its size,
+ * modification time or inode, it is read and hashed again, so a
+ * program that has changed is compiled anew, and the code for its old
+ * version is thrown away.  A cached program keeps its VM context, too,
+ * so the threaded code, native code, traces and memo table of earlier
+ * runs are still there for the next one.
+ *
+ * Bad programs can take down the process they run in: syntax errors
+ * are assertions, and errors like stack overflows exit.  That's why
+ * the cache lives in a worker process, which the server passes the
+ * requests on to.  If the worker dies, the server replies with what
+ * it said last, and starts a new one, with an empty cache.
+ */
+
+#define SERVER_MAX_PROGRAMS	16
+
+typedef struct _cached_program_t
+{
+	uint64_t hash;
+	size_t size;
+	char *path;		// where it was last loaded from
+	struct stat st;		// of PATH, at the time
+	context_t ctx;		// owns the syntax tree
+	program_t *program;
+	vm_program_t prog;
+	vm_t vm;
+	int n_args;		// main's
+	struct _cached_program_t *next;
+} cached_program_t;
+
+typedef struct
+{
+	const server_options_t *options;
+	// Most recently used first.
+	cached_program_t *programs;
+	int n_programs;
+} cache_t;
+
+typedef struct
+{
+	const server_options_t *options;
+	pid_t worker;		// -1 if there is none
+	FILE *to_worker;
+	FILE *from_worker;
+	// Descriptors the worker mustn't keep open, or -1.
+	int listen_fd;
+	int client_fd;
+} server_t;
+
+// FNV-1a
+static uint64_t
+hash_source (const char *source, size_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (unsigned char)source[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static char*
+read_file (const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "r");
+	size_t capacity = 4096;
+	char *buf;
+
+	if (f == NULL)
+		return NULL;
+	buf = malloc(capacity);
+	assert(buf != NULL);
+	*size = 0;
+	for (;;) {
+		*size += fread(buf + *size, 1, capacity - *size, f);
+		if (*size < capacity)
+			break;
+		capacity *= 2;
+		buf = realloc(buf, capacity);
+		assert(buf != NULL);
+	}
+	fclose(f);
+	return buf;
+}
+
+static cached_program_t*
+load_program (const server_options_t *options, const char *path, char *source, size_t size, uint64_t hash)
+{
+	cached_program_t *cp = malloc(sizeof(cached_program_t));
+	function_t *main_function;
+
+	assert(cp != NULL);
+	cp->hash = hash;
+	cp->size = size;
+	cp->path = strdup(path);
+	pool_init(&cp->ctx.pool);
+
+	scan_init_source(&cp->ctx, source, size);
+	parser_init(&cp->ctx);
+	cp->program = parse_program(&cp->ctx);
+	scan_free(&cp->ctx);
+
+	resolve_program(cp->program);
+	if (options->memo_names != NULL)
+		memo_select(memo_new(options->memo_size), &cp->ctx.symbols, cp->program, options->memo_names);
+	main_function = lookup_function(cp->program, "main");
+	error_assert(main_function != NULL, "Function main must be defined.");
+	cp->n_args = main_function->n_args;
+
+	compile_program(&cp->ctx, cp->program, &cp->prog);
+	if (options->fuse)
+		vm_fuse(&cp->prog);
+	if (options->verify)
+		vm_verify(&cp->prog);
+
+	vm_init(&cp->vm, &cp->prog, VM_STACK_SLOTS, VM_CALL_STACK_SIZE, options->huge_pages);
+	cp->vm.memo = cp->program->memo;
+	return cp;
+}
+
+static void
+free_program (cached_program_t *cp)
+{
+	vm_free(&cp->vm);
+	free(cp->prog.instructions);
+	free(cp->prog.memo_ids);
+	free(cp->prog.names);
+	free(cp->prog.frame_sizes);
+	if (cp->program->memo != NULL)
+		memo_free(cp->program->memo);
+	pool_free(&cp->ctx.pool);
+	symtab_free(&cp->ctx.symbols);
+	free(cp->path);
+	free(cp);
+}
+
+/*
+ * Returns the program for SOURCE, which was read from PATH, from the
+ * cache, or loads it.  Other versions of PATH are dropped.
+ */
+static cached_program_t*
+get_program (cache_t *cache, const char *path, char *source, size_t size)
+{
+	uint64_t hash = hash_source(source, size);
+	cached_program_t **link = &cache->programs;
+	cached_program_t *found = NULL;
+
+	while (*link != NULL) {
+		cached_program_t *cp = *link;
+		if (cp->hash == hash && cp->size == size) {
+			*link = cp->next;
+			found = cp;
+		} else if (strcmp(cp->path, path) == 0) {
+			*link = cp->next;
+			free_program(cp);
+			cache->n_programs--;
+		} else {
+			link = &cp->next;
+		}
+	}
+
+	if (found != NULL) {
+		if (strcmp(found->path, path) != 0) {
+			free(found->path);
+			found->path = strdup(path);
+		}
+	} else {
+		found = load_program(cache->options, path, source, size, hash);
+		cache->n_programs++;
+	}
+	found->next = cache->programs;
+	cache->programs = found;
+
+	if (cache->n_programs > SERVER_MAX_PROGRAMS) {
+		link = &cache->programs;
+		while ((*link)->next != NULL)
+			link = &(*link)->next;
+		free_program(*link);
+		*link = NULL;
+		cache->n_programs--;
+	}
+	return found;
+}
+
+static bool
+same_file (const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+		&& a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Returns the cached program for PATH if its file hasn't changed
+ * since, without reading it, or NULL.
+ */
+static cached_program_t*
+find_unchanged (cache_t *cache, const char *path, const struct stat *st)
+{
+	for (cached_program_t **link = &cache->programs; *link != NULL; link = &(*link)->next) {
+		cached_program_t *cp = *link;
+		if (strcmp(cp->path, path) == 0 && same_file(&cp->st, st)) {
+			*link = cp->next;
+			cp->next = cache->programs;
+			cache->programs = cp;
+			return cp;
+		}
+	}
+	return NULL;
+}
+
+// Handles REQUEST, printing the reply, prefixed with "=", to OUT.
+static void
+handle_request (cache_t *cache, char *request, FILE *out)
+{
+	char *save;
+	char *path = strtok_r(request, " \t", &save);
+	int64_t *args = malloc(sizeof(int64_t) * (strlen(save) / 2 + 1));
+	int argc = 0;
+	char *arg;
+
+	assert(path != NULL && args != NULL);
+	while ((arg = strtok_r(NULL, " \t", &save)) != NULL)
+		args[argc++] = (int64_t)strtoll(arg, NULL, 10);
+
+	struct stat st;
+	cached_program_t *cp = NULL;
+	memset(&st, 0, sizeof(st));
+	if (stat(path, &st) == 0)
+		cp = find_unchanged(cache, path, &st);
+	if (cp == NULL) {
+		size_t size;
+		char *source = read_file(path, &size);
+		if (source == NULL) {
+			fprintf(out, "=Error: cannot read %s: %s\n", path, strerror(errno));
+			free(args);
+			return;
+		}
+		cp = get_program(cache, path, source, size);
+		cp->st = st;
+		free(source);
+	}
+
+	if (cp->n_args != argc) {
+		fprintf(out, "=Error: main expects %d args, but got %d.\n", cp->n_args, argc);
+	} else {
+		vm_reset(&cp->vm);
+		vm_push_args(&cp->vm, argc, args);
+		fprintf(out, "=%" PRId64 "\n", cache->options->engine(&cp->vm));
+	}
+	free(args);
+}
+
+static void
+worker_main (const server_options_t *options, FILE *in, FILE *out)
+{
+	cache_t cache;
+	char *line = NULL;
+	size_t capacity = 0;
+
+	cache.options = options;
+	cache.programs = NULL;
+	cache.n_programs = 0;
+
+	while (getline(&line, &capacity, in) >= 0) {
+		line[strcspn(line, "\n")] = '\0';
+		handle_request(&cache, line, out);
+		fflush(out);
+	}
+}
+
+/*
+ * The worker reads requests from one pipe, and answers on another,
+ * which is its stdout and stderr, so that the server also gets the
+ * error message if it dies.
+ */
+static void
+start_worker (server_t *server)
+{
+	int requests[2], replies[2];
+
+	error_assert(pipe(requests) == 0 && pipe(replies) == 0, "cannot create pipes for the server worker");
+	fflush(stdout);
+	fflush(stderr);
+	server->worker = fork();
+	error_assert(server->worker >= 0, "cannot start the server worker");
+
+	if (server->worker == 0) {
+		if (server->listen_fd >= 0)
+			close(server->listen_fd);
+		if (server->client_fd >= 0)
+			close(server->client_fd);
+		close(requests[1]);
+		close(replies[0]);
+		dup2(replies[1], 1);
+		dup2(replies[1], 2);
+		close(replies[1]);
+		worker_main(server->options, fdopen(requests[0], "r"), stdout);
+		exit(0);
+	}
+
+	close(requests[0]);
+	close(replies[1]);
+	server->to_worker = fdopen(requests[1], "w");
+	server->from_worker = fdopen(replies[0], "r");
+	assert(server->to_worker != NULL && server->from_worker != NULL);
+}
+
+static void
+stop_worker (server_t *server, int *status)
+{
+	fclose(server->to_worker);
+	fclose(server->from_worker);
+	waitpid(server->worker, status, 0);
+	server->worker = -1;
+}
+
+// Passes REQUEST on to the worker and prints its reply to OUT.
+static void
+forward_request (server_t *server, const char *request, FILE *out)
+{
+	char *line = NULL;
+	size_t capacity = 0;
+	char *message = NULL;
+
+	if (server->worker < 0)
+		start_worker(server);
+
+	fprintf(server->to_worker, "%s\n", request);
+	fflush(server->to_worker);
+	while (getline(&line, &capacity, server->from_worker) >= 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '=') {
+			fprintf(out, "%s\n", line + 1);
+			free(message);
+			free(line);
+			return;
+		}
+		if (message == NULL)
+			message = strdup(line);
+	}
+
+	int status;
+	stop_worker(server, &status);
+	if (message != NULL && strncmp(message, "Error:", 6) == 0)
+		fprintf(out, "%s\n", message);
+	else if (message != NULL)
+		fprintf(out, "Error: %s\n", message);
+	else if (WIFSIGNALED(status))
+		fprintf(out, "Error: killed by signal %d\n", WTERMSIG(status));
+	else
+		fprintf(out, "Error: exited with status %d\n", WEXITSTATUS(status));
+	free(message);
+	free(line);
+}
+
+static void
+serve_stream (server_t *server, FILE *in, FILE *out)
+{
+	char *line = NULL;
+	size_t capacity = 0;
+
+	while (getline(&line, &capacity, in) >= 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0')
+			continue;
+		forward_request(server, line, out);
+		fflush(out);
+	}
+	free(line);
+}
+
+static void
+serve_socket (server_t *server, const char *socket_path)
+{
+	struct sockaddr_un addr;
+
+	error_assert(strlen(socket_path) < sizeof(addr.sun_path), "socket path is too long");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	error_assert(server->listen_fd >= 0, "cannot create socket");
+	unlink(socket_path);
+	error_assert(bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0, "cannot bind socket");
+	error_assert(listen(server->listen_fd, 16) == 0, "cannot listen on socket");
+
+	for (;;) {
+		server->client_fd = accept(server->listen_fd, NULL, NULL);
+		if (server->client_fd < 0) {
+			error_assert(errno == EINTR, "cannot accept connection");
+			continue;
+		}
+		FILE *in = fdopen(server->client_fd, "r");
+		FILE *out = fdopen(dup(server->client_fd), "w");
+		assert(in != NULL && out != NULL);
+		serve_stream(server, in, out);
+		fclose(in);
+		fclose(out);
+		server->client_fd = -1;
+	}
+}
+
+void
+serve (const server_options_t *options, const char *socket_path)
+{
+	server_t server;
+
+	// Writing to a dead worker or a client that has gone away must
+	// not kill us.
+	signal(SIGPIPE, SIG_IGN);
+
+	server.options = options;
+	server.worker = -1;
+	server.listen_fd = -1;
+	server.client_fd = -1;
+
+	if (socket_path != NULL) {
+		serve_socket(&server, socket_path);
+	} else {
+		serve_stream(&server, stdin, stdout);
+		if (server.worker >= 0)
+			stop_worker(&server, NULL);
+	}
+}
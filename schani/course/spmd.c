@@ -0,0 +1,399 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+
+/*
+ * The SPMD engine runs verified VM code on 4 or 8 argument vectors at
+ * once, one per lane.  Each lane has its own program counter, stack
+ * pointer and call stack, but the lanes' values of a slot are stored
+ * next to each other, so that the lanes that are at the same
+ * instruction with the same stack pointer can be run together with
+ * vector instructions.  Such a set of lanes is a group.  Dispatch then
+ * costs the same for the whole group.
+ *
+ * The scheduler picks the lanes with the deepest call stack, and of
+ * those the ones at the lowest instruction.  The code generator places
+ * the joins of conditionals and the exits of loops after their
+ * branches, so lanes that took different branches meet again there.
+ * A group runs until it branches apart, returns, or reaches an
+ * instruction where another lane is waiting to join it.
+ *
+ * A group whose lanes have different stack pointers, because they got
+ * there through different calls, is run one lane at a time.
+ */
+
+#define SPMD_WIDTH	4
+#define SPMD_MAX_LANES	8
+#define SPMD_MAX_VECS	(SPMD_MAX_LANES / SPMD_WIDTH)
+
+typedef int64_t spmd_vec_t __attribute__ ((vector_size (SPMD_WIDTH * sizeof(int64_t))));
+
+typedef struct
+{
+	size_t stack_pointer;
+	size_t dst;
+	int32_t return_pc;
+} spmd_frame_t;
+
+struct _vm_spmd_t
+{
+	const vm_program_t *program;
+	int lanes;
+	int n_vecs;
+
+	// Slot S of lane L is VALUES[S * LANES + L].
+	int64_t *values;
+	size_t array_size;
+	size_t used_slots;
+
+	// Call depth D of lane L is FRAMES[D * LANES + L].
+	spmd_frame_t *frames;
+	size_t call_stack_size;
+};
+
+typedef struct
+{
+	vm_spmd_t *spmd;
+	unsigned live;
+	int32_t pc[SPMD_MAX_LANES];
+	size_t sp[SPMD_MAX_LANES];
+	size_t depth[SPMD_MAX_LANES];
+	int64_t *results;
+} spmd_run_t;
+
+vm_spmd_t*
+vm_spmd_new (const vm_program_t *prog, int lanes, size_t stack_size, size_t call_stack_size, bool huge_pages)
+{
+	assert(lanes == 4 || lanes == 8);
+	assert(prog->frame_sizes != NULL && prog->memo_ids == NULL);
+
+	vm_spmd_t *spmd = malloc(sizeof(vm_spmd_t));
+	assert(spmd != NULL);
+	spmd->program = prog;
+	spmd->lanes = lanes;
+	spmd->n_vecs = lanes / SPMD_WIDTH;
+	spmd->values = vm_reserve_stack(stack_size * lanes * sizeof(int64_t), huge_pages);
+	spmd->array_size = stack_size;
+	spmd->used_slots = 0;
+	spmd->frames = vm_reserve_stack(call_stack_size * lanes * sizeof(spmd_frame_t), false);
+	spmd->call_stack_size = call_stack_size;
+	return spmd;
+}
+
+void
+vm_spmd_free (vm_spmd_t *spmd)
+{
+	vm_release_stack(spmd->values, spmd->array_size * spmd->lanes * sizeof(int64_t));
+	vm_release_stack(spmd->frames, spmd->call_stack_size * spmd->lanes * sizeof(spmd_frame_t));
+	free(spmd);
+}
+
+static inline void
+check_frame (vm_spmd_t *spmd, size_t sp, int32_t entry)
+{
+	size_t end = sp + spmd->program->frame_sizes[entry];
+
+	error_assert(end <= spmd->array_size, "VM stack overflow");
+	if (end > spmd->used_slots)
+		spmd->used_slots = end;
+}
+
+/*
+ * Picks the next group.  Returns its lanes as a bit set, and in
+ * MERGE_PC the lowest instruction after it where other lanes at the
+ * same call depth are waiting.
+ */
+static unsigned
+schedule (spmd_run_t *run, int32_t *merge_pc)
+{
+	unsigned group = 0;
+	size_t depth = 0;
+	int32_t pc = 0;
+
+	for (int l = 0; l < run->spmd->lanes; l++) {
+		if (!(run->live & (1u << l)))
+			continue;
+		if (group == 0 || run->depth[l] > depth || (run->depth[l] == depth && run->pc[l] < pc)) {
+			group = 1u << l;
+			depth = run->depth[l];
+			pc = run->pc[l];
+		} else if (run->depth[l] == depth && run->pc[l] == pc) {
+			group |= 1u << l;
+		}
+	}
+
+	*merge_pc = INT32_MAX;
+	for (int l = 0; l < run->spmd->lanes; l++) {
+		if ((run->live & ~group & (1u << l)) && run->depth[l] == depth && run->pc[l] < *merge_pc)
+			*merge_pc = run->pc[l];
+	}
+	return group;
+}
+
+#define FOR_LANES(l, group)	for (int l = 0; l < lanes; l++) if ((group) & (1u << l))
+#define LANE_SLOT(l, slot)	values[(run->sp[l] + (slot)) * lanes + (l)]
+#define VEC_SLOT(slot, k)	base[(ptrdiff_t)(slot) * n_vecs + (k)]
+
+// Sets slot DST to EXPR for all lanes of the group.  EXPR can use A
+// and B, the values of slots SRC1 and SRC2, and is evaluated on
+// vectors if the group is uniform.
+#define SPMD_OP(dst, src1, src2, expr)						\
+	do {									\
+		if (uniform) {							\
+			for (int k = 0; k < n_vecs; k++) {			\
+				spmd_vec_t a = VEC_SLOT(src1, k);		\
+				spmd_vec_t b = VEC_SLOT(src2, k);		\
+				spmd_vec_t r = (expr);				\
+				spmd_vec_t *d = &VEC_SLOT(dst, k);		\
+				if (full)					\
+					*d = r;					\
+				else						\
+					*d = (r & mask[k]) | (*d & ~mask[k]);	\
+				(void)b;					\
+			}							\
+		} else {							\
+			FOR_LANES(l, group) {					\
+				int64_t a = LANE_SLOT(l, src1);			\
+				int64_t b = LANE_SLOT(l, src2);			\
+				LANE_SLOT(l, dst) = (expr);			\
+				(void)b;					\
+			}							\
+		}								\
+	} while (0)
+
+// Sets BITS to the lanes of the group for which COND holds, with A
+// and B as in SPMD_OP.
+#define SPMD_LANES_WHERE(bits, src1, src2, cond)				\
+	do {									\
+		bits = 0;							\
+		if (uniform) {							\
+			for (int k = 0; k < n_vecs; k++) {			\
+				spmd_vec_t a = VEC_SLOT(src1, k);		\
+				spmd_vec_t b = VEC_SLOT(src2, k);		\
+				spmd_vec_t c = (cond) & lane_bits[k];		\
+				for (int i = 0; i < SPMD_WIDTH; i++)		\
+					bits |= c[i];				\
+				(void)b;					\
+			}							\
+		} else {							\
+			FOR_LANES(l, group) {					\
+				int64_t a = LANE_SLOT(l, src1);			\
+				int64_t b = LANE_SLOT(l, src2);			\
+				if (cond)					\
+					bits |= 1u << l;			\
+				(void)b;					\
+			}							\
+		}								\
+		bits &= group;							\
+	} while (0)
+
+static const spmd_vec_t lane_bits[SPMD_MAX_VECS] = {
+	{ 1, 2, 4, 8 },
+	{ 16, 32, 64, 128 }
+};
+
+/*
+ * Runs GROUP, starting at its lanes' common instruction, until it has
+ * to be scheduled again.  This is compiled for AVX2 and for plain
+ * x86-64, where the vectors are done in SSE registers, and the best
+ * one for the machine is picked at load time.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__clang__)
+__attribute__ ((target_clones ("avx2", "default")))
+#endif
+static void
+run_group (spmd_run_t *run, unsigned group, int32_t merge_pc)
+{
+	vm_spmd_t *spmd = run->spmd;
+	const vm_program_t *prog = spmd->program;
+	const int lanes = spmd->lanes;
+	const int n_vecs = spmd->n_vecs;
+	int64_t *values = spmd->values;
+	spmd_vec_t mask[SPMD_MAX_VECS];
+	spmd_vec_t *base = NULL;
+	// Lanes that are done can be overwritten, so if all others are in
+	// the group the results don't have to be blended in.
+	unsigned writable = group | ~run->live;
+	bool full = (writable & ((1u << lanes) - 1)) == (1u << lanes) - 1;
+	bool uniform = true;
+	int first = __builtin_ctz(group);
+	int32_t pc = run->pc[first];
+
+	FOR_LANES(l, group) {
+		if (run->sp[l] != run->sp[first])
+			uniform = false;
+	}
+	for (int k = 0; k < n_vecs; k++) {
+		for (int i = 0; i < SPMD_WIDTH; i++)
+			mask[k][i] = (writable & (1u << (k * SPMD_WIDTH + i))) ? -1 : 0;
+	}
+	if (uniform)
+		base = (spmd_vec_t*)(values + run->sp[first] * lanes);
+
+	while (pc < merge_pc) {
+		vm_ins_t *ins = &prog->instructions[pc];
+		int32_t target = ins->opcode == VM_OP_JUMP_IF_ZERO ? ins->args.slot.arg2 : ins->args.slot.arg3;
+		unsigned taken;
+
+		switch (ins->opcode) {
+			case VM_OP_MOVE:
+				SPMD_OP(ins->args.slot.arg1, ins->args.slot.arg2, ins->args.slot.arg2, a);
+				break;
+			case VM_OP_SET: {
+				int64_t imm = ins->args.imm.imm;
+				SPMD_OP(ins->args.imm.arg, ins->args.imm.arg, ins->args.imm.arg, 0 * a + imm);
+				break;
+			}
+			case VM_OP_ADD:
+				SPMD_OP(ins->args.slot.arg1, ins->args.slot.arg2, ins->args.slot.arg3, a + b);
+				break;
+			case VM_OP_MULTIPLY:
+				SPMD_OP(ins->args.slot.arg1, ins->args.slot.arg2, ins->args.slot.arg3, a * b);
+				break;
+			case VM_OP_NEGATE:
+				SPMD_OP(ins->args.slot.arg1, ins->args.slot.arg2, ins->args.slot.arg2, -a);
+				break;
+			case VM_OP_NOT:
+				SPMD_OP(ins->args.slot.arg1, ins->args.slot.arg2, ins->args.slot.arg2, (a == 0) & 1);
+				break;
+			case VM_OP_LESS_THAN:
+				SPMD_OP(ins->args.slot.arg1, ins->args.slot.arg2, ins->args.slot.arg3, (a < b) & 1);
+				break;
+			case VM_OP_EQUALS:
+				SPMD_OP(ins->args.slot.arg1, ins->args.slot.arg2, ins->args.slot.arg3, (a == b) & 1);
+				break;
+			case VM_OP_ADD_IMM: {
+				int64_t imm = ins->args.imm.imm;
+				SPMD_OP(ins->args.imm.arg, ins->args.imm.arg2, ins->args.imm.arg2, a + imm);
+				break;
+			}
+			case VM_OP_MULTIPLY_IMM: {
+				int64_t imm = ins->args.imm.imm;
+				SPMD_OP(ins->args.imm.arg, ins->args.imm.arg2, ins->args.imm.arg2, a * imm);
+				break;
+			}
+			case VM_OP_MOVE_MOVE:
+				SPMD_OP(ins->args.slot.arg1, ins->args.slot.arg2, ins->args.slot.arg2, a);
+				SPMD_OP(ins->args.slot.arg3, ins->args.slot.arg4, ins->args.slot.arg4, a);
+				break;
+
+			case VM_OP_JUMP:
+				pc = ins->args.slot.arg1;
+				continue;
+
+			case VM_OP_JUMP_IF_ZERO:
+			case VM_OP_JUMP_IF_NOT_LESS:
+			case VM_OP_JUMP_IF_NOT_EQUAL:
+				if (ins->opcode == VM_OP_JUMP_IF_ZERO)
+					SPMD_LANES_WHERE(taken, ins->args.slot.arg1, ins->args.slot.arg1, a == 0);
+				else if (ins->opcode == VM_OP_JUMP_IF_NOT_LESS)
+					SPMD_LANES_WHERE(taken, ins->args.slot.arg1, ins->args.slot.arg2, a >= b);
+				else
+					SPMD_LANES_WHERE(taken, ins->args.slot.arg1, ins->args.slot.arg2, a != b);
+				if (taken == 0) {
+					pc++;
+					continue;
+				}
+				if (taken == group) {
+					pc = target;
+					continue;
+				}
+				// The group splits up.
+				FOR_LANES(l, group)
+					run->pc[l] = (taken & (1u << l)) ? target : pc + 1;
+				return;
+
+			case VM_OP_CALL: {
+				int32_t n = ins->args.slot.arg2;
+				target = ins->args.slot.arg1;
+				FOR_LANES(l, group) {
+					size_t sp = run->sp[l];
+					check_frame(spmd, sp + n, target);
+					spmd_frame_t *frame = &spmd->frames[run->depth[l] * lanes + l];
+					frame->stack_pointer = sp;
+					frame->dst = sp + ins->args.slot.arg3;
+					frame->return_pc = pc + 1;
+					run->depth[l]++;
+					run->sp[l] = sp + n;
+				}
+				if (uniform)
+					base += (ptrdiff_t)n * n_vecs;
+				// Nothing is deeper than this group, so no lane
+				// can be waiting for it.
+				merge_pc = INT32_MAX;
+				pc = target;
+				continue;
+			}
+
+			case VM_OP_RETURN:
+				FOR_LANES(l, group) {
+					int64_t result = LANE_SLOT(l, ins->args.slot.arg1);
+					if (run->depth[l] == 0) {
+						run->results[l] = result;
+						run->live &= ~(1u << l);
+						continue;
+					}
+					spmd_frame_t *frame = &spmd->frames[--run->depth[l] * lanes + l];
+					values[frame->dst * lanes + l] = result;
+					run->sp[l] = frame->stack_pointer;
+					run->pc[l] = frame->return_pc;
+				}
+				// If this was the only group and all its lanes return
+				// to the same place it keeps running.
+				if (group != run->live)
+					return;
+				FOR_LANES(l, group) {
+					if (run->pc[l] != run->pc[first] || run->sp[l] != run->sp[first])
+						return;
+				}
+				pc = run->pc[first];
+				uniform = true;
+				base = (spmd_vec_t*)(values + run->sp[first] * lanes);
+				continue;
+
+			default:
+				assert(false);
+		}
+		pc++;
+	}
+
+	FOR_LANES(l, group)
+		run->pc[l] = pc;
+}
+
+/*
+ * Runs the program on N argument vectors, at most as many as there
+ * are lanes.  Vector I has N_ARGS[I] arguments, starting at ARGS[I].
+ */
+void
+vm_run_spmd (vm_spmd_t *spmd, int n, int64_t **args, int *n_args, int64_t *results)
+{
+	spmd_run_t run;
+
+	assert(n > 0 && n <= spmd->lanes);
+
+	memset(spmd->values, 0, spmd->used_slots * spmd->lanes * sizeof(int64_t));
+	spmd->used_slots = 0;
+
+	run.spmd = spmd;
+	run.live = (1u << n) - 1;
+	run.results = results;
+	for (int l = 0; l < n; l++) {
+		error_assert(n_args[l] >= spmd->program->entry_args, "not enough arguments for the VM code");
+		check_frame(spmd, n_args[l], 0);
+		for (int i = 0; i < n_args[l]; i++)
+			spmd->values[i * spmd->lanes + l] = args[l][i];
+		run.pc[l] = 0;
+		run.sp[l] = n_args[l];
+		run.depth[l] = 0;
+	}
+
+	while (run.live != 0) {
+		int32_t merge_pc;
+		unsigned group = schedule(&run, &merge_pc);
+		run_group(&run, group, merge_pc);
+	}
+}
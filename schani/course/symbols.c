@@ -0,0 +1,125 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+
+/*
+ * The names are allocated in the symbol table's own pool, so they
+ * never move, and found by an open addressing hash table of symbol
+ * ids, which is kept at most half full.  The hash of each symbol is
+ * kept, too, so that growing the table doesn't have to hash the names
+ * again, and so that most mismatches are found without looking at the
+ * names.
+ */
+
+#define INITIAL_TABLE_SIZE	256
+
+// FNV-1a
+static uint32_t
+hash_name (const char *name, size_t length)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void
+symtab_init (symtab_t *symtab)
+{
+	pool_init(&symtab->pool);
+	symtab->names = NULL;
+	symtab->hashes = NULL;
+	symtab->n_symbols = 0;
+	symtab->names_size = 0;
+	symtab->table_size = INITIAL_TABLE_SIZE;
+	symtab->table = malloc(sizeof(int32_t) * symtab->table_size);
+	assert(symtab->table != NULL);
+	memset(symtab->table, -1, sizeof(int32_t) * symtab->table_size);
+}
+
+void
+symtab_free (symtab_t *symtab)
+{
+	pool_free(&symtab->pool);
+	free(symtab->names);
+	free(symtab->hashes);
+	free(symtab->table);
+}
+
+static int32_t*
+find_slot (symtab_t *symtab, const char *name, size_t length, uint32_t hash)
+{
+	size_t mask = symtab->table_size - 1;
+	size_t i = hash & mask;
+
+	for (;;) {
+		int32_t id = symtab->table[i];
+		if (id < 0
+		    || (symtab->hashes[id] == hash
+			&& strncmp(symtab->names[id], name, length) == 0
+			&& symtab->names[id][length] == '\0'))
+			return &symtab->table[i];
+		i = (i + 1) & mask;
+	}
+}
+
+static void
+grow_table (symtab_t *symtab)
+{
+	size_t mask;
+
+	free(symtab->table);
+	symtab->table_size *= 2;
+	symtab->table = malloc(sizeof(int32_t) * symtab->table_size);
+	assert(symtab->table != NULL);
+	memset(symtab->table, -1, sizeof(int32_t) * symtab->table_size);
+
+	mask = symtab->table_size - 1;
+	for (int32_t id = 0; id < symtab->n_symbols; id++) {
+		size_t i = symtab->hashes[id] & mask;
+		while (symtab->table[i] >= 0)
+			i = (i + 1) & mask;
+		symtab->table[i] = id;
+	}
+}
+
+int32_t
+symtab_lookup (symtab_t *symtab, const char *name, size_t length)
+{
+	return *find_slot(symtab, name, length, hash_name(name, length));
+}
+
+int32_t
+symtab_intern (symtab_t *symtab, const char *name, size_t length)
+{
+	uint32_t hash = hash_name(name, length);
+	int32_t *slot = find_slot(symtab, name, length, hash);
+
+	if (*slot >= 0)
+		return *slot;
+
+	if (symtab->n_symbols == symtab->names_size) {
+		symtab->names_size = symtab->names_size == 0 ? 64 : symtab->names_size * 2;
+		symtab->names = realloc(symtab->names, sizeof(const char*) * symtab->names_size);
+		symtab->hashes = realloc(symtab->hashes, sizeof(uint32_t) * symtab->names_size);
+		assert(symtab->names != NULL && symtab->hashes != NULL);
+	}
+
+	char *copy = pool_alloc(&symtab->pool, length + 1);
+	memcpy(copy, name, length);
+	copy[length] = '\0';
+
+	int32_t id = symtab->n_symbols++;
+	symtab->names[id] = copy;
+	symtab->hashes[id] = hash;
+	*slot = id;
+
+	if ((size_t)symtab->n_symbols * 2 > symtab->table_size)
+		grow_table(symtab);
+	return id;
+}
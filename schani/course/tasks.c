@@ -0,0 +1,243 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "tasks.h"
+#include "compiler.h"
+
+/*
+ * Each worker has a Chase-Lev deque of tasks.  The owner pushes and
+ * takes at the bottom without locking, and other workers steal from
+ * the top with a compare-and-swap.  The memory orders follow Lê et
+ * al., "Correct and Efficient Work-Stealing for Weak Memory Models".
+ *
+ * The deque never grows: no more than TASK_MAX_QUEUED tasks are ever
+ * waiting in it, so a small ring buffer is enough.
+ */
+
+#define DEQUE_SIZE	16
+
+// Tasks may recurse deeply, and a worker that waits for a join runs
+// other tasks on top of its own, so workers get big stacks.  They're
+// only backed by memory as far as they're used.
+#define WORKER_STACK_SIZE	((size_t)256 << 20)
+
+typedef struct
+{
+	atomic_llong top;
+	atomic_llong bottom;
+	_Atomic(task_t*) buffer[DEQUE_SIZE];
+} deque_t;
+
+struct _task_worker_t
+{
+	deque_t deque;
+	void *data;
+	unsigned seed;
+	struct _task_scheduler_t *scheduler;
+	pthread_t thread;
+};
+
+typedef struct _task_scheduler_t
+{
+	task_worker_t *workers;
+	int n_workers;
+	atomic_int finished;
+} task_scheduler_t;
+
+static void
+deque_init (deque_t *deque)
+{
+	atomic_init(&deque->top, 0);
+	atomic_init(&deque->bottom, 0);
+	for (int i = 0; i < DEQUE_SIZE; i++)
+		atomic_init(&deque->buffer[i], NULL);
+}
+
+static long long
+deque_size (deque_t *deque)
+{
+	long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	long long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+	return b - t;
+}
+
+static void
+deque_push (deque_t *deque, task_t *task)
+{
+	long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	long long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+	assert(b - t < DEQUE_SIZE);
+	atomic_store_explicit(&deque->buffer[b % DEQUE_SIZE], task, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+}
+
+// Takes the most recently pushed task, or returns NULL if it has
+// been stolen.
+static task_t*
+deque_take (deque_t *deque)
+{
+	long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+	if (t > b) {
+		atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	task_t *task = atomic_load_explicit(&deque->buffer[b % DEQUE_SIZE], memory_order_relaxed);
+	if (t == b) {
+		// The last one, which a thief might be after, too.
+		if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+							     memory_order_seq_cst, memory_order_relaxed))
+			task = NULL;
+		atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+	}
+	return task;
+}
+
+static task_t*
+deque_steal (deque_t *deque)
+{
+	long long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+	if (t >= b)
+		return NULL;
+
+	task_t *task = atomic_load_explicit(&deque->buffer[t % DEQUE_SIZE], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+						     memory_order_seq_cst, memory_order_relaxed))
+		return NULL;
+	return task;
+}
+
+void*
+task_worker_data (task_worker_t *worker)
+{
+	return worker->data;
+}
+
+static void
+run_task (task_t *task, task_worker_t *worker)
+{
+	task->func(task, worker);
+	atomic_store_explicit(&task->done, 1, memory_order_release);
+}
+
+void
+task_spawn (task_worker_t *worker, task_t *task, task_func_t func)
+{
+	task->func = func;
+	atomic_init(&task->done, 0);
+	task->spawned = worker->scheduler->n_workers > 1 && deque_size(&worker->deque) < TASK_MAX_QUEUED;
+	if (task->spawned)
+		deque_push(&worker->deque, task);
+}
+
+// Tries to steal a task from a random other worker and run it.
+static bool
+steal_and_run (task_worker_t *worker)
+{
+	task_scheduler_t *scheduler = worker->scheduler;
+	int n = scheduler->n_workers;
+
+	if (n < 2)
+		return false;
+
+	int start = rand_r(&worker->seed) % n;
+	for (int i = 0; i < n; i++) {
+		task_worker_t *victim = &scheduler->workers[(start + i) % n];
+		if (victim == worker)
+			continue;
+		task_t *task = deque_steal(&victim->deque);
+		if (task != NULL) {
+			run_task(task, worker);
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+task_join (task_worker_t *worker, task_t *task)
+{
+	if (!task->spawned) {
+		task->func(task, worker);
+		return;
+	}
+
+	// Tasks are joined in the reverse order of spawning, so if TASK
+	// is still here it's at the bottom.
+	task_t *taken = deque_take(&worker->deque);
+	if (taken != NULL) {
+		assert(taken == task);
+		run_task(task, worker);
+		return;
+	}
+
+	while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+		if (!steal_and_run(worker))
+			sched_yield();
+	}
+}
+
+static void*
+worker_main (void *arg)
+{
+	task_worker_t *worker = arg;
+
+	while (!atomic_load_explicit(&worker->scheduler->finished, memory_order_acquire)) {
+		if (!steal_and_run(worker))
+			sched_yield();
+	}
+	return NULL;
+}
+
+void
+task_run (int n_workers, void **data, task_t *root, task_func_t func)
+{
+	task_scheduler_t scheduler;
+
+	assert(n_workers >= 1);
+	scheduler.workers = malloc(sizeof(task_worker_t) * n_workers);
+	assert(scheduler.workers != NULL);
+	scheduler.n_workers = n_workers;
+	atomic_init(&scheduler.finished, 0);
+
+	for (int i = 0; i < n_workers; i++) {
+		task_worker_t *worker = &scheduler.workers[i];
+		deque_init(&worker->deque);
+		worker->data = data[i];
+		worker->seed = i + 1;
+		worker->scheduler = &scheduler;
+	}
+
+	// The calling thread is worker 0 and runs the root task.
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+	for (int i = 1; i < n_workers; i++) {
+		task_worker_t *worker = &scheduler.workers[i];
+		int err = pthread_create(&worker->thread, &attr, worker_main, worker);
+		error_assert(err == 0, "cannot create worker thread");
+	}
+	pthread_attr_destroy(&attr);
+
+	root->func = func;
+	atomic_init(&root->done, 0);
+	root->spawned = false;
+	run_task(root, &scheduler.workers[0]);
+
+	atomic_store_explicit(&scheduler.finished, 1, memory_order_release);
+	for (int i = 1; i < n_workers; i++)
+		pthread_join(scheduler.workers[i].thread, NULL);
+	free(scheduler.workers);
+}
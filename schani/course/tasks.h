@@ -0,0 +1,46 @@
+#ifndef __TASKS_H__
+#define __TASKS_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/*
+ * A fork-join scheduler.  A task is spawned onto its worker's deque,
+ * from where idle workers can steal it, and must be joined by the same
+ * worker before the function that spawned it returns, in the reverse
+ * order of spawning.  Tasks usually live on the spawner's C stack.
+ */
+
+typedef struct _task_t task_t;
+typedef struct _task_worker_t task_worker_t;
+
+typedef void (*task_func_t) (task_t *task, task_worker_t *worker);
+
+struct _task_t
+{
+	task_func_t func;
+	atomic_int done;
+	bool spawned;
+};
+
+// Workers don't spawn more tasks while they have this many waiting
+// to be stolen, so that the tasks deep down in a computation, which
+// are usually small, run sequentially.
+#define TASK_MAX_QUEUED		8
+
+void* task_worker_data (task_worker_t *worker);
+
+/*
+ * Queues TASK to run FUNC.  If the worker has enough tasks queued
+ * already it is only marked as not spawned, and task_join runs it.
+ */
+void task_spawn (task_worker_t *worker, task_t *task, task_func_t func);
+
+// Waits until TASK has run, running it right here if no other worker
+// has taken it, and helping with other tasks while waiting.
+void task_join (task_worker_t *worker, task_t *task);
+
+// Runs ROOT on N_WORKERS workers.  Worker I gets DATA[I].
+void task_run (int n_workers, void **data, task_t *root, task_func_t func);
+
+#endif
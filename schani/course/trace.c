@@ -0,0 +1,188 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "x86.h"
+
+/*
+ * The tracing mode of vm_run.  When verified code takes a backward
+ * branch, the target counts as a loop header.  Once a header has been
+ * reached TRACE_HOT times, the next iteration of its loop is run here,
+ * recording the pcs it executes.  If the iteration gets back to the
+ * header without a Call or Return, the JIT compiles the recording into
+ * a native loop, and from then on vm_run runs that whenever it gets to
+ * the header.  The native code returns when a guard fails, i.e. when
+ * the loop ends or takes a path that wasn't recorded, and vm_run goes
+ * on from there.
+ *
+ * Loops that can't be traced are tried a few more times, in case the
+ * first recording took an unusual path, and then given up on.
+ */
+
+#define TRACE_HOT		64
+#define TRACE_MAX_ATTEMPTS	4
+#define TRACE_MAX_LENGTH	1024
+
+typedef int32_t (*trace_code_t) (int64_t *frame);
+
+typedef struct
+{
+	trace_code_t code;
+	size_t size;
+} trace_t;
+
+struct _vm_traces_t
+{
+	const vm_program_t *program;
+	// Per instruction: how often it was reached by a backward branch,
+	// or -1 if it has been given up on.
+	int32_t *counters;
+	uint8_t *attempts;
+	trace_t *traces;
+	int32_t recording[TRACE_MAX_LENGTH];
+};
+
+vm_traces_t*
+vm_traces_new (const vm_program_t *prog)
+{
+	vm_traces_t *traces = malloc(sizeof(vm_traces_t));
+
+	assert(traces != NULL);
+	traces->program = prog;
+	traces->counters = calloc(prog->num_instructions, sizeof(int32_t));
+	traces->attempts = calloc(prog->num_instructions, sizeof(uint8_t));
+	traces->traces = calloc(prog->num_instructions, sizeof(trace_t));
+	assert(traces->counters != NULL && traces->attempts != NULL && traces->traces != NULL);
+	return traces;
+}
+
+void
+vm_traces_free (vm_traces_t *traces)
+{
+	for (int32_t pc = 0; pc < traces->program->num_instructions; pc++) {
+		if (traces->traces[pc].code != NULL)
+			x86_release(traces->traces[pc].code, traces->traces[pc].size);
+	}
+	free(traces->counters);
+	free(traces->attempts);
+	free(traces->traces);
+	free(traces);
+}
+
+/*
+ * Runs one iteration of the loop starting at HEADER, recording the
+ * pcs it executes, and returns the number of them.  If the iteration
+ * can't be traced it stops before the offending instruction, stores
+ * its pc in *PC_OUT and returns 0.
+ */
+static int32_t
+record (vm_traces_t *traces, int64_t *sp, int32_t header, int32_t *pc_out)
+{
+	int32_t pc = header;
+	int32_t n = 0;
+
+	do {
+		vm_ins_t *ins = &traces->program->instructions[pc];
+
+		if (n == TRACE_MAX_LENGTH || ins->opcode == VM_OP_CALL || ins->opcode == VM_OP_RETURN) {
+			*pc_out = pc;
+			return 0;
+		}
+		traces->recording[n++] = pc;
+
+		switch (ins->opcode) {
+			case VM_OP_ADD:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] + sp[ins->args.slot.arg3];
+				break;
+			case VM_OP_SET:
+				sp[ins->args.imm.arg] = ins->args.imm.imm;
+				break;
+			case VM_OP_MOVE:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2];
+				break;
+			case VM_OP_MULTIPLY:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] * sp[ins->args.slot.arg3];
+				break;
+			case VM_OP_NEGATE:
+				sp[ins->args.slot.arg1] = -sp[ins->args.slot.arg2];
+				break;
+			case VM_OP_NOT:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] == 0 ? 1 : 0;
+				break;
+			case VM_OP_LESS_THAN:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] < sp[ins->args.slot.arg3] ? 1 : 0;
+				break;
+			case VM_OP_EQUALS:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] == sp[ins->args.slot.arg3] ? 1 : 0;
+				break;
+			case VM_OP_JUMP:
+				pc = ins->args.slot.arg1;
+				continue;
+			case VM_OP_JUMP_IF_ZERO:
+				if (sp[ins->args.slot.arg1] == 0) {
+					pc = ins->args.slot.arg2;
+					continue;
+				}
+				break;
+			case VM_OP_ADD_IMM:
+				sp[ins->args.imm.arg] = sp[ins->args.imm.arg2] + ins->args.imm.imm;
+				break;
+			case VM_OP_MULTIPLY_IMM:
+				sp[ins->args.imm.arg] = sp[ins->args.imm.arg2] * ins->args.imm.imm;
+				break;
+			case VM_OP_JUMP_IF_NOT_LESS:
+				if (!(sp[ins->args.slot.arg1] < sp[ins->args.slot.arg2])) {
+					pc = ins->args.slot.arg3;
+					continue;
+				}
+				break;
+			case VM_OP_JUMP_IF_NOT_EQUAL:
+				if (sp[ins->args.slot.arg1] != sp[ins->args.slot.arg2]) {
+					pc = ins->args.slot.arg3;
+					continue;
+				}
+				break;
+			case VM_OP_MOVE_MOVE:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2];
+				sp[ins->args.slot.arg3] = sp[ins->args.slot.arg4];
+				break;
+
+			default:
+				assert(false);
+		}
+
+		pc++;
+	} while (pc != header);
+
+	*pc_out = header;
+	return n;
+}
+
+int32_t
+vm_trace_loop (vm_traces_t *traces, int64_t *sp, int32_t header)
+{
+	trace_t *trace = &traces->traces[header];
+
+	if (trace->code != NULL)
+		return trace->code(sp);
+	if (traces->counters[header] < 0 || ++traces->counters[header] < TRACE_HOT)
+		return header;
+
+	int32_t pc;
+	int32_t n = record(traces, sp, header, &pc);
+	if (n > 0)
+		trace->code = (trace_code_t)vm_jit_compile_trace(traces->program, traces->recording, n, &trace->size);
+	if (trace->code != NULL)
+		return trace->code(sp);
+
+	traces->counters[header] = ++traces->attempts[header] < TRACE_MAX_ATTEMPTS ? 0 : -1;
+	return pc;
+}
+
+int64_t
+vm_run_trace (vm_t *vm)
+{
+	if (vm->traces == NULL && vm->program->frame_sizes != NULL)
+		vm->traces = vm_traces_new(vm->program);
+	return vm_run(vm);
+}
@@ -2,7 +2,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "dynarr.h"
 #include "compiler.h"
@@ -20,10 +26,19 @@ vs_load (vm_t *vm, ssize_t rel_slot)
 	return *get_slot(vm, (size_t)(vm->stack_pointer + rel_slot));
 }
 
+static inline void
+mark_used (vm_t *vm, size_t end)
+{
+	if (end > vm->used_slots)
+		vm->used_slots = end;
+}
+
 static inline void
 vs_store (vm_t *vm, ssize_t rel_slot, int64_t value)
 {
-	*get_slot(vm, (size_t)(vm->stack_pointer + rel_slot)) = value;
+	size_t abs_slot = (size_t)(vm->stack_pointer + rel_slot);
+	*get_slot(vm, abs_slot) = value;
+	mark_used(vm, abs_slot + 1);
 }
 
 static inline void
@@ -38,11 +53,15 @@ vs_pop (vm_t *vm, int64_t n_slots)
 	vm->stack_pointer -= n_slots;
 }
 
+// The call stack grows one entry at a time, so the guard page after it
+// catches overflows.
 static inline void
-cs_push (vm_t *vm, int32_t pc)
+cs_push (vm_t *vm, int32_t return_pc, int64_t *stack_pointer, int64_t *dst)
 {
-	assert(vm->call_stack_pointer < vm->call_stack_size);
-	vm->call_stack[vm->call_stack_pointer++] = pc;
+	vm_frame_t *frame = &vm->call_stack[vm->call_stack_pointer++];
+	frame->stack_pointer = stack_pointer;
+	frame->dst = dst;
+	frame->return_pc = return_pc;
 }
 
 static inline bool
@@ -51,24 +70,157 @@ cs_is_empty (vm_t *vm)
 	return vm->call_stack_pointer == 0;
 }
 
-static inline int32_t
+static inline vm_frame_t*
 cs_pop (vm_t *vm)
 {
 	assert(!cs_is_empty(vm));
-	return vm->call_stack[--vm->call_stack_pointer];
+	return &vm->call_stack[--vm->call_stack_pointer];
 }
 
+/*
+ * The value array and the call stack are reserved as ranges of address
+ * space that are only backed by memory where they have been touched,
+ * so they can be large while memory use tracks the actual stack depth.
+ * Each is followed by an inaccessible guard region.  An access to one
+ * is a stack overflow, which the SIGSEGV handler reports.
+ */
+
+#define GUARD_BYTES	((size_t)1 << 20)
+#define MAX_GUARDS	1024
+
+static struct { char *start; char *end; } guards[MAX_GUARDS];
+static volatile int n_guards = 0;
+
+static void
+guard_handler (int sig, siginfo_t *info, void *context)
+{
+	static const char message[] = "Error: VM stack overflow\n";
+	char *addr = info->si_addr;
+
+	for (int i = 0; i < n_guards; i++) {
+		if (addr >= guards[i].start && addr < guards[i].end) {
+			ssize_t written = write(2, message, sizeof(message) - 1);
+			(void)written;
+			_exit(1);
+		}
+	}
+
+	// Not a stack overflow, so crash as usual when the access is
+	// retried.
+	signal(sig, SIG_DFL);
+}
+
+static void
+add_guard (char *start, size_t size)
+{
+	error_assert(n_guards < MAX_GUARDS, "too many VM stacks");
+	guards[n_guards].start = start;
+	guards[n_guards].end = start + size;
+	n_guards++;
+
+	if (n_guards == 1) {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = guard_handler;
+		action.sa_flags = SA_SIGINFO;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGSEGV, &action, NULL);
+	}
+}
+
+static void
+remove_guard (char *start)
+{
+	for (int i = 0; i < n_guards; i++) {
+		if (guards[i].start == start) {
+			guards[i] = guards[n_guards - 1];
+			n_guards--;
+			return;
+		}
+	}
+	assert(false);
+}
+
+static size_t
+round_to_pages (size_t bytes)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	return (bytes + page - 1) / page * page;
+}
+
+void*
+vm_reserve_stack (size_t bytes, bool huge_pages)
+{
+	bytes = round_to_pages(bytes);
+
+	char *start = mmap(NULL, bytes + GUARD_BYTES, PROT_NONE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	error_assert(start != MAP_FAILED, "cannot reserve the VM stack");
+	error_assert(mprotect(start, bytes, PROT_READ | PROT_WRITE) == 0, "cannot reserve the VM stack");
+#ifdef MADV_HUGEPAGE
+	// Only a hint; it's fine if the kernel doesn't do it.
+	if (huge_pages)
+		madvise(start, bytes, MADV_HUGEPAGE);
+#endif
+	add_guard(start + bytes, GUARD_BYTES);
+	return start;
+}
+
+void
+vm_release_stack (void *start, size_t bytes)
+{
+	bytes = round_to_pages(bytes);
+	remove_guard((char*)start + bytes);
+	munmap(start, bytes + GUARD_BYTES);
+}
+
+/*
+ * Sets up a context for running PROG.  Contexts must be set up and
+ * freed while no other context is running, because the guard regions
+ * are shared.
+ */
 void
-vm_init (vm_t *vm, size_t stack_size, size_t call_stack_size)
+vm_init (vm_t *vm, const vm_program_t *prog, size_t stack_size, size_t call_stack_size, bool huge_pages)
 {
-	vm->value_array = calloc(stack_size, sizeof(int64_t));
-	assert(vm->value_array);
+	vm->program = prog;
+
+	vm->value_array = vm_reserve_stack(stack_size * sizeof(int64_t), huge_pages);
 	vm->array_size = stack_size;
 	vm->stack_pointer = 0;
+	vm->used_slots = 0;
 
-	vm->call_stack = calloc(call_stack_size, sizeof(int32_t));
+	vm->call_stack = vm_reserve_stack(call_stack_size * sizeof(vm_frame_t), false);
 	vm->call_stack_size = call_stack_size;
 	vm->call_stack_pointer = 0;
+
+	vm->memo = NULL;
+	vm->threaded_code = NULL;
+	vm->jit = NULL;
+	vm->jit_failed = false;
+	vm->traces = NULL;
+	vm->profile = NULL;
+}
+
+// Gets the context ready for another run, with all slots zero.
+void
+vm_reset (vm_t *vm)
+{
+	memset(vm->value_array, 0, vm->used_slots * sizeof(int64_t));
+	vm->used_slots = 0;
+	vm->stack_pointer = 0;
+	vm->call_stack_pointer = 0;
+}
+
+void
+vm_free (vm_t *vm)
+{
+	vm_release_stack(vm->value_array, vm->array_size * sizeof(int64_t));
+	vm_release_stack(vm->call_stack, vm->call_stack_size * sizeof(vm_frame_t));
+	free(vm->threaded_code);
+	if (vm->jit != NULL)
+		vm_jit_free(vm->jit);
+	if (vm->traces != NULL)
+		vm_traces_free(vm->traces);
 }
 
 static char*
@@ -103,40 +255,132 @@ parse_arg (char **p)
 	return arg;
 }
 
+// Argument kinds: '$' is a slot, 'i' an instruction index, 'n' a
+// number.  Indexed by opcode.
+static struct { const char *name; const char *kinds; } instructions[] = {
+	{ "Move", "$$" },
+	{ "Set", "$n" },
+	{ "Add", "$$$" },
+	{ "Multiply", "$$$" },
+	{ "Negate", "$$" },
+	{ "Not", "$$" },
+	{ "Jump", "i" },
+	{ "JumpIfZero", "$i" },
+	{ "Call", "in$" },
+	{ "Return", "$" },
+	{ "LessThan", "$$$" },
+	{ "Equals", "$$$" },
+	{ "AddImm", "$$n" },
+	{ "MultiplyImm", "$$n" },
+	{ "JumpIfNotLess", "$$i" },
+	{ "JumpIfNotEqual", "$$i" },
+	{ "MoveMove", "$$$$" },
+	{ NULL, NULL }
+};
+
+#define MAX_ARGS	4
+
 static vm_opcode_t
-which_opcode (int len, char *name, int *nargs)
-{
-	static struct { const char *name; int nargs; } instructions[] = {
-		{ "Move", 2 },
-		{ "Set", -1 },
-		{ "Add", 3 },
-		{ "Multiply", 3 },
-		{ "Negate", 2 },
-		{ "Not", 2 },
-		{ "Jump", 1 },
-		{ "JumpIfZero", 2 },
-		{ "Call", 3 },
-		{ "Return", 1 },
-		{ "LessThan", 3 },
-		{ "Equals", 3 },
-		{ NULL, 0 }
-	};
+which_opcode (int len, char *name)
+{
 	for (int i = 0; instructions[i].name != NULL; i++) {
 		if (strlen(instructions[i].name) != len)
 			continue;
-		if (strncmp(name, instructions[i].name, len) == 0) {
-			*nargs = instructions[i].nargs;
+		if (strncmp(name, instructions[i].name, len) == 0)
 			return (vm_opcode_t)i;
-		}
 	}
 	assert(false);
 }
 
+// ARGS are in the order of the instruction's kinds.
+static void
+get_args (vm_ins_t *ins, int64_t args[MAX_ARGS])
+{
+	if (vm_opcode_has_imm(ins->opcode)) {
+		args[0] = ins->args.imm.arg;
+		if (ins->opcode == VM_OP_SET) {
+			args[1] = ins->args.imm.imm;
+		} else {
+			args[1] = ins->args.imm.arg2;
+			args[2] = ins->args.imm.imm;
+		}
+	} else {
+		args[0] = ins->args.slot.arg1;
+		args[1] = ins->args.slot.arg2;
+		args[2] = ins->args.slot.arg3;
+		args[3] = ins->args.slot.arg4;
+	}
+}
+
+// Sets all fields, including the unused ones, so that the padding of
+// the instruction is zero if it was before.
+static void
+set_args (vm_ins_t *ins, int64_t args[MAX_ARGS])
+{
+	if (vm_opcode_has_imm(ins->opcode)) {
+		ins->args.imm.arg = (int32_t)args[0];
+		if (ins->opcode == VM_OP_SET) {
+			ins->args.imm.arg2 = 0;
+			ins->args.imm.imm = args[1];
+		} else {
+			ins->args.imm.arg2 = (int32_t)args[1];
+			ins->args.imm.imm = args[2];
+		}
+	} else {
+		ins->args.slot.arg1 = (int32_t)args[0];
+		ins->args.slot.arg2 = (int32_t)args[1];
+		ins->args.slot.arg3 = (int32_t)args[2];
+		ins->args.slot.arg4 = (int32_t)args[3];
+	}
+}
+
+/*
+ * Maps a file in the binary format and points the VM's instructions
+ * into the mapping.  Returns false if the file is not in the binary
+ * format.
+ */
+static bool
+load_binary (vm_program_t *prog, const char *filename)
+{
+	vm_binary_header_t header;
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+
+	assert(fd >= 0);
+	if (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != VM_BINARY_MAGIC) {
+		close(fd);
+		return false;
+	}
+
+	error_assert(header.version == VM_BINARY_VERSION, "unsupported VM code version");
+	error_assert(header.ins_size == sizeof(vm_ins_t), "VM code was written for a different machine");
+	error_assert(fstat(fd, &st) == 0, "cannot stat VM code file");
+	error_assert(header.instructions_offset % sizeof(int64_t) == 0
+		     && header.instructions_offset + (uint64_t)header.num_instructions * sizeof(vm_ins_t) <= (uint64_t)st.st_size,
+		     "VM code file is truncated or corrupt");
+
+	void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	error_assert(mapping != MAP_FAILED, "cannot map VM code file");
+	close(fd);
+
+	prog->num_instructions = header.num_instructions;
+	prog->instructions = (vm_ins_t*)((char*)mapping + header.instructions_offset);
+	prog->mapping = mapping;
+	return true;
+}
+
 #define LINE_LENGTH 128
 
 void
-vm_load (vm_t *vm, const char *filename)
+vm_load (vm_program_t *prog, const char *filename)
 {
+	prog->mapping = NULL;
+	prog->memo_ids = NULL;
+	prog->names = NULL;
+	prog->frame_sizes = NULL;
+	if (load_binary(prog, filename))
+		return;
+
 	pool_t pool;
 	pool_init(&pool);
 	dynarr_t ins_ptrs;
@@ -148,36 +392,557 @@ vm_load (vm_t *vm, const char *filename)
 		vm_ins_t *ins = pool_alloc(&pool, sizeof(vm_ins_t));
 		char *start = skip(line, "0123456789 \t");
 		char *end = find(start, " \t");
-		int nargs;
-		ins->opcode = which_opcode(end - start, start, &nargs);
-
-		int32_t arg1 = (int32_t)parse_arg(&end);
-		if (nargs == -1) {
-			int64_t imm = parse_arg(&end);
-			ins->args.imm.arg = arg1;
-			ins->args.imm.imm = imm;
-		} else {
-			int32_t arg2 = 0, arg3 = 0;
-			if (nargs >= 2)
-				arg2 = (int32_t)parse_arg(&end);
-			if (nargs >= 3)
-				arg3 = (int32_t)parse_arg(&end);
-			ins->args.slot.arg1 = arg1;
-			ins->args.slot.arg2 = arg2;
-			ins->args.slot.arg3 = arg3;
-		}
+		int64_t args[MAX_ARGS] = { 0, 0, 0, 0 };
+
+		memset(ins, 0, sizeof(vm_ins_t));
+		ins->opcode = which_opcode(end - start, start);
+		for (int i = 0; instructions[ins->opcode].kinds[i] != 0; i++)
+			args[i] = parse_arg(&end);
+		set_args(ins, args);
 
 		dynarr_append(&ins_ptrs, ins);
 	}
 
-	vm->num_instructions = dynarr_length(&ins_ptrs);
-	vm->instructions = malloc(sizeof(vm_ins_t) * vm->num_instructions);
-	for (int i = 0; i < vm->num_instructions; i++)
-		memcpy(&vm->instructions[i], dynarr_nth(&ins_ptrs, i), sizeof(vm_ins_t));
+	prog->num_instructions = dynarr_length(&ins_ptrs);
+	prog->instructions = malloc(sizeof(vm_ins_t) * prog->num_instructions);
+	for (int i = 0; i < prog->num_instructions; i++)
+		memcpy(&prog->instructions[i], dynarr_nth(&ins_ptrs, i), sizeof(vm_ins_t));
 
 	pool_free(&pool);
 }
 
+const char*
+vm_opcode_name (vm_opcode_t opcode)
+{
+	return instructions[opcode].name;
+}
+
+void
+vm_write_ins (const vm_program_t *prog, int32_t pc, FILE *f)
+{
+	vm_ins_t *ins = &prog->instructions[pc];
+	const char *kinds = instructions[ins->opcode].kinds;
+	int64_t args[MAX_ARGS];
+
+	get_args(ins, args);
+	fprintf(f, "%4d %-14s", pc, instructions[ins->opcode].name);
+	for (int i = 0; kinds[i] != 0; i++)
+		fprintf(f, "%s%s%" PRId64, i == 0 ? " " : ", ", kinds[i] == '$' ? "$" : "", args[i]);
+}
+
+void
+vm_write (vm_program_t *prog, FILE *f)
+{
+	for (int32_t pc = 0; pc < prog->num_instructions; pc++) {
+		vm_write_ins(prog, pc, f);
+		fprintf(f, "\n");
+	}
+}
+
+void
+vm_write_binary (vm_program_t *prog, FILE *f)
+{
+	vm_binary_header_t header;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = VM_BINARY_MAGIC;
+	header.version = VM_BINARY_VERSION;
+	header.ins_size = sizeof(vm_ins_t);
+	header.num_instructions = prog->num_instructions;
+	header.instructions_offset = sizeof(header);
+
+	fwrite(&header, sizeof(header), 1, f);
+	for (int32_t pc = 0; pc < prog->num_instructions; pc++) {
+		vm_ins_t *ins = &prog->instructions[pc];
+		vm_ins_t out;
+		int64_t args[MAX_ARGS];
+
+		// Copy field by field so that the padding is zero.
+		memset(&out, 0, sizeof(out));
+		out.opcode = ins->opcode;
+		get_args(ins, args);
+		set_args(&out, args);
+		fwrite(&out, sizeof(out), 1, f);
+	}
+}
+
+/*
+ * Superinstructions.  vm_fuse replaces common pairs of instructions
+ * with single instructions that do the work of both:
+ *
+ *   Set $t, n; Add $d, $s, $t              ->  AddImm $d, $s, n
+ *   Set $t, n; Multiply $d, $s, $t         ->  MultiplyImm $d, $s, n
+ *   LessThan $t, $a, $b; JumpIfZero $t, L  ->  JumpIfNotLess $a, $b, L
+ *   Equals $t, $a, $b; JumpIfZero $t, L    ->  JumpIfNotEqual $a, $b, L
+ *   Move $a, $b; Move $c, $d               ->  MoveMove $a, $b, $c, $d
+ *
+ * A pair is only fused if nothing jumps to its second instruction.  The
+ * fused instructions don't store the temporary $t, so it must not be
+ * read afterwards, which we find out with a liveness analysis over the
+ * slots.
+ */
+
+// Don't do the liveness analysis if its sets would need more words.
+#define MAX_LIVENESS_WORDS	(1 << 22)
+
+typedef struct
+{
+	vm_program_t *prog;
+	int32_t lo, hi;		// the range of slots in the sets
+	int n_words;
+	uint64_t *sets;		// the live-in set of each instruction
+} liveness_t;
+
+static inline uint64_t*
+live_in (liveness_t *lv, int32_t pc)
+{
+	return &lv->sets[(size_t)pc * lv->n_words];
+}
+
+static inline void
+set_live (liveness_t *lv, uint64_t *set, int32_t slot, bool live)
+{
+	int32_t bit = slot - lv->lo;
+	if (live)
+		set[bit / 64] |= (uint64_t)1 << (bit % 64);
+	else
+		set[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+static inline bool
+is_live (liveness_t *lv, uint64_t *set, int32_t slot)
+{
+	int32_t bit = slot - lv->lo;
+	return (set[bit / 64] >> (bit % 64)) & 1;
+}
+
+// Makes all slots below END live.
+static void
+set_live_below (liveness_t *lv, uint64_t *set, int32_t end)
+{
+	for (int32_t slot = lv->lo; slot < end && slot <= lv->hi; slot++)
+		set_live(lv, set, slot, true);
+}
+
+static bool
+falls_through (vm_opcode_t opcode)
+{
+	return opcode != VM_OP_JUMP && opcode != VM_OP_RETURN;
+}
+
+// Returns the jump target of the instruction, or -1.  The callee of a
+// Call is not a successor.
+static int32_t
+jump_target (vm_ins_t *ins)
+{
+	switch (ins->opcode) {
+		case VM_OP_JUMP:
+			return ins->args.slot.arg1;
+		case VM_OP_JUMP_IF_ZERO:
+			return ins->args.slot.arg2;
+		case VM_OP_JUMP_IF_NOT_LESS:
+		case VM_OP_JUMP_IF_NOT_EQUAL:
+			return ins->args.slot.arg3;
+		default:
+			return -1;
+	}
+}
+
+static void
+live_out (liveness_t *lv, int32_t pc, uint64_t *out)
+{
+	vm_ins_t *ins = &lv->prog->instructions[pc];
+	int32_t target = jump_target(ins);
+
+	memset(out, 0, sizeof(uint64_t) * lv->n_words);
+	if (falls_through(ins->opcode) && pc + 1 < lv->prog->num_instructions) {
+		for (int i = 0; i < lv->n_words; i++)
+			out[i] |= live_in(lv, pc + 1)[i];
+	}
+	if (target >= 0) {
+		for (int i = 0; i < lv->n_words; i++)
+			out[i] |= live_in(lv, target)[i];
+	}
+}
+
+// Turns the live-out set SET of the instruction into its live-in set.
+static void
+transfer (liveness_t *lv, vm_ins_t *ins, uint64_t *set)
+{
+	const char *kinds = instructions[ins->opcode].kinds;
+	int64_t args[MAX_ARGS];
+
+	get_args(ins, args);
+	switch (ins->opcode) {
+		case VM_OP_MOVE_MOVE:
+			set_live(lv, set, args[2], false);
+			set_live(lv, set, args[3], true);
+			set_live(lv, set, args[0], false);
+			set_live(lv, set, args[1], true);
+			break;
+		case VM_OP_CALL:
+			// The callee's arguments are the slots below N.
+			set_live(lv, set, args[2], false);
+			set_live_below(lv, set, args[1]);
+			break;
+		case VM_OP_RETURN:
+			// The caller's slots are below 0.
+			memset(set, 0, sizeof(uint64_t) * lv->n_words);
+			set_live_below(lv, set, 0);
+			set_live(lv, set, args[0], true);
+			break;
+		case VM_OP_JUMP:
+		case VM_OP_JUMP_IF_ZERO:
+		case VM_OP_JUMP_IF_NOT_LESS:
+		case VM_OP_JUMP_IF_NOT_EQUAL:
+			for (int i = 0; kinds[i] != 0; i++) {
+				if (kinds[i] == '$')
+					set_live(lv, set, args[i], true);
+			}
+			break;
+		default:
+			// The first argument is the destination.
+			set_live(lv, set, args[0], false);
+			for (int i = 1; kinds[i] != 0; i++) {
+				if (kinds[i] == '$')
+					set_live(lv, set, args[i], true);
+			}
+			break;
+	}
+}
+
+static bool
+liveness_init (liveness_t *lv, vm_program_t *prog)
+{
+	lv->prog = prog;
+	lv->lo = 0;
+	lv->hi = 0;
+	for (int32_t pc = 0; pc < prog->num_instructions; pc++) {
+		vm_ins_t *ins = &prog->instructions[pc];
+		const char *kinds = instructions[ins->opcode].kinds;
+		int64_t args[MAX_ARGS];
+
+		get_args(ins, args);
+		for (int i = 0; kinds[i] != 0; i++) {
+			if (kinds[i] != '$')
+				continue;
+			if (args[i] < lv->lo)
+				lv->lo = args[i];
+			if (args[i] > lv->hi)
+				lv->hi = args[i];
+		}
+	}
+
+	lv->n_words = (lv->hi - lv->lo) / 64 + 1;
+	if ((uint64_t)lv->n_words * prog->num_instructions > MAX_LIVENESS_WORDS)
+		return false;
+	lv->sets = calloc((size_t)lv->n_words * prog->num_instructions, sizeof(uint64_t));
+	assert(lv->sets != NULL);
+
+	uint64_t set[lv->n_words];
+	bool changed;
+	do {
+		changed = false;
+		for (int32_t pc = prog->num_instructions - 1; pc >= 0; pc--) {
+			live_out(lv, pc, set);
+			transfer(lv, &prog->instructions[pc], set);
+			if (memcmp(set, live_in(lv, pc), sizeof(set)) != 0) {
+				memcpy(live_in(lv, pc), set, sizeof(set));
+				changed = true;
+			}
+		}
+	} while (changed);
+	return true;
+}
+
+// Fuses the instructions at PC and PC + 1 into FUSED if possible.  LV is
+// NULL if there is no liveness information.
+static bool
+fuse_pair (vm_program_t *prog, liveness_t *lv, int32_t pc, vm_ins_t *fused)
+{
+	vm_ins_t *a = &prog->instructions[pc];
+	vm_ins_t *b = &prog->instructions[pc + 1];
+
+	memset(fused, 0, sizeof(vm_ins_t));
+	if (a->opcode == VM_OP_MOVE && b->opcode == VM_OP_MOVE) {
+		fused->opcode = VM_OP_MOVE_MOVE;
+		fused->args.slot.arg1 = a->args.slot.arg1;
+		fused->args.slot.arg2 = a->args.slot.arg2;
+		fused->args.slot.arg3 = b->args.slot.arg1;
+		fused->args.slot.arg4 = b->args.slot.arg2;
+		return true;
+	}
+
+	if (lv == NULL)
+		return false;
+	uint64_t out[lv->n_words];
+	live_out(lv, pc + 1, out);
+
+	if (a->opcode == VM_OP_SET && (b->opcode == VM_OP_ADD || b->opcode == VM_OP_MULTIPLY)) {
+		int32_t tmp = a->args.imm.arg;
+		int32_t src;
+
+		if (b->args.slot.arg3 == tmp)
+			src = b->args.slot.arg2;
+		else if (b->args.slot.arg2 == tmp)
+			src = b->args.slot.arg3;
+		else
+			return false;
+		if (src == tmp || (b->args.slot.arg1 != tmp && is_live(lv, out, tmp)))
+			return false;
+
+		fused->opcode = b->opcode == VM_OP_ADD ? VM_OP_ADD_IMM : VM_OP_MULTIPLY_IMM;
+		fused->args.imm.arg = b->args.slot.arg1;
+		fused->args.imm.arg2 = src;
+		fused->args.imm.imm = a->args.imm.imm;
+		return true;
+	}
+
+	if ((a->opcode == VM_OP_LESS_THAN || a->opcode == VM_OP_EQUALS)
+	    && b->opcode == VM_OP_JUMP_IF_ZERO && b->args.slot.arg1 == a->args.slot.arg1) {
+		if (is_live(lv, out, a->args.slot.arg1))
+			return false;
+
+		fused->opcode = a->opcode == VM_OP_LESS_THAN ? VM_OP_JUMP_IF_NOT_LESS : VM_OP_JUMP_IF_NOT_EQUAL;
+		fused->args.slot.arg1 = a->args.slot.arg2;
+		fused->args.slot.arg2 = a->args.slot.arg3;
+		fused->args.slot.arg3 = b->args.slot.arg2;
+		return true;
+	}
+
+	return false;
+}
+
+void
+vm_fuse (vm_program_t *prog)
+{
+	int32_t n = prog->num_instructions;
+
+	// Mapped code can't be changed.  Converting it wrote it fused.
+	if (prog->mapping != NULL || n == 0)
+		return;
+
+	bool *is_target = calloc(n, sizeof(bool));
+	assert(is_target != NULL);
+	for (int32_t pc = 0; pc < n; pc++) {
+		vm_ins_t *ins = &prog->instructions[pc];
+		const char *kinds = instructions[ins->opcode].kinds;
+		int64_t args[MAX_ARGS];
+
+		get_args(ins, args);
+		for (int i = 0; kinds[i] != 0; i++) {
+			if (kinds[i] != 'i')
+				continue;
+			if (args[i] < 0 || args[i] >= n) {
+				// Broken code is left alone.
+				free(is_target);
+				return;
+			}
+			is_target[args[i]] = true;
+		}
+	}
+
+	liveness_t lv;
+	bool have_liveness = liveness_init(&lv, prog);
+
+	vm_ins_t *code = malloc(sizeof(vm_ins_t) * n);
+	int32_t *new_pc = malloc(sizeof(int32_t) * n);
+	assert(code != NULL && new_pc != NULL);
+
+	int32_t m = 0;
+	for (int32_t pc = 0; pc < n; pc++) {
+		new_pc[pc] = m;
+		if (pc + 1 < n && !is_target[pc + 1]
+		    && fuse_pair(prog, have_liveness ? &lv : NULL, pc, &code[m])) {
+			new_pc[pc + 1] = m;
+			pc++;
+		} else {
+			code[m] = prog->instructions[pc];
+		}
+		m++;
+	}
+
+	for (int32_t pc = 0; pc < m; pc++) {
+		vm_ins_t *ins = &code[pc];
+		const char *kinds = instructions[ins->opcode].kinds;
+		int64_t args[MAX_ARGS];
+
+		get_args(ins, args);
+		for (int i = 0; kinds[i] != 0; i++) {
+			if (kinds[i] == 'i')
+				args[i] = new_pc[args[i]];
+		}
+		set_args(ins, args);
+	}
+
+	if (prog->memo_ids != NULL) {
+		int *memo_ids = malloc(sizeof(int) * m);
+		assert(memo_ids != NULL);
+		for (int32_t pc = 0; pc < m; pc++)
+			memo_ids[pc] = -1;
+		for (int32_t pc = 0; pc < n; pc++) {
+			if (prog->memo_ids[pc] >= 0)
+				memo_ids[new_pc[pc]] = prog->memo_ids[pc];
+		}
+		free(prog->memo_ids);
+		prog->memo_ids = memo_ids;
+	}
+
+	if (prog->names != NULL) {
+		const char **names = calloc(m, sizeof(const char*));
+		assert(names != NULL);
+		for (int32_t pc = 0; pc < n; pc++) {
+			if (prog->names[pc] != NULL)
+				names[new_pc[pc]] = prog->names[pc];
+		}
+		free(prog->names);
+		prog->names = names;
+	}
+
+	free(prog->instructions);
+	prog->instructions = code;
+	prog->num_instructions = m;
+	// The code has to be verified again.
+	free(prog->frame_sizes);
+	prog->frame_sizes = NULL;
+
+	if (have_liveness)
+		free(lv.sets);
+	free(new_pc);
+	free(is_target);
+}
+
+/*
+ * The verifier.  Instruction 0 and every Call target start a function,
+ * which consists of the instructions reachable from there without
+ * following calls.  The verifier checks that those instructions are
+ * valid, that their jump and call targets are in the code and that they
+ * don't run off its end, and computes the range of slots each function
+ * uses.  A callee may read below its stack pointer only as far as the
+ * call moved it up, so every slot access stays within the frames on
+ * the stack, and all that remains to be checked at runtime is that
+ * each callee's frame fits.
+ */
+
+#define NUM_OPCODES	((int)(sizeof(instructions) / sizeof(instructions[0])) - 1)
+
+// Finds the range of slots used by the function starting at ENTRY.
+// VISITED must not contain STAMP.  WORK has room for an element per
+// instruction.
+static void
+verify_function (vm_program_t *prog, int32_t entry, int32_t *visited, int32_t stamp, int32_t *work,
+		 int32_t *min_slot, int32_t *max_slot)
+{
+	int32_t n_work = 0;
+
+	*min_slot = 0;
+	*max_slot = -1;
+	work[n_work++] = entry;
+	visited[entry] = stamp;
+	while (n_work > 0) {
+		int32_t pc = work[--n_work];
+		vm_ins_t *ins = &prog->instructions[pc];
+		const char *kinds = instructions[ins->opcode].kinds;
+		int64_t args[MAX_ARGS];
+		int32_t succs[2];
+		int n_succs = 0;
+
+		get_args(ins, args);
+		for (int i = 0; kinds[i] != 0; i++) {
+			if (kinds[i] != '$')
+				continue;
+			if (args[i] < *min_slot)
+				*min_slot = args[i];
+			if (args[i] > *max_slot)
+				*max_slot = args[i];
+		}
+
+		if (jump_target(ins) >= 0)
+			succs[n_succs++] = jump_target(ins);
+		if (falls_through(ins->opcode)) {
+			error_assert(pc + 1 < prog->num_instructions, "VM code runs off its end");
+			succs[n_succs++] = pc + 1;
+		}
+		for (int i = 0; i < n_succs; i++) {
+			if (visited[succs[i]] != stamp) {
+				visited[succs[i]] = stamp;
+				work[n_work++] = succs[i];
+			}
+		}
+	}
+}
+
+/*
+ * Verifies the code and sets the VM's frame sizes.  Code that can't be
+ * verified is rejected with an error.
+ */
+void
+vm_verify (vm_program_t *prog)
+{
+	int32_t n = prog->num_instructions;
+
+	free(prog->frame_sizes);
+	prog->frame_sizes = NULL;
+	error_assert(n > 0, "VM code is empty");
+
+	for (int32_t pc = 0; pc < n; pc++) {
+		vm_ins_t *ins = &prog->instructions[pc];
+		error_assert((unsigned)ins->opcode < NUM_OPCODES, "VM code has an invalid opcode");
+
+		const char *kinds = instructions[ins->opcode].kinds;
+		int64_t args[MAX_ARGS];
+
+		get_args(ins, args);
+		for (int i = 0; kinds[i] != 0; i++) {
+			if (kinds[i] != 'i' || (args[i] >= 0 && args[i] < n))
+				continue;
+			error_assert(ins->opcode != VM_OP_CALL, "VM code calls an entry point outside of the code");
+			error_assert(false, "VM code jumps outside of the code");
+		}
+	}
+
+	int32_t *min_slots = malloc(sizeof(int32_t) * n);
+	int32_t *max_slots = malloc(sizeof(int32_t) * n);
+	int32_t *visited = malloc(sizeof(int32_t) * n);
+	int32_t *work = malloc(sizeof(int32_t) * n);
+	bool *is_entry = calloc(n, sizeof(bool));
+	assert(min_slots != NULL && max_slots != NULL && visited != NULL && work != NULL && is_entry != NULL);
+
+	is_entry[0] = true;
+	for (int32_t pc = 0; pc < n; pc++) {
+		visited[pc] = -1;
+		if (prog->instructions[pc].opcode == VM_OP_CALL)
+			is_entry[prog->instructions[pc].args.slot.arg1] = true;
+	}
+
+	for (int32_t pc = 0; pc < n; pc++) {
+		if (is_entry[pc])
+			verify_function(prog, pc, visited, pc, work, &min_slots[pc], &max_slots[pc]);
+	}
+
+	for (int32_t pc = 0; pc < n; pc++) {
+		vm_ins_t *ins = &prog->instructions[pc];
+		if (ins->opcode != VM_OP_CALL)
+			continue;
+		int32_t n_slots = ins->args.slot.arg2;
+		error_assert(n_slots >= 0, "VM code calls with a negative number of slots");
+		error_assert(min_slots[ins->args.slot.arg1] >= -n_slots,
+			     "VM code reads below the frame of a function");
+	}
+
+	prog->frame_sizes = max_slots;
+	for (int32_t pc = 0; pc < n; pc++) {
+		if (is_entry[pc])
+			prog->frame_sizes[pc] = max_slots[pc] + 1;
+	}
+	prog->entry_args = -min_slots[0];
+
+	free(min_slots);
+	free(visited);
+	free(work);
+	free(is_entry);
+}
+
 void
 vm_push_args (vm_t *vm, int argc, int64_t *args)
 {
@@ -186,14 +951,51 @@ vm_push_args (vm_t *vm, int argc, int64_t *args)
 	vs_push(vm, argc);
 }
 
-int64_t
-vm_run (vm_t *vm)
+/*
+ * Memoized calls.  The arguments of a call are the N slots below the
+ * callee's stack pointer.  Compiled code never assigns to them, so they
+ * are still intact when the callee returns.
+ */
+static bool
+memo_call (vm_t *vm, vm_ins_t *ins)
 {
+	int id = vm->program->memo_ids[ins->args.slot.arg1];
+	int64_t result;
+
+	if (id < 0)
+		return false;
+	int32_t first_arg = ins->args.slot.arg2 - memo_n_args(vm->memo, id);
+	assert(vm->stack_pointer + first_arg >= 0);
+	if (!memo_lookup(vm->memo, id, &vm->value_array[vm->stack_pointer + first_arg], &result))
+		return false;
+	vs_store(vm, ins->args.slot.arg3, result);
+	return true;
+}
+
+// Called on return, before the callee's frame is popped.
+static void
+memo_return (vm_t *vm, vm_ins_t *ins, int64_t result)
+{
+	int id = vm->program->memo_ids[ins->args.slot.arg1];
+
+	if (id < 0)
+		return;
+	int n_args = memo_n_args(vm->memo, id);
+	memo_insert(vm->memo, id, &vm->value_array[vm->stack_pointer - n_args], result);
+}
+
+// Runs code that is not verified, checking every slot access.
+static int64_t
+run_checked (vm_t *vm)
+{
+	vm_profile_t *profile = vm->profile;
 	int64_t tmp, tmp2;
 	int32_t pc = 0;
 
 	for (;;) {
-		vm_ins_t *ins = &vm->instructions[pc];
+		vm_ins_t *ins = &vm->program->instructions[pc];
+		if (profile != NULL)
+			vm_profile_count(profile, pc);
 		switch (ins->opcode) {
 			case VM_OP_ADD:
 				tmp = vs_load(vm, ins->args.slot.arg2) + vs_load(vm, ins->args.slot.arg3);
@@ -202,16 +1004,21 @@ vm_run (vm_t *vm)
 			case VM_OP_SET:
 				vs_store(vm, ins->args.imm.arg, ins->args.imm.imm);
 				break;
-			case VM_OP_RETURN:
+			case VM_OP_RETURN: {
 				tmp = vs_load(vm, ins->args.slot.arg1);
 				if (cs_is_empty(vm))
 					return tmp;
-				pc = cs_pop(vm);
-				ins = &vm->instructions[pc];
-				assert(ins->opcode == VM_OP_CALL);
-				vs_pop(vm, ins->args.slot.arg2);
-				vs_store(vm, ins->args.slot.arg3, tmp);
-				break;
+				if (profile != NULL)
+					vm_profile_return(profile);
+				vm_frame_t *frame = cs_pop(vm);
+				if (vm->program->memo_ids != NULL)
+					memo_return(vm, &vm->program->instructions[frame->return_pc - 1], tmp);
+				vm->stack_pointer = frame->stack_pointer - vm->value_array;
+				*get_slot(vm, frame->dst - vm->value_array) = tmp;
+				mark_used(vm, frame->dst - vm->value_array + 1);
+				pc = frame->return_pc;
+				continue;
+			}
 			case VM_OP_MOVE:
 				tmp = vs_load(vm, ins->args.slot.arg2);
 				vs_store(vm, ins->args.slot.arg1, tmp);
@@ -249,10 +1056,188 @@ vm_run (vm_t *vm)
 				}
 				break;
 			case VM_OP_CALL:
-				cs_push(vm, pc);
+				if (vm->program->memo_ids != NULL && memo_call(vm, ins))
+					break;
+				if (profile != NULL)
+					vm_profile_call(profile, ins->args.slot.arg1);
+				cs_push(vm, pc + 1, vm->value_array + vm->stack_pointer,
+					vm->value_array + vm->stack_pointer + ins->args.slot.arg3);
 				vs_push(vm, ins->args.slot.arg2);
 				pc = ins->args.slot.arg1;
 				continue;
+			case VM_OP_ADD_IMM:
+				tmp = vs_load(vm, ins->args.imm.arg2) + ins->args.imm.imm;
+				vs_store(vm, ins->args.imm.arg, tmp);
+				break;
+			case VM_OP_MULTIPLY_IMM:
+				tmp = vs_load(vm, ins->args.imm.arg2) * ins->args.imm.imm;
+				vs_store(vm, ins->args.imm.arg, tmp);
+				break;
+			case VM_OP_JUMP_IF_NOT_LESS:
+				if (!(vs_load(vm, ins->args.slot.arg1) < vs_load(vm, ins->args.slot.arg2))) {
+					pc = ins->args.slot.arg3;
+					continue;
+				}
+				break;
+			case VM_OP_JUMP_IF_NOT_EQUAL:
+				if (vs_load(vm, ins->args.slot.arg1) != vs_load(vm, ins->args.slot.arg2)) {
+					pc = ins->args.slot.arg3;
+					continue;
+				}
+				break;
+			case VM_OP_MOVE_MOVE:
+				vs_store(vm, ins->args.slot.arg1, vs_load(vm, ins->args.slot.arg2));
+				vs_store(vm, ins->args.slot.arg3, vs_load(vm, ins->args.slot.arg4));
+				break;
+
+			default:
+				assert(false);
+				return 0;
+		}
+
+		pc++;
+	}
+}
+
+// The only stack checks verified code needs.  Call stack overflows hit
+// its guard region.
+static void
+check_entry (vm_t *vm)
+{
+	size_t end = vm->stack_pointer + vm->program->frame_sizes[0];
+
+	error_assert(vm->stack_pointer >= (size_t)vm->program->entry_args, "not enough arguments for the VM code");
+	error_assert(end <= vm->array_size, "VM stack overflow");
+	mark_used(vm, end);
+}
+
+static inline void
+check_call (vm_t *vm, size_t callee_sp, int32_t entry)
+{
+	size_t end = callee_sp + vm->program->frame_sizes[entry];
+
+	error_assert(end <= vm->array_size, "VM stack overflow");
+	mark_used(vm, end);
+}
+
+// Backward branches go to loop headers, where the tracing mode might
+// have native code to run.
+#define BRANCH(target)	do {								\
+		int32_t target_ = (target);						\
+		pc = traces != NULL && target_ <= pc ? vm_trace_loop(traces, sp, target_) : target_; \
+	} while (0)
+
+/*
+ * Runs verified code.  Slots are accessed without checks through SP,
+ * and FP points to the next free call stack entry.  The VM's stack
+ * pointer is only brought up to date for the memo functions.
+ */
+static int64_t
+run_verified (vm_t *vm)
+{
+	int64_t *sp = vm->value_array + vm->stack_pointer;
+	vm_frame_t *fp = vm->call_stack + vm->call_stack_pointer;
+	vm_traces_t *traces = vm->traces;
+	vm_profile_t *profile = vm->profile;
+	int64_t tmp;
+	int32_t pc = 0;
+
+	check_entry(vm);
+	for (;;) {
+		vm_ins_t *ins = &vm->program->instructions[pc];
+		if (profile != NULL)
+			vm_profile_count(profile, pc);
+		switch (ins->opcode) {
+			case VM_OP_ADD:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] + sp[ins->args.slot.arg3];
+				break;
+			case VM_OP_SET:
+				sp[ins->args.imm.arg] = ins->args.imm.imm;
+				break;
+			case VM_OP_RETURN: {
+				tmp = sp[ins->args.slot.arg1];
+				if (fp == vm->call_stack) {
+					vm->stack_pointer = sp - vm->value_array;
+					vm->call_stack_pointer = 0;
+					return tmp;
+				}
+				if (profile != NULL)
+					vm_profile_return(profile);
+				fp--;
+				if (vm->program->memo_ids != NULL) {
+					vm->stack_pointer = sp - vm->value_array;
+					memo_return(vm, &vm->program->instructions[fp->return_pc - 1], tmp);
+				}
+				sp = fp->stack_pointer;
+				*fp->dst = tmp;
+				pc = fp->return_pc;
+				continue;
+			}
+			case VM_OP_MOVE:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2];
+				break;
+			case VM_OP_MULTIPLY:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] * sp[ins->args.slot.arg3];
+				break;
+			case VM_OP_NEGATE:
+				sp[ins->args.slot.arg1] = -sp[ins->args.slot.arg2];
+				break;
+			case VM_OP_NOT:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] == 0 ? 1 : 0;
+				break;
+			case VM_OP_LESS_THAN:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] < sp[ins->args.slot.arg3] ? 1 : 0;
+				break;
+			case VM_OP_EQUALS:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2] == sp[ins->args.slot.arg3] ? 1 : 0;
+				break;
+			case VM_OP_JUMP:
+				BRANCH(ins->args.slot.arg1);
+				continue;
+			case VM_OP_JUMP_IF_ZERO:
+				if (sp[ins->args.slot.arg1] == 0) {
+					BRANCH(ins->args.slot.arg2);
+					continue;
+				}
+				break;
+			case VM_OP_CALL:
+				if (vm->program->memo_ids != NULL) {
+					vm->stack_pointer = sp - vm->value_array;
+					if (memo_call(vm, ins))
+						break;
+				}
+				if (profile != NULL)
+					vm_profile_call(profile, ins->args.slot.arg1);
+				check_call(vm, (sp - vm->value_array) + ins->args.slot.arg2, ins->args.slot.arg1);
+				fp->stack_pointer = sp;
+				fp->dst = sp + ins->args.slot.arg3;
+				fp->return_pc = pc + 1;
+				fp++;
+				sp += ins->args.slot.arg2;
+				pc = ins->args.slot.arg1;
+				continue;
+			case VM_OP_ADD_IMM:
+				sp[ins->args.imm.arg] = sp[ins->args.imm.arg2] + ins->args.imm.imm;
+				break;
+			case VM_OP_MULTIPLY_IMM:
+				sp[ins->args.imm.arg] = sp[ins->args.imm.arg2] * ins->args.imm.imm;
+				break;
+			case VM_OP_JUMP_IF_NOT_LESS:
+				if (!(sp[ins->args.slot.arg1] < sp[ins->args.slot.arg2])) {
+					BRANCH(ins->args.slot.arg3);
+					continue;
+				}
+				break;
+			case VM_OP_JUMP_IF_NOT_EQUAL:
+				if (sp[ins->args.slot.arg1] != sp[ins->args.slot.arg2]) {
+					BRANCH(ins->args.slot.arg3);
+					continue;
+				}
+				break;
+			case VM_OP_MOVE_MOVE:
+				sp[ins->args.slot.arg1] = sp[ins->args.slot.arg2];
+				sp[ins->args.slot.arg3] = sp[ins->args.slot.arg4];
+				break;
 
 			default:
 				assert(false);
@@ -263,6 +1248,212 @@ vm_run (vm_t *vm)
 	}
 }
 
+#undef BRANCH
+
+int64_t
+vm_run (vm_t *vm)
+{
+	if (vm->program->frame_sizes != NULL)
+		return run_verified(vm);
+	return run_checked(vm);
+}
+
+#ifdef __GNUC__
+typedef struct _vm_threaded_ins_t
+{
+	const void *handler;
+	int32_t arg1;
+	int32_t arg2;
+	int32_t arg3;
+	int32_t arg4;
+	union {
+		int64_t imm;
+		struct _vm_threaded_ins_t *target;
+	} v;
+} vm_threaded_ins_t;
+
+static vm_threaded_ins_t*
+translate_threaded (const vm_program_t *prog, const void **handlers)
+{
+	vm_threaded_ins_t *code = malloc(sizeof(vm_threaded_ins_t) * prog->num_instructions);
+	assert(code != NULL);
+
+	for (int32_t pc = 0; pc < prog->num_instructions; pc++) {
+		vm_ins_t *ins = &prog->instructions[pc];
+		vm_threaded_ins_t *t = &code[pc];
+
+		t->handler = handlers[ins->opcode];
+		if (vm_opcode_has_imm(ins->opcode)) {
+			t->arg1 = ins->args.imm.arg;
+			t->arg2 = ins->args.imm.arg2;
+			t->v.imm = ins->args.imm.imm;
+			continue;
+		}
+
+		t->arg1 = ins->args.slot.arg1;
+		t->arg2 = ins->args.slot.arg2;
+		t->arg3 = ins->args.slot.arg3;
+		t->arg4 = ins->args.slot.arg4;
+		switch (ins->opcode) {
+			case VM_OP_JUMP:
+			case VM_OP_CALL:
+				t->v.target = &code[t->arg1];
+				break;
+			case VM_OP_JUMP_IF_ZERO:
+				t->v.target = &code[t->arg2];
+				break;
+			case VM_OP_JUMP_IF_NOT_LESS:
+			case VM_OP_JUMP_IF_NOT_EQUAL:
+				t->v.target = &code[t->arg3];
+				break;
+			default:
+				break;
+		}
+	}
+	return code;
+}
+
+/*
+ * Like vm_run, but first translates the instructions into a stream of
+ * handler addresses, so that each instruction jumps directly to the
+ * next one's handler.  The stack pointer is kept in a local variable.
+ * Only verified code is run here, so the stack is only checked on
+ * calls.  Programs with memoized functions are handed to vm_run.
+ */
+int64_t
+vm_run_threaded (vm_t *vm)
+{
+	static const void *handlers[] = {
+		[VM_OP_MOVE] = &&op_move,
+		[VM_OP_SET] = &&op_set,
+		[VM_OP_ADD] = &&op_add,
+		[VM_OP_MULTIPLY] = &&op_multiply,
+		[VM_OP_NEGATE] = &&op_negate,
+		[VM_OP_NOT] = &&op_not,
+		[VM_OP_JUMP] = &&op_jump,
+		[VM_OP_JUMP_IF_ZERO] = &&op_jump_if_zero,
+		[VM_OP_CALL] = &&op_call,
+		[VM_OP_RETURN] = &&op_return,
+		[VM_OP_LESS_THAN] = &&op_less_than,
+		[VM_OP_EQUALS] = &&op_equals,
+		[VM_OP_ADD_IMM] = &&op_add_imm,
+		[VM_OP_MULTIPLY_IMM] = &&op_multiply_imm,
+		[VM_OP_JUMP_IF_NOT_LESS] = &&op_jump_if_not_less,
+		[VM_OP_JUMP_IF_NOT_EQUAL] = &&op_jump_if_not_equal,
+		[VM_OP_MOVE_MOVE] = &&op_move_move
+	};
+
+	// Only vm_run does memoization and profiling, and checks unverified
+	// code.
+	if (vm->program->memo_ids != NULL || vm->program->frame_sizes == NULL || vm->profile != NULL)
+		return vm_run(vm);
+
+	vm_threaded_ins_t *code = vm->threaded_code;
+	if (code == NULL)
+		vm->threaded_code = code = translate_threaded(vm->program, handlers);
+
+	int64_t *sp = vm->value_array + vm->stack_pointer;
+	vm_frame_t *fp = vm->call_stack + vm->call_stack_pointer;
+	vm_threaded_ins_t *ip = code;
+	int64_t result;
+
+	check_entry(vm);
+
+#define DISPATCH()	goto *ip->handler
+#define NEXT()		do { ip++; DISPATCH(); } while (0)
+
+	DISPATCH();
+
+op_move:
+	sp[ip->arg1] = sp[ip->arg2];
+	NEXT();
+op_set:
+	sp[ip->arg1] = ip->v.imm;
+	NEXT();
+op_add:
+	sp[ip->arg1] = sp[ip->arg2] + sp[ip->arg3];
+	NEXT();
+op_multiply:
+	sp[ip->arg1] = sp[ip->arg2] * sp[ip->arg3];
+	NEXT();
+op_negate:
+	sp[ip->arg1] = -sp[ip->arg2];
+	NEXT();
+op_not:
+	sp[ip->arg1] = sp[ip->arg2] == 0 ? 1 : 0;
+	NEXT();
+op_less_than:
+	sp[ip->arg1] = sp[ip->arg2] < sp[ip->arg3] ? 1 : 0;
+	NEXT();
+op_equals:
+	sp[ip->arg1] = sp[ip->arg2] == sp[ip->arg3] ? 1 : 0;
+	NEXT();
+op_add_imm:
+	sp[ip->arg1] = sp[ip->arg2] + ip->v.imm;
+	NEXT();
+op_multiply_imm:
+	sp[ip->arg1] = sp[ip->arg2] * ip->v.imm;
+	NEXT();
+op_move_move:
+	sp[ip->arg1] = sp[ip->arg2];
+	sp[ip->arg3] = sp[ip->arg4];
+	NEXT();
+op_jump:
+	ip = ip->v.target;
+	DISPATCH();
+op_jump_if_zero:
+	if (sp[ip->arg1] == 0) {
+		ip = ip->v.target;
+		DISPATCH();
+	}
+	NEXT();
+op_jump_if_not_less:
+	if (!(sp[ip->arg1] < sp[ip->arg2])) {
+		ip = ip->v.target;
+		DISPATCH();
+	}
+	NEXT();
+op_jump_if_not_equal:
+	if (sp[ip->arg1] != sp[ip->arg2]) {
+		ip = ip->v.target;
+		DISPATCH();
+	}
+	NEXT();
+op_call:
+	check_call(vm, (sp - vm->value_array) + ip->arg2, ip->arg1);
+	fp->stack_pointer = sp;
+	fp->dst = sp + ip->arg3;
+	fp->return_pc = (int32_t)(ip - code) + 1;
+	fp++;
+	sp += ip->arg2;
+	ip = ip->v.target;
+	DISPATCH();
+op_return:
+	result = sp[ip->arg1];
+	if (fp == vm->call_stack)
+		goto done;
+	fp--;
+	*fp->dst = result;
+	sp = fp->stack_pointer;
+	ip = &code[fp->return_pc];
+	DISPATCH();
+
+#undef DISPATCH
+#undef NEXT
+
+done:
+	vm->stack_pointer = sp - vm->value_array;
+	vm->call_stack_pointer = 0;
+	return result;
+}
+#else
+int64_t
+vm_run_threaded (vm_t *vm)
+{
+	return vm_run(vm);
+}
+#endif
+
 #define N 1024
 #define M 32
 
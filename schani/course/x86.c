@@ -0,0 +1,276 @@
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "x86.h"
+
+void
+x86_init (x86_buf_t *buf)
+{
+	buf->size = 0;
+	buf->capacity = 4096;
+	buf->code = malloc(buf->capacity);
+	assert(buf->code != NULL);
+}
+
+void
+x86_free (x86_buf_t *buf)
+{
+	free(buf->code);
+	buf->code = NULL;
+}
+
+void
+x86_byte (x86_buf_t *buf, uint8_t b)
+{
+	if (buf->size >= buf->capacity) {
+		buf->capacity *= 2;
+		buf->code = realloc(buf->code, buf->capacity);
+		assert(buf->code != NULL);
+	}
+	buf->code[buf->size++] = b;
+}
+
+void
+x86_int32 (x86_buf_t *buf, int32_t i)
+{
+	uint32_t u = (uint32_t)i;
+	for (int k = 0; k < 4; k++)
+		x86_byte(buf, (u >> (8 * k)) & 0xff);
+}
+
+void
+x86_patch_rel32 (x86_buf_t *buf, size_t at, size_t target)
+{
+	int64_t rel = (int64_t)target - (int64_t)(at + 4);
+	uint32_t u = (uint32_t)(int32_t)rel;
+
+	assert(x86_fits_int32(rel));
+	for (int k = 0; k < 4; k++)
+		buf->code[at + k] = (u >> (8 * k)) & 0xff;
+}
+
+/*
+ * Copies the code into freshly mapped executable memory and frees the
+ * buffer.  Returns NULL if the memory can't be mapped.
+ */
+void*
+x86_finish (x86_buf_t *buf, size_t *size)
+{
+	void *code = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		x86_free(buf);
+		return NULL;
+	}
+	memcpy(code, buf->code, buf->size);
+	if (mprotect(code, buf->size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(code, buf->size);
+		x86_free(buf);
+		return NULL;
+	}
+	*size = buf->size;
+	x86_free(buf);
+	return code;
+}
+
+void
+x86_release (void *code, size_t size)
+{
+	munmap(code, size);
+}
+
+static void
+rex (x86_buf_t *buf, bool w, int reg, int rm)
+{
+	uint8_t r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+	if (r != 0x40)
+		x86_byte(buf, r);
+}
+
+// Emits the ModRM byte (and SIB and displacement) for REG and the
+// register or memory operand RM.
+static void
+modrm (x86_buf_t *buf, int reg, x86_operand_t rm)
+{
+	if (rm.is_reg) {
+		x86_byte(buf, 0xc0 | ((reg & 7) << 3) | (rm.reg & 7));
+		return;
+	}
+
+	bool disp8 = rm.disp >= -128 && rm.disp <= 127;
+	int mod = disp8 ? 1 : 2;
+
+	x86_byte(buf, (mod << 6) | ((reg & 7) << 3) | (rm.reg & 7));
+	if ((rm.reg & 7) == X86_RSP)
+		x86_byte(buf, 0x24);
+	if (disp8)
+		x86_byte(buf, (uint8_t)(int8_t)rm.disp);
+	else
+		x86_int32(buf, rm.disp);
+}
+
+// A 64-bit instruction with one or two opcode bytes.
+static void
+op_rm (x86_buf_t *buf, int opcode, int reg, x86_operand_t rm)
+{
+	rex(buf, true, reg, rm.reg);
+	if (opcode > 0xff)
+		x86_byte(buf, opcode >> 8);
+	x86_byte(buf, opcode & 0xff);
+	modrm(buf, reg, rm);
+}
+
+void
+x86_mov (x86_buf_t *buf, x86_operand_t dst, x86_operand_t src)
+{
+	assert(dst.is_reg || src.is_reg);
+	if (dst.is_reg && src.is_reg && dst.reg == src.reg)
+		return;
+	if (src.is_reg)
+		op_rm(buf, 0x89, src.reg, dst);
+	else
+		op_rm(buf, 0x8b, dst.reg, src);
+}
+
+void
+x86_mov_imm (x86_buf_t *buf, x86_operand_t dst, int64_t imm)
+{
+	if (x86_fits_int32(imm)) {
+		op_rm(buf, 0xc7, 0, dst);
+		x86_int32(buf, (int32_t)imm);
+	} else if (dst.is_reg) {
+		rex(buf, true, 0, dst.reg);
+		x86_byte(buf, 0xb8 | (dst.reg & 7));
+		x86_int32(buf, (int32_t)(uint32_t)imm);
+		x86_int32(buf, (int32_t)(uint32_t)((uint64_t)imm >> 32));
+	} else {
+		x86_mov_imm(buf, x86_reg(X86_RAX), imm);
+		x86_mov(buf, dst, x86_reg(X86_RAX));
+	}
+}
+
+void
+x86_lea (x86_buf_t *buf, x86_reg_t dst, x86_operand_t src)
+{
+	assert(!src.is_reg);
+	op_rm(buf, 0x8d, dst, src);
+}
+
+void
+x86_add (x86_buf_t *buf, x86_reg_t dst, x86_operand_t src)
+{
+	op_rm(buf, 0x03, dst, src);
+}
+
+void
+x86_sub (x86_buf_t *buf, x86_reg_t dst, x86_operand_t src)
+{
+	op_rm(buf, 0x2b, dst, src);
+}
+
+void
+x86_imul (x86_buf_t *buf, x86_reg_t dst, x86_operand_t src)
+{
+	op_rm(buf, 0x0faf, dst, src);
+}
+
+void
+x86_cmp (x86_buf_t *buf, x86_reg_t left, x86_operand_t right)
+{
+	op_rm(buf, 0x3b, left, right);
+}
+
+void
+x86_cmp_imm (x86_buf_t *buf, x86_operand_t left, int32_t imm)
+{
+	if (imm >= -128 && imm <= 127) {
+		op_rm(buf, 0x83, 7, left);
+		x86_byte(buf, (uint8_t)(int8_t)imm);
+	} else {
+		op_rm(buf, 0x81, 7, left);
+		x86_int32(buf, imm);
+	}
+}
+
+void
+x86_add_imm (x86_buf_t *buf, x86_operand_t dst, int32_t imm)
+{
+	if (imm >= -128 && imm <= 127) {
+		op_rm(buf, 0x83, 0, dst);
+		x86_byte(buf, (uint8_t)(int8_t)imm);
+	} else {
+		op_rm(buf, 0x81, 0, dst);
+		x86_int32(buf, imm);
+	}
+}
+
+void
+x86_neg (x86_buf_t *buf, x86_operand_t dst)
+{
+	op_rm(buf, 0xf7, 3, dst);
+}
+
+void
+x86_test (x86_buf_t *buf, x86_reg_t left, x86_reg_t right)
+{
+	op_rm(buf, 0x85, right, x86_reg(left));
+}
+
+// Sets RAX to 1 if the condition holds, otherwise to 0.
+void
+x86_setcc_rax (x86_buf_t *buf, x86_cc_t cc)
+{
+	// setcc al
+	x86_byte(buf, 0x0f);
+	x86_byte(buf, 0x90 | cc);
+	x86_byte(buf, 0xc0);
+	// movzx eax, al
+	x86_byte(buf, 0x0f);
+	x86_byte(buf, 0xb6);
+	x86_byte(buf, 0xc0);
+}
+
+void
+x86_push (x86_buf_t *buf, x86_reg_t reg)
+{
+	rex(buf, false, 0, reg);
+	x86_byte(buf, 0x50 | (reg & 7));
+}
+
+void
+x86_pop (x86_buf_t *buf, x86_reg_t reg)
+{
+	rex(buf, false, 0, reg);
+	x86_byte(buf, 0x58 | (reg & 7));
+}
+
+void
+x86_ret (x86_buf_t *buf)
+{
+	x86_byte(buf, 0xc3);
+}
+
+size_t
+x86_jmp (x86_buf_t *buf)
+{
+	x86_byte(buf, 0xe9);
+	x86_int32(buf, 0);
+	return buf->size - 4;
+}
+
+size_t
+x86_jcc (x86_buf_t *buf, x86_cc_t cc)
+{
+	x86_byte(buf, 0x0f);
+	x86_byte(buf, 0x80 | cc);
+	x86_int32(buf, 0);
+	return buf->size - 4;
+}
+
+size_t
+x86_call (x86_buf_t *buf)
+{
+	x86_byte(buf, 0xe8);
+	x86_int32(buf, 0);
+	return buf->size - 4;
+}
@@ -0,0 +1,93 @@
+#ifndef __X86_H__
+#define __X86_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef enum {
+	X86_RAX, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI, X86_RDI,
+	X86_R8, X86_R9, X86_R10, X86_R11, X86_R12, X86_R13, X86_R14, X86_R15
+} x86_reg_t;
+
+typedef enum {
+	X86_CC_B = 0x2,
+	X86_CC_E = 0x4,
+	X86_CC_NE = 0x5,
+	X86_CC_BE = 0x6,
+	X86_CC_A = 0x7,
+	X86_CC_L = 0xc,
+	X86_CC_GE = 0xd
+} x86_cc_t;
+
+// Either a register or a memory operand [base + disp].
+typedef struct {
+	bool is_reg;
+	x86_reg_t reg;
+	int32_t disp;
+} x86_operand_t;
+
+typedef struct {
+	uint8_t *code;
+	size_t size;
+	size_t capacity;
+} x86_buf_t;
+
+static inline x86_operand_t
+x86_reg (x86_reg_t reg)
+{
+	x86_operand_t op = { true, reg, 0 };
+	return op;
+}
+
+static inline x86_operand_t
+x86_mem (x86_reg_t base, int32_t disp)
+{
+	x86_operand_t op = { false, base, disp };
+	return op;
+}
+
+void x86_init (x86_buf_t *buf);
+void x86_free (x86_buf_t *buf);
+void x86_byte (x86_buf_t *buf, uint8_t b);
+void x86_int32 (x86_buf_t *buf, int32_t i);
+void x86_patch_rel32 (x86_buf_t *buf, size_t at, size_t target);
+
+void* x86_finish (x86_buf_t *buf, size_t *size);
+void x86_release (void *code, size_t size);
+
+void x86_mov (x86_buf_t *buf, x86_operand_t dst, x86_operand_t src);
+void x86_mov_imm (x86_buf_t *buf, x86_operand_t dst, int64_t imm);
+void x86_lea (x86_buf_t *buf, x86_reg_t dst, x86_operand_t src);
+void x86_add (x86_buf_t *buf, x86_reg_t dst, x86_operand_t src);
+void x86_sub (x86_buf_t *buf, x86_reg_t dst, x86_operand_t src);
+void x86_imul (x86_buf_t *buf, x86_reg_t dst, x86_operand_t src);
+void x86_cmp (x86_buf_t *buf, x86_reg_t left, x86_operand_t right);
+void x86_cmp_imm (x86_buf_t *buf, x86_operand_t left, int32_t imm);
+void x86_add_imm (x86_buf_t *buf, x86_operand_t dst, int32_t imm);
+void x86_neg (x86_buf_t *buf, x86_operand_t dst);
+void x86_test (x86_buf_t *buf, x86_reg_t left, x86_reg_t right);
+void x86_setcc_rax (x86_buf_t *buf, x86_cc_t cc);
+void x86_push (x86_buf_t *buf, x86_reg_t reg);
+void x86_pop (x86_buf_t *buf, x86_reg_t reg);
+void x86_ret (x86_buf_t *buf);
+
+// These return the offset of the rel32 field, to be patched with
+// x86_patch_rel32.
+size_t x86_jmp (x86_buf_t *buf);
+size_t x86_jcc (x86_buf_t *buf, x86_cc_t cc);
+size_t x86_call (x86_buf_t *buf);
+
+static inline size_t
+x86_offset (x86_buf_t *buf)
+{
+	return buf->size;
+}
+
+static inline bool
+x86_fits_int32 (int64_t i)
+{
+	return i >= INT32_MIN && i <= INT32_MAX;
+}
+
+#endif
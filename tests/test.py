@@ -38,25 +38,49 @@ flags = sys.argv [3:]
 def run_exe(sl, args):
     return subprocess.check_output ([exe] + flags + [sl] + [str (x) for x in args], universal_newlines=True)
 
+# Runs the program without arguments, expecting it to fail.  Returns
+# the first line of its error output.
+def run_exe_error(sl):
+    p = subprocess.run ([exe] + flags + [sl], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+    if p.returncode == 0:
+        return None
+    return (p.stderr.splitlines () or [''])[0]
+
+def find_program(fn_base):
+    for d in [test_dir, os.path.join (tests_dir, '..', 'examples')]:
+        for ext in ['.sl', '.sbc']:
+            path = os.path.join (d, fn_base + ext)
+            if os.path.isfile (path):
+                return path
+    print("Error: Cannot find SL file for test %s" % fn_base)
+    return None
+
 for fn in [os.path.join (test_dir, n) for n in os.listdir (test_dir)]:
     if not os.path.isfile (fn):
         continue
     is_outfile = False
+    is_errfile = False
     if fn.endswith ('.tests'):
         fn_base = os.path.basename (fn) [:-6]
     elif fn.endswith ('.out'):
         fn_base = os.path.basename (fn) [:-4]
         is_outfile = True
+    elif fn.endswith ('.err'):
+        fn_base = os.path.basename (fn) [:-4]
+        is_errfile = True
     else:
         continue
-    sl_name = '%s.sl' % fn_base
-    sl_path = os.path.join (test_dir, sl_name)
-    if not os.path.isfile (sl_path):
-        sl_path = os.path.join (tests_dir, '..', 'examples', sl_name)
-        if not os.path.isfile (sl_path):
-            print("Error: Cannot find SL file for test %s" % fn_base)
+    sl_path = find_program (fn_base)
     print(fn_base)
-    if is_outfile:
+    if is_errfile:
+        with open(fn, 'r') as f:
+            expected = f.read().strip()
+        num_tests += 1
+        result = run_exe_error(sl_path)
+        if result != expected:
+            print("Failure on %s: expected error\n\n%s\n\ngot\n\n%s\n" % (fn_base, expected, result))
+            failed_tests += 1
+    elif is_outfile:
         with open(fn, 'r') as f:
             expected = f.read()
         num_tests += 1